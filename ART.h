@@ -7,15 +7,25 @@
 #pragma once
 
 #include <assert.h>
-#include <emmintrin.h>  // x86 SSE intrinsics
-#include <stdint.h>     // integer types
+#include <stdint.h>  // integer types
 #include <stdio.h>
 #include <stdlib.h>    // malloc, free
 #include <string.h>    // memset, memcpy
 #include <sys/time.h>  // gettime
 
 #include <algorithm>  // std::random_shuffle
+#include <atomic>
 #include <chrono>
+#include <memory>
+#include <new>  // placement new
+#include <thread>
+#include <type_traits>  // std::is_integral
+#include <utility>      // std::pair
+#include <vector>
+
+#include "Allocator.h"
+#include "BloomFilter.h"
+#include "Simd.h"
 
 namespace ART {
 
@@ -27,25 +37,41 @@ static const int8_t NodeType256 = 3;
 
 // The maximum prefix length for compressed paths stored in the
 // header, if the path is longer it is loaded from the database on
-// demand
+// demand (or kept out-of-line, see StoredPrefixes)
 static const unsigned maxPrefixLength = 9;
 
+// Alignment of inner nodes. ART_CACHE_LINE_NODES aligns every node to a
+// cache line, so the header and keys of Node4/16 and the whole of Node4 are
+// read with one line fill, at the cost of padding node sizes to 64 bytes.
+#if defined(ART_CACHE_LINE_NODES)
+static const size_t nodeAlignment = 64;
+#else
+static const size_t nodeAlignment = 8;
+#endif
+
 // Shared header of all inner nodes
-struct ArtNode {
+struct alignas(nodeAlignment) ArtNode {
     // length of the compressed path (prefix)
     uint32_t prefixLength;
+    // version lock of the concurrent variants (ARTOLC.h), unused otherwise;
+    // it fits in what was padding in front of the Node4 children
+    uint32_t version;
     // number of non-null children
     uint16_t count;
     // node type
     int8_t type;
-    // compressed path (prefix)
+    // compressed path (prefix); a longer prefix kept out-of-line stores
+    // the pointer to its bytes here instead
     uint8_t prefix[maxPrefixLength];
 
-    ArtNode(int8_t type) : prefixLength(0), count(0), type(type) {}
+    ArtNode(int8_t type)
+        : prefixLength(0), version(0), count(0), type(type) {}
 };
 
 // Node with up to 4 children
 struct Node4 : ArtNode {
+    static const int8_t nodeType = NodeType4;
+
     uint8_t key[4];
     ArtNode* child[4];
 
@@ -57,6 +83,8 @@ struct Node4 : ArtNode {
 
 // Node with up to 16 children
 struct Node16 : ArtNode {
+    static const int8_t nodeType = NodeType16;
+
     uint8_t key[16];
     ArtNode* child[16];
 
@@ -70,6 +98,8 @@ static const uint8_t emptyMarker = 48;
 
 // Node with up to 48 children
 struct Node48 : ArtNode {
+    static const int8_t nodeType = NodeType48;
+
     uint8_t childIndex[256];
     ArtNode* child[48];
 
@@ -81,11 +111,239 @@ struct Node48 : ArtNode {
 
 // Node with up to 256 children
 struct Node256 : ArtNode {
+    static const int8_t nodeType = NodeType256;
+
     ArtNode* child[256];
 
     Node256() : ArtNode(NodeType256) { memset(child, 0, sizeof(child)); }
 };
 
+// Node memory owned by a tree: one slab pool per node type, so grow and
+// shrink recycle slots instead of going through the global heap, and the
+// whole tree can be freed chunk by chunk via release(). Live nodes per type
+// and live leaf records are counted as they are allocated and freed. With
+// huge pages or a NUMA policy (MemoryOptions) all chunks come from a
+// PageArena of the allocator.
+class Allocator {
+   public:
+    explicit Allocator(const MemoryOptions& options = MemoryOptions())
+        : arena(options.usesArena() ? new PageArena(options) : NULL),
+          pools{SlabPool(sizeof(Node4), nodeAlignment, arena.get()),
+                SlabPool(sizeof(Node16), nodeAlignment, arena.get()),
+                SlabPool(sizeof(Node48), nodeAlignment, arena.get()),
+                SlabPool(sizeof(Node256), nodeAlignment, arena.get())},
+          leaves(arena.get()),
+          liveNodes{0, 0, 0, 0},
+          liveLeaves(0),
+          liveLeafBytes(0),
+          livePrefixBytes(0) {}
+
+    template <typename N>
+    N* allocate() {
+        // Create an empty node of type N
+        liveNodes[N::nodeType]++;
+        return new (pools[N::nodeType].allocate()) N();
+    }
+
+    void deallocate(ArtNode* node) {
+        // Recycle the slot of an inner node (all node types are trivially
+        // destructible)
+        liveNodes[node->type]--;
+        pools[node->type].deallocate(node);
+    }
+
+    void* allocateLeaf(size_t bytes) {
+        // Memory for an out-of-line leaf
+        liveLeaves++;
+        liveLeafBytes += bytes;
+        return leaves.allocate(bytes);
+    }
+
+    void deallocateLeaf(void* leaf, size_t bytes) {
+        liveLeaves--;
+        liveLeafBytes -= bytes;
+        leaves.deallocate(leaf, bytes);
+    }
+
+    uint8_t* allocatePrefix(size_t bytes) {
+        // Memory for an out-of-line prefix, see StoredPrefixes
+        livePrefixBytes += bytes;
+        return static_cast<uint8_t*>(leaves.allocate(bytes));
+    }
+
+    void deallocatePrefix(uint8_t* prefix, size_t bytes) {
+        livePrefixBytes -= bytes;
+        leaves.deallocate(prefix, bytes);
+    }
+
+    void merge(Allocator& other) {
+        // Take over all memory of another allocator, e.g. one that built a
+        // subtree on another thread; both must use the same options
+        assert(bool(arena) == bool(other.arena));
+        if (arena) arena->merge(*other.arena);
+        for (unsigned i = 0; i < 4; i++) {
+            pools[i].merge(other.pools[i]);
+            liveNodes[i] += other.liveNodes[i];
+            other.liveNodes[i] = 0;
+        }
+        leaves.merge(other.leaves);
+        liveLeaves += other.liveLeaves;
+        liveLeafBytes += other.liveLeafBytes;
+        livePrefixBytes += other.livePrefixBytes;
+        other.liveLeaves = other.liveLeafBytes = other.livePrefixBytes = 0;
+    }
+
+    void swap(Allocator& other) {
+        // Exchange all memory with another allocator, O(1)
+        arena.swap(other.arena);
+        for (unsigned i = 0; i < 4; i++) {
+            pools[i].swap(other.pools[i]);
+            std::swap(liveNodes[i], other.liveNodes[i]);
+        }
+        leaves.swap(other.leaves);
+        std::swap(liveLeaves, other.liveLeaves);
+        std::swap(liveLeafBytes, other.liveLeafBytes);
+        std::swap(livePrefixBytes, other.livePrefixBytes);
+    }
+
+    void release() {
+        // Free all nodes and leaves at once
+        for (SlabPool& pool : pools) pool.release();
+        leaves.release();
+        if (arena) arena->release();
+        for (size_t& n : liveNodes) n = 0;
+        liveLeaves = liveLeafBytes = livePrefixBytes = 0;
+    }
+
+    size_t bytesReserved() const {
+        // Memory obtained from the system: the slab chunks and large
+        // leaves, or with an arena all of its regions (which hold the
+        // chunks, including the unused rest of the current region)
+        if (arena) return arena->bytesMapped() + leaves.largeBlockBytes();
+        size_t bytes = leaves.bytesReserved();
+        for (const SlabPool& pool : pools) bytes += pool.bytesReserved();
+        return bytes;
+    }
+
+    MemoryOptions memoryOptions() const {
+        return arena ? arena->options : MemoryOptions();
+    }
+
+    // The arena behind the pools, NULL with the default options
+    const PageArena* pageArena() const { return arena.get(); }
+
+    size_t nodeCount(int8_t type) const { return liveNodes[type]; }
+    size_t leafCount() const { return liveLeaves; }
+    size_t prefixBytes() const { return livePrefixBytes; }
+
+    size_t bytesInUse() const {
+        // Bytes of the live nodes, leaf records and out-of-line prefixes,
+        // without slab slack
+        return liveNodes[NodeType4] * sizeof(Node4) +
+               liveNodes[NodeType16] * sizeof(Node16) +
+               liveNodes[NodeType48] * sizeof(Node48) +
+               liveNodes[NodeType256] * sizeof(Node256) + liveLeafBytes +
+               livePrefixBytes;
+    }
+
+   private:
+    // Declared first, the pools hold pointers to it
+    std::unique_ptr<PageArena> arena;
+    SlabPool pools[4];
+    SizeClassPool leaves;
+    // Counts of live objects; with several allocators sharing a tree (the
+    // concurrent variants free into the retiring thread's allocator) only
+    // their sums are meaningful
+    size_t liveNodes[4];
+    size_t liveLeaves;
+    size_t liveLeafBytes;
+    size_t livePrefixBytes;
+};
+
+// Node type changes of a tree since it was created. The counters count
+// replaced nodes, not type steps: a replacement that skips types, as when
+// a batch grows a Node4 into a Node48, counts once.
+struct TransitionCounts {
+    size_t grows;    // nodes insert replaced by a larger type
+    size_t shrinks;  // nodes erase replaced by a smaller type
+    // Erases down to the count at which eager shrinking replaces a node
+    // that the ShrinkPolicy of the tree kept: a copy saved each, and
+    // another one if churn around the boundary grows the node again
+    size_t deferredShrinks;
+    size_t compacted;  // nodes compact() replaced by a smaller type
+
+    TransitionCounts()
+        : grows(0), shrinks(0), deferredShrinks(0), compacted(0) {}
+};
+
+// Shape and memory of a tree, see Tree::stats()
+struct TreeStats {
+    // Inner nodes by type (NodeType4..NodeType256)
+    size_t nodes[4];
+    size_t leaves;
+    // Bytes of inner nodes, stored leaf records and out-of-line prefixes
+    // in use
+    size_t nodeBytes;
+    size_t leafBytes;
+    size_t prefixBytes;
+    // Bytes the allocator obtained from the system
+    size_t reservedBytes;
+    // Bytes of the membership filter, 0 without one
+    size_t filterBytes;
+    // Nodes with prefixLength > maxPrefixLength kept inline, whose prefix
+    // checks load a key from a leaf
+    size_t longPrefixes;
+    // depth[d]: leaves below d inner nodes
+    std::vector<size_t> depth;
+    // prefixLength[l]: inner nodes with a prefix of l bytes
+    std::vector<size_t> prefixLength;
+    TransitionCounts transitions;
+
+    TreeStats()
+        : nodes{0, 0, 0, 0},
+          leaves(0),
+          nodeBytes(0),
+          leafBytes(0),
+          prefixBytes(0),
+          reservedBytes(0),
+          filterBytes(0),
+          longPrefixes(0) {}
+
+    double bytesPerKey() const {
+        return leaves ? double(reservedBytes) / leaves : 0;
+    }
+
+    void print(FILE* out, const char* prefix = "art.") const {
+        // One "name value" line per metric
+        static const char* const names[4] = {"node4", "node16", "node48",
+                                             "node256"};
+        for (unsigned i = 0; i < 4; i++)
+            fprintf(out, "%snodes.%s %zu\n", prefix, names[i], nodes[i]);
+        fprintf(out, "%sleaves %zu\n", prefix, leaves);
+        fprintf(out, "%sbytes.nodes %zu\n", prefix, nodeBytes);
+        fprintf(out, "%sbytes.leaves %zu\n", prefix, leafBytes);
+        fprintf(out, "%sbytes.prefixes %zu\n", prefix, prefixBytes);
+        fprintf(out, "%sbytes.reserved %zu\n", prefix, reservedBytes);
+        fprintf(out, "%sbytes.filter %zu\n", prefix, filterBytes);
+        fprintf(out, "%sbytes_per_key %.2f\n", prefix, bytesPerKey());
+        fprintf(out, "%sprefix.long %zu\n", prefix, longPrefixes);
+        fprintf(out, "%stransitions.grows %zu\n", prefix, transitions.grows);
+        fprintf(out, "%stransitions.shrinks %zu\n", prefix,
+                transitions.shrinks);
+        fprintf(out, "%stransitions.deferred_shrinks %zu\n", prefix,
+                transitions.deferredShrinks);
+        fprintf(out, "%stransitions.compacted %zu\n", prefix,
+                transitions.compacted);
+        for (size_t d = 0; d < depth.size(); d++)
+            if (depth[d])
+                fprintf(out, "%sdepth.%zu %zu\n", prefix, d, depth[d]);
+        for (size_t l = 0; l < prefixLength.size(); l++)
+            if (prefixLength[l])
+                fprintf(out, "%sprefix.length.%zu %zu\n", prefix, l,
+                        prefixLength[l]);
+    }
+};
+
 inline ArtNode* makeLeaf(uintptr_t tid) {
     // Create a pseudo-leaf
     return reinterpret_cast<ArtNode*>((tid << 1) | 1);
@@ -102,19 +360,69 @@ inline bool isLeaf(ArtNode* node) {
 }
 
 uint8_t flipSign(uint8_t keyByte) {
-    // Flip the sign bit, enables signed SSE comparison of unsigned values, used
-    // by Node16
+    // Flip the sign bit, enables signed SIMD comparison of unsigned values,
+    // used by Node16
     return keyByte ^ 128;
 }
 
-void loadKey(uintptr_t tid, uint8_t key[]) {
-    // Store the key of the tuple into the key vector
-    // Implementation is database specific
-    reinterpret_cast<uint64_t*>(key)[0] = __builtin_bswap64(tid);
-}
+// Key loader for integer keys that are their own tuple identifier: the key
+// bytes are the big-endian encoding of the value stored in the leaf
+template <typename Key>
+struct IntegerKeyLoader {
+    static_assert(std::is_integral<Key>::value && std::is_unsigned<Key>::value,
+                  "IntegerKeyLoader requires an unsigned integer key");
+
+    static const unsigned keyLength = sizeof(Key);
+
+    static unsigned encode(Key key, uint8_t out[]) {
+        // Store the key in binary-comparable (big-endian) order, return its
+        // length
+        if constexpr (sizeof(Key) == 8)
+            key = __builtin_bswap64(key);
+        else if constexpr (sizeof(Key) == 4)
+            key = __builtin_bswap32(key);
+        else if constexpr (sizeof(Key) == 2)
+            key = __builtin_bswap16(key);
+        memcpy(out, &key, sizeof(Key));
+        return sizeof(Key);
+    }
+
+    static void load(uintptr_t tid, uint8_t key[]) {
+        // Store the key of the tuple into the key vector
+        encode(static_cast<Key>(tid), key);
+    }
+};
+
+// Leaf representations, selected by the Leaves parameter of Tree.
+// Pseudo-leaves keep the value in the tagged child pointer and rebuild the
+// key through the KeyLoader; stored leaves point to an out-of-line record
+// holding the payload next to the full key bytes.
+struct PseudoLeaves {};
+struct StoredLeaves {};
+
+// Prefix representations, selected by the Prefixes parameter of Tree.
+// Inline prefixes keep the first maxPrefixLength bytes in the node and
+// recover the rest from the key of a leaf below it; stored prefixes move
+// prefixes longer than that to an out-of-line copy, so every prefix check
+// is a compare against node memory.
+struct InlinePrefixes {};
+struct StoredPrefixes {};
+
+// Out-of-line leaf, the key bytes follow the header
+template <typename Value>
+struct LeafRecord {
+    Value value;
+    uint32_t keyLength;
+
+    uint8_t* key() { return reinterpret_cast<uint8_t*>(this + 1); }
+    const uint8_t* key() const {
+        return reinterpret_cast<const uint8_t*>(this + 1);
+    }
 
-// This address is used to communicate that search failed
-ArtNode* nullNode = NULL;
+    static constexpr size_t size(unsigned keyLength) {
+        return sizeof(LeafRecord) + keyLength;
+    }
+};
 
 static inline unsigned ctz(uint16_t x) {
     // Count trailing zeros, only defined for x>0
@@ -140,32 +448,29 @@ static inline unsigned ctz(uint16_t x) {
 }
 
 ArtNode** findChild(ArtNode* n, uint8_t keyByte) {
-    // Find the next child for the keyByte
+    // Find the next child for the keyByte, NULL if the node has no slot for it
     switch (n->type) {
         case NodeType4: {
             Node4* node = static_cast<Node4*>(n);
             for (unsigned i = 0; i < node->count; i++)
                 if (node->key[i] == keyByte) return &node->child[i];
-            return &nullNode;
+            return NULL;
         }
         case NodeType16: {
             Node16* node = static_cast<Node16*>(n);
-            __m128i cmp = _mm_cmpeq_epi8(
-                _mm_set1_epi8(flipSign(keyByte)),
-                _mm_loadu_si128(reinterpret_cast<__m128i*>(node->key)));
-            unsigned bitfield =
-                _mm_movemask_epi8(cmp) & ((1 << node->count) - 1);
+            unsigned bitfield = equalMask16(node->key, flipSign(keyByte)) &
+                                ((1 << node->count) - 1);
             if (bitfield)
                 return &node->child[ctz(bitfield)];
             else
-                return &nullNode;
+                return NULL;
         }
         case NodeType48: {
             Node48* node = static_cast<Node48*>(n);
             if (node->childIndex[keyByte] != emptyMarker)
                 return &node->child[node->childIndex[keyByte]];
             else
-                return &nullNode;
+                return NULL;
         }
         case NodeType256: {
             Node256* node = static_cast<Node256*>(n);
@@ -175,171 +480,142 @@ ArtNode** findChild(ArtNode* n, uint8_t keyByte) {
     throw;  // Unreachable
 }
 
-ArtNode* minimum(ArtNode* node) {
-    // Find the leaf with smallest key
-    if (!node) return NULL;
-
-    if (isLeaf(node)) return node;
+// Ordered traversal of the children of an inner node. A child position is
+// the slot index in Node4/Node16 (whose keys are kept sorted) and the key
+// byte in Node48/Node256; positions increase with the key byte.
 
-    switch (node->type) {
-        case NodeType4: {
-            Node4* n = static_cast<Node4*>(node);
-            return minimum(n->child[0]);
-        }
-        case NodeType16: {
-            Node16* n = static_cast<Node16*>(node);
-            return minimum(n->child[0]);
-        }
-        case NodeType48: {
-            Node48* n = static_cast<Node48*>(node);
-            unsigned pos = 0;
-            while (n->childIndex[pos] == emptyMarker) pos++;
-            return minimum(n->child[n->childIndex[pos]]);
-        }
-        case NodeType256: {
-            Node256* n = static_cast<Node256*>(node);
-            unsigned pos = 0;
-            while (!n->child[pos]) pos++;
-            return minimum(n->child[pos]);
-        }
+int nextChild(ArtNode* n, int pos) {
+    // Position of the first child after pos (-1 for the first child), -1 if
+    // there is none
+    switch (n->type) {
+        case NodeType4:
+        case NodeType16:
+            return (pos + 1 < n->count) ? pos + 1 : -1;
+        case NodeType48:
+            return findUsedByte(static_cast<Node48*>(n)->childIndex, pos + 1,
+                                emptyMarker);
+        case NodeType256:
+            return findUsedPointer(static_cast<Node256*>(n)->child, pos + 1);
     }
     throw;  // Unreachable
 }
 
-ArtNode* maximum(ArtNode* node) {
-    // Find the leaf with largest key
-    if (!node) return NULL;
-
-    if (isLeaf(node)) return node;
+int prevChild(ArtNode* n, int pos) {
+    // Position of the last child before pos (256 for the last child), -1 if
+    // there is none
+    switch (n->type) {
+        case NodeType4:
+        case NodeType16:
+            return (pos > n->count ? n->count : pos) - 1;
+        case NodeType48:
+            return findUsedByteBackward(static_cast<Node48*>(n)->childIndex,
+                                        pos - 1, emptyMarker);
+        case NodeType256:
+            return findUsedPointerBackward(static_cast<Node256*>(n)->child,
+                                           pos - 1);
+    }
+    throw;  // Unreachable
+}
 
-    switch (node->type) {
+int lowerChild(ArtNode* n, uint8_t keyByte) {
+    // Position of the first child whose key byte is >= keyByte, -1 if there
+    // is none
+    switch (n->type) {
         case NodeType4: {
-            Node4* n = static_cast<Node4*>(node);
-            return maximum(n->child[n->count - 1]);
+            Node4* node = static_cast<Node4*>(n);
+            for (unsigned i = 0; i < node->count; i++)
+                if (node->key[i] >= keyByte) return i;
+            return -1;
         }
         case NodeType16: {
-            Node16* n = static_cast<Node16*>(node);
-            return maximum(n->child[n->count - 1]);
-        }
-        case NodeType48: {
-            Node48* n = static_cast<Node48*>(node);
-            unsigned pos = 255;
-            while (n->childIndex[pos] == emptyMarker) pos--;
-            return maximum(n->child[n->childIndex[pos]]);
-        }
-        case NodeType256: {
-            Node256* n = static_cast<Node256*>(node);
-            unsigned pos = 255;
-            while (!n->child[pos]) pos--;
-            return maximum(n->child[pos]);
+            // Keys are stored sign-flipped
+            Node16* node = static_cast<Node16*>(n);
+            for (unsigned i = 0; i < node->count; i++)
+                if (flipSign(node->key[i]) >= keyByte) return i;
+            return -1;
         }
+        case NodeType48:
+        case NodeType256:
+            return nextChild(n, int(keyByte) - 1);
     }
     throw;  // Unreachable
 }
 
-bool leafMatches(ArtNode* leaf, uint8_t key[], unsigned keyLength,
-                 unsigned depth, unsigned maxKeyLength) {
-    // Check if the key of the leaf is equal to the searched key
-    if (depth != keyLength) {
-        uint8_t leafKey[maxKeyLength];
-        loadKey(getLeafValue(leaf), leafKey);
-        for (unsigned i = depth; i < keyLength; i++)
-            if (leafKey[i] != key[i]) return false;
-    }
-    return true;
-}
-
-unsigned prefixMismatch(ArtNode* node, uint8_t key[], unsigned depth,
-                        unsigned maxKeyLength) {
-    // Compare the key with the prefix of the node, return the number matching
-    // bytes
-    unsigned pos;
-    if (node->prefixLength > maxPrefixLength) {
-        for (pos = 0; pos < maxPrefixLength; pos++)
-            if (key[depth + pos] != node->prefix[pos]) return pos;
-        uint8_t minKey[maxKeyLength];
-        loadKey(getLeafValue(minimum(node)), minKey);
-        for (; pos < node->prefixLength; pos++)
-            if (key[depth + pos] != minKey[depth + pos]) return pos;
-    } else {
-        for (pos = 0; pos < node->prefixLength; pos++)
-            if (key[depth + pos] != node->prefix[pos]) return pos;
+ArtNode* childAt(ArtNode* n, int pos) {
+    // The child at a position returned by nextChild/prevChild/lowerChild
+    switch (n->type) {
+        case NodeType4:
+            return static_cast<Node4*>(n)->child[pos];
+        case NodeType16:
+            return static_cast<Node16*>(n)->child[pos];
+        case NodeType48: {
+            Node48* node = static_cast<Node48*>(n);
+            return node->child[node->childIndex[pos]];
+        }
+        case NodeType256:
+            return static_cast<Node256*>(n)->child[pos];
     }
-    return pos;
+    throw;  // Unreachable
 }
 
-ArtNode* lookup(ArtNode* node, uint8_t key[], unsigned keyLength,
-                unsigned depth, unsigned maxKeyLength) {
-    // Find the node with a matching key, optimistic version
-
-    bool skippedPrefix =
-        false;  // Did we optimistically skip some prefix without checking it?
-
-    while (node != NULL) {
-        if (isLeaf(node)) {
-            if (!skippedPrefix && depth == keyLength)  // No check required
-                return node;
-
-            if (depth != keyLength) {
-                // Check leaf
-                uint8_t leafKey[maxKeyLength];
-                loadKey(getLeafValue(node), leafKey);
-                for (unsigned i = (skippedPrefix ? 0 : depth); i < keyLength;
-                     i++)
-                    if (leafKey[i] != key[i]) return NULL;
-            }
-            return node;
-        }
-
-        if (node->prefixLength) {
-            if (node->prefixLength < maxPrefixLength) {
-                for (unsigned pos = 0; pos < node->prefixLength; pos++)
-                    if (key[depth + pos] != node->prefix[pos]) return NULL;
-            } else
-                skippedPrefix = true;
-            depth += node->prefixLength;
+ArtNode** childSlot(ArtNode* n, int pos) {
+    // The address of the child pointer at a position
+    switch (n->type) {
+        case NodeType4:
+            return &static_cast<Node4*>(n)->child[pos];
+        case NodeType16:
+            return &static_cast<Node16*>(n)->child[pos];
+        case NodeType48: {
+            Node48* node = static_cast<Node48*>(n);
+            return &node->child[node->childIndex[pos]];
         }
-
-        node = *findChild(node, key[depth]);
-        depth++;
+        case NodeType256:
+            return &static_cast<Node256*>(n)->child[pos];
     }
-
-    return NULL;
+    throw;  // Unreachable
 }
 
-ArtNode* lookupPessimistic(ArtNode* node, uint8_t key[], unsigned keyLength,
-                           unsigned depth, unsigned maxKeyLength) {
-    // Find the node with a matching key, alternative pessimistic version
+uint8_t keyByteAt(ArtNode* n, int pos) {
+    // The key byte leading to the child at a position
+    switch (n->type) {
+        case NodeType4:
+            return static_cast<Node4*>(n)->key[pos];
+        case NodeType16:
+            return flipSign(static_cast<Node16*>(n)->key[pos]);
+        default:
+            return pos;
+    }
+}
 
-    while (node != NULL) {
-        if (isLeaf(node)) {
-            if (leafMatches(node, key, keyLength, depth, maxKeyLength))
-                return node;
-            return NULL;
-        }
+ArtNode* minimum(ArtNode* node) {
+    // Find the leaf with smallest key
+    if (!node) return NULL;
 
-        if (prefixMismatch(node, key, depth, maxKeyLength) !=
-            node->prefixLength)
-            return NULL;
-        else
-            depth += node->prefixLength;
+    while (!isLeaf(node)) node = childAt(node, nextChild(node, -1));
+    return node;
+}
 
-        node = *findChild(node, key[depth]);
-        depth++;
-    }
+ArtNode* maximum(ArtNode* node) {
+    // Find the leaf with largest key
+    if (!node) return NULL;
 
-    return NULL;
+    while (!isLeaf(node)) node = childAt(node, prevChild(node, 256));
+    return node;
 }
 
 // Forward references
+template <typename Alloc>
 void insertNode4(Node4* node, ArtNode** nodeRef, uint8_t keyByte,
-                 ArtNode* child);
+                 ArtNode* child, Alloc& alloc);
+template <typename Alloc>
 void insertNode16(Node16* node, ArtNode** nodeRef, uint8_t keyByte,
-                  ArtNode* child);
+                  ArtNode* child, Alloc& alloc);
+template <typename Alloc>
 void insertNode48(Node48* node, ArtNode** nodeRef, uint8_t keyByte,
-                  ArtNode* child);
+                  ArtNode* child, Alloc& alloc);
+template <typename Alloc>
 void insertNode256(Node256* node, ArtNode** nodeRef, uint8_t keyByte,
-                   ArtNode* child);
+                   ArtNode* child, Alloc& alloc);
 
 unsigned min(unsigned a, unsigned b) {
     // Helper function
@@ -353,100 +629,9 @@ void copyPrefix(ArtNode* src, ArtNode* dst) {
     memcpy(dst->prefix, src->prefix, min(src->prefixLength, maxPrefixLength));
 }
 
-void insert(ArtNode* node, ArtNode** nodeRef, uint8_t key[], unsigned depth,
-            uintptr_t value, unsigned maxKeyLength) {
-    // Insert the leaf value into the tree
-
-    if (node == NULL) {
-        *nodeRef = makeLeaf(value);
-        return;
-    }
-
-    if (isLeaf(node)) {
-        // Replace leaf with Node4 and store both leaves in it
-        uint8_t existingKey[maxKeyLength];
-        loadKey(getLeafValue(node), existingKey);
-        unsigned newPrefixLength = 0;
-        while (existingKey[depth + newPrefixLength] ==
-               key[depth + newPrefixLength])
-            newPrefixLength++;
-
-        Node4* newNode = new Node4();
-        newNode->prefixLength = newPrefixLength;
-        memcpy(newNode->prefix, key + depth,
-               min(newPrefixLength, maxPrefixLength));
-        *nodeRef = newNode;
-
-        insertNode4(newNode, nodeRef, existingKey[depth + newPrefixLength],
-                    node);
-        insertNode4(newNode, nodeRef, key[depth + newPrefixLength],
-                    makeLeaf(value));
-        return;
-    }
-
-    // Handle prefix of inner node
-    if (node->prefixLength) {
-        unsigned mismatchPos = prefixMismatch(node, key, depth, maxKeyLength);
-        if (mismatchPos != node->prefixLength) {
-            // Prefix differs, create new node
-            Node4* newNode = new Node4();
-            *nodeRef = newNode;
-            newNode->prefixLength = mismatchPos;
-            memcpy(newNode->prefix, node->prefix,
-                   min(mismatchPos, maxPrefixLength));
-            // Break up prefix
-            if (node->prefixLength < maxPrefixLength) {
-                insertNode4(newNode, nodeRef, node->prefix[mismatchPos], node);
-                node->prefixLength -= (mismatchPos + 1);
-                memmove(node->prefix, node->prefix + mismatchPos + 1,
-                        min(node->prefixLength, maxPrefixLength));
-            } else {
-                node->prefixLength -= (mismatchPos + 1);
-                uint8_t minKey[maxKeyLength];
-                loadKey(getLeafValue(minimum(node)), minKey);
-                insertNode4(newNode, nodeRef, minKey[depth + mismatchPos],
-                            node);
-                memmove(node->prefix, minKey + depth + mismatchPos + 1,
-                        min(node->prefixLength, maxPrefixLength));
-            }
-            insertNode4(newNode, nodeRef, key[depth + mismatchPos],
-                        makeLeaf(value));
-            return;
-        }
-        depth += node->prefixLength;
-    }
-
-    // Recurse
-    ArtNode** child = findChild(node, key[depth]);
-    if (*child) {
-        insert(*child, child, key, depth + 1, value, maxKeyLength);
-        return;
-    }
-
-    // Insert leaf into inner node
-    ArtNode* newNode = makeLeaf(value);
-    switch (node->type) {
-        case NodeType4:
-            insertNode4(static_cast<Node4*>(node), nodeRef, key[depth],
-                        newNode);
-            break;
-        case NodeType16:
-            insertNode16(static_cast<Node16*>(node), nodeRef, key[depth],
-                         newNode);
-            break;
-        case NodeType48:
-            insertNode48(static_cast<Node48*>(node), nodeRef, key[depth],
-                         newNode);
-            break;
-        case NodeType256:
-            insertNode256(static_cast<Node256*>(node), nodeRef, key[depth],
-                          newNode);
-            break;
-    }
-}
-
+template <typename Alloc>
 void insertNode4(Node4* node, ArtNode** nodeRef, uint8_t keyByte,
-                 ArtNode* child) {
+                 ArtNode* child, Alloc& alloc) {
     // Insert leaf into inner node
     if (node->count < 4) {
         // Insert element
@@ -460,29 +645,27 @@ void insertNode4(Node4* node, ArtNode** nodeRef, uint8_t keyByte,
         node->count++;
     } else {
         // Grow to Node16
-        Node16* newNode = new Node16();
+        Node16* newNode = alloc.template allocate<Node16>();
         *nodeRef = newNode;
         newNode->count = 4;
         copyPrefix(node, newNode);
         for (unsigned i = 0; i < 4; i++)
             newNode->key[i] = flipSign(node->key[i]);
         memcpy(newNode->child, node->child, node->count * sizeof(uintptr_t));
-        delete node;
-        return insertNode16(newNode, nodeRef, keyByte, child);
+        alloc.deallocate(node);
+        return insertNode16(newNode, nodeRef, keyByte, child, alloc);
     }
 }
 
+template <typename Alloc>
 void insertNode16(Node16* node, ArtNode** nodeRef, uint8_t keyByte,
-                  ArtNode* child) {
+                  ArtNode* child, Alloc& alloc) {
     // Insert leaf into inner node
     if (node->count < 16) {
         // Insert element
         uint8_t keyByteFlipped = flipSign(keyByte);
-        __m128i cmp = _mm_cmplt_epi8(
-            _mm_set1_epi8(keyByteFlipped),
-            _mm_loadu_si128(reinterpret_cast<__m128i*>(node->key)));
-        uint16_t bitfield =
-            _mm_movemask_epi8(cmp) & (0xFFFF >> (16 - node->count));
+        uint16_t bitfield = greaterMask16(node->key, keyByteFlipped) &
+                            (0xFFFF >> (16 - node->count));
         unsigned pos = bitfield ? ctz(bitfield) : node->count;
         memmove(node->key + pos + 1, node->key + pos, node->count - pos);
         memmove(node->child + pos + 1, node->child + pos,
@@ -492,20 +675,21 @@ void insertNode16(Node16* node, ArtNode** nodeRef, uint8_t keyByte,
         node->count++;
     } else {
         // Grow to Node48
-        Node48* newNode = new Node48();
+        Node48* newNode = alloc.template allocate<Node48>();
         *nodeRef = newNode;
         memcpy(newNode->child, node->child, node->count * sizeof(uintptr_t));
         for (unsigned i = 0; i < node->count; i++)
             newNode->childIndex[flipSign(node->key[i])] = i;
         copyPrefix(node, newNode);
         newNode->count = node->count;
-        delete node;
-        return insertNode48(newNode, nodeRef, keyByte, child);
+        alloc.deallocate(node);
+        return insertNode48(newNode, nodeRef, keyByte, child, alloc);
     }
 }
 
+template <typename Alloc>
 void insertNode48(Node48* node, ArtNode** nodeRef, uint8_t keyByte,
-                  ArtNode* child) {
+                  ArtNode* child, Alloc& alloc) {
     // Insert leaf into inner node
     if (node->count < 48) {
         // Insert element
@@ -517,77 +701,110 @@ void insertNode48(Node48* node, ArtNode** nodeRef, uint8_t keyByte,
         node->count++;
     } else {
         // Grow to Node256
-        Node256* newNode = new Node256();
+        Node256* newNode = alloc.template allocate<Node256>();
         for (unsigned i = 0; i < 256; i++)
             if (node->childIndex[i] != 48)
                 newNode->child[i] = node->child[node->childIndex[i]];
         newNode->count = node->count;
         copyPrefix(node, newNode);
         *nodeRef = newNode;
-        delete node;
-        return insertNode256(newNode, nodeRef, keyByte, child);
+        alloc.deallocate(node);
+        return insertNode256(newNode, nodeRef, keyByte, child, alloc);
     }
 }
 
+template <typename Alloc>
 void insertNode256(Node256* node, ArtNode** nodeRef, uint8_t keyByte,
-                   ArtNode* child) {
+                   ArtNode* child, Alloc& /*alloc*/) {
     // Insert leaf into inner node
     node->count++;
     node->child[keyByte] = child;
 }
 
-// Forward references
-void eraseNode4(Node4* node, ArtNode** nodeRef, ArtNode** leafPlace);
-void eraseNode16(Node16* node, ArtNode** nodeRef, ArtNode** leafPlace);
-void eraseNode48(Node48* node, ArtNode** nodeRef, uint8_t keyByte);
-void eraseNode256(Node256* node, ArtNode** nodeRef, uint8_t keyByte);
-
-void erase(ArtNode* node, ArtNode** nodeRef, uint8_t key[], unsigned keyLength,
-           unsigned depth, unsigned maxKeyLength) {
-    // Delete a leaf from a tree
-
-    if (!node) return;
+// Child counts at or below which erase replaces a Node16, Node48 or Node256
+// by the next smaller type. The default shrinks eagerly, as soon as the
+// children fit, one or two erases below the counts at which insert grows
+// the node: churn around a boundary then copies the node on every other
+// operation. Lower counts keep such nodes and leave the space to compact().
+// Every count is between its minimum (a shrunk node keeps at least two
+// children) and the eager one, which stays below the grow count of the
+// smaller type; counts outside that range are clamped into it.
+struct ShrinkPolicy {
+    unsigned node16;
+    unsigned node48;
+    unsigned node256;
+
+    ShrinkPolicy() : node16(3), node48(12), node256(37) {}
+    ShrinkPolicy(unsigned node16, unsigned node48, unsigned node256)
+        : node16(clamp(node16, 2, 3)),
+          node48(clamp(node48, 3, 12)),
+          node256(clamp(node256, 4, 37)) {}
+
+    // Shrink once a node is down to about half the smaller type
+    static ShrinkPolicy lazy() { return ShrinkPolicy(2, 8, 24); }
+
+    unsigned count(int8_t type) const {
+        // The count for nodes of a type other than NodeType4
+        return type == NodeType16 ? node16
+               : type == NodeType48 ? node48
+                                    : node256;
+    }
 
-    if (isLeaf(node)) {
-        // Make sure we have the right leaf
-        if (leafMatches(node, key, keyLength, depth, maxKeyLength))
-            *nodeRef = NULL;
-        return;
+    static unsigned clamp(unsigned count, unsigned low, unsigned high) {
+        return count < low ? low : count > high ? high : count;
     }
+};
 
-    // Handle prefix
-    if (node->prefixLength) {
-        if (prefixMismatch(node, key, depth, maxKeyLength) !=
-            node->prefixLength)
-            return;
-        depth += node->prefixLength;
+template <typename Alloc>
+void shrinkNode16(Node16* node, ArtNode** nodeRef, Alloc& alloc) {
+    // Replace a node of at most 4 children by a Node4
+    assert(node->count <= 4);
+    Node4* newNode = alloc.template allocate<Node4>();
+    newNode->count = node->count;
+    copyPrefix(node, newNode);
+    for (unsigned i = 0; i < 4; i++) newNode->key[i] = flipSign(node->key[i]);
+    memcpy(newNode->child, node->child, sizeof(uintptr_t) * 4);
+    *nodeRef = newNode;
+    alloc.deallocate(node);
+}
+
+template <typename Alloc>
+void shrinkNode48(Node48* node, ArtNode** nodeRef, Alloc& alloc) {
+    // Replace a node of at most 16 children by a Node16
+    assert(node->count <= 16);
+    Node16* newNode = alloc.template allocate<Node16>();
+    *nodeRef = newNode;
+    copyPrefix(node, newNode);
+    for (unsigned b = 0; b < 256; b++) {
+        if (node->childIndex[b] != emptyMarker) {
+            newNode->key[newNode->count] = flipSign(b);
+            newNode->child[newNode->count] = node->child[node->childIndex[b]];
+            newNode->count++;
+        }
     }
+    alloc.deallocate(node);
+}
 
-    ArtNode** child = findChild(node, key[depth]);
-    if (isLeaf(*child) &&
-        leafMatches(*child, key, keyLength, depth, maxKeyLength)) {
-        // Leaf found, delete it in inner node
-        switch (node->type) {
-            case NodeType4:
-                eraseNode4(static_cast<Node4*>(node), nodeRef, child);
-                break;
-            case NodeType16:
-                eraseNode16(static_cast<Node16*>(node), nodeRef, child);
-                break;
-            case NodeType48:
-                eraseNode48(static_cast<Node48*>(node), nodeRef, key[depth]);
-                break;
-            case NodeType256:
-                eraseNode256(static_cast<Node256*>(node), nodeRef, key[depth]);
-                break;
+template <typename Alloc>
+void shrinkNode256(Node256* node, ArtNode** nodeRef, Alloc& alloc) {
+    // Replace a node of at most 48 children by a Node48
+    assert(node->count <= 48);
+    Node48* newNode = alloc.template allocate<Node48>();
+    *nodeRef = newNode;
+    copyPrefix(node, newNode);
+    for (unsigned b = 0; b < 256; b++) {
+        if (node->child[b]) {
+            newNode->childIndex[b] = newNode->count;
+            newNode->child[newNode->count] = node->child[b];
+            newNode->count++;
         }
-    } else {
-        // Recurse
-        erase(*child, child, key, keyLength, depth + 1, maxKeyLength);
     }
+    alloc.deallocate(node);
 }
 
-void eraseNode4(Node4* node, ArtNode** nodeRef, ArtNode** leafPlace) {
+template <typename Alloc>
+void eraseNode4(Node4* node, ArtNode** nodeRef, ArtNode** leafPlace,
+                Alloc& alloc) {
     // Delete leaf from inner node
     unsigned pos = leafPlace - node->child;
     memmove(node->key + pos, node->key + pos + 1, node->count - pos - 1);
@@ -615,11 +832,13 @@ void eraseNode4(Node4* node, ArtNode** nodeRef, ArtNode** leafPlace) {
             child->prefixLength += node->prefixLength + 1;
         }
         *nodeRef = child;
-        delete node;
+        alloc.deallocate(node);
     }
 }
 
-void eraseNode16(Node16* node, ArtNode** nodeRef, ArtNode** leafPlace) {
+template <typename Alloc>
+void eraseNode16(Node16* node, ArtNode** nodeRef, ArtNode** leafPlace,
+                 Alloc& alloc, unsigned shrinkCount = 3) {
     // Delete leaf from inner node
     unsigned pos = leafPlace - node->child;
     memmove(node->key + pos, node->key + pos + 1, node->count - pos - 1);
@@ -627,60 +846,1840 @@ void eraseNode16(Node16* node, ArtNode** nodeRef, ArtNode** leafPlace) {
             (node->count - pos - 1) * sizeof(uintptr_t));
     node->count--;
 
-    if (node->count == 3) {
-        // Shrink to Node4
-        Node4* newNode = new Node4();
-        newNode->count = node->count;
-        copyPrefix(node, newNode);
-        for (unsigned i = 0; i < 4; i++)
-            newNode->key[i] = flipSign(node->key[i]);
-        memcpy(newNode->child, node->child, sizeof(uintptr_t) * 4);
-        *nodeRef = newNode;
-        delete node;
-    }
+    // Shrink to Node4
+    if (node->count <= shrinkCount) shrinkNode16(node, nodeRef, alloc);
 }
 
-void eraseNode48(Node48* node, ArtNode** nodeRef, uint8_t keyByte) {
+template <typename Alloc>
+void eraseNode48(Node48* node, ArtNode** nodeRef, uint8_t keyByte,
+                 Alloc& alloc, unsigned shrinkCount = 12) {
     // Delete leaf from inner node
     node->child[node->childIndex[keyByte]] = NULL;
     node->childIndex[keyByte] = emptyMarker;
     node->count--;
 
-    if (node->count == 12) {
-        // Shrink to Node16
-        Node16* newNode = new Node16();
-        *nodeRef = newNode;
-        copyPrefix(node, newNode);
-        for (unsigned b = 0; b < 256; b++) {
-            if (node->childIndex[b] != emptyMarker) {
-                newNode->key[newNode->count] = flipSign(b);
-                newNode->child[newNode->count] =
-                    node->child[node->childIndex[b]];
-                newNode->count++;
-            }
-        }
-        delete node;
-    }
+    // Shrink to Node16
+    if (node->count <= shrinkCount) shrinkNode48(node, nodeRef, alloc);
 }
 
-void eraseNode256(Node256* node, ArtNode** nodeRef, uint8_t keyByte) {
+template <typename Alloc>
+void eraseNode256(Node256* node, ArtNode** nodeRef, uint8_t keyByte,
+                  Alloc& alloc, unsigned shrinkCount = 37) {
     // Delete leaf from inner node
     node->child[keyByte] = NULL;
     node->count--;
 
-    if (node->count == 37) {
-        // Shrink to Node48
-        Node48* newNode = new Node48();
-        *nodeRef = newNode;
-        copyPrefix(node, newNode);
-        for (unsigned b = 0; b < 256; b++) {
-            if (node->child[b]) {
-                newNode->childIndex[b] = newNode->count;
-                newNode->child[newNode->count] = node->child[b];
-                newNode->count++;
-            }
+    // Shrink to Node48
+    if (node->count <= shrinkCount) shrinkNode256(node, nodeRef, alloc);
+}
+
+bool insertGrows(ArtNode* node) {
+    // Does inserting another child replace the node with a larger type?
+    switch (node->type) {
+        case NodeType4:
+            return node->count == 4;
+        case NodeType16:
+            return node->count == 16;
+        case NodeType48:
+            return node->count == 48;
+        default:
+            return false;
+    }
+}
+
+bool eraseShrinks(ArtNode* node,
+                  const ShrinkPolicy& policy = ShrinkPolicy()) {
+    // Does erasing a child replace the node with a smaller type? A Node4 left
+    // with one child is merged into that child.
+    if (node->type == NodeType4) return node->count == 2;
+    return node->count - 1u <= policy.count(node->type);
+}
+
+template <typename Alloc>
+bool compactNode(ArtNode** nodeRef, Alloc& alloc) {
+    // Replace the node in a slot by the smallest type eager shrinking would
+    // have left it at, return whether it changed
+    static const ShrinkPolicy eager;
+    ArtNode* original = *nodeRef;
+    if ((*nodeRef)->type == NodeType256 && (*nodeRef)->count <= eager.node256)
+        shrinkNode256(static_cast<Node256*>(*nodeRef), nodeRef, alloc);
+    if ((*nodeRef)->type == NodeType48 && (*nodeRef)->count <= eager.node48)
+        shrinkNode48(static_cast<Node48*>(*nodeRef), nodeRef, alloc);
+    if ((*nodeRef)->type == NodeType16 && (*nodeRef)->count <= eager.node16)
+        shrinkNode16(static_cast<Node16*>(*nodeRef), nodeRef, alloc);
+    return *nodeRef != original;
+}
+
+template <typename Alloc>
+void insertChild(ArtNode* node, ArtNode** nodeRef, uint8_t keyByte,
+                 ArtNode* child, Alloc& alloc) {
+    // Insert a child into an inner node of any type, *nodeRef is replaced if
+    // the node grows
+    switch (node->type) {
+        case NodeType4:
+            insertNode4(static_cast<Node4*>(node), nodeRef, keyByte, child,
+                        alloc);
+            break;
+        case NodeType16:
+            insertNode16(static_cast<Node16*>(node), nodeRef, keyByte, child,
+                         alloc);
+            break;
+        case NodeType48:
+            insertNode48(static_cast<Node48*>(node), nodeRef, keyByte, child,
+                         alloc);
+            break;
+        case NodeType256:
+            insertNode256(static_cast<Node256*>(node), nodeRef, keyByte, child,
+                          alloc);
+            break;
+    }
+}
+
+template <typename Alloc>
+void eraseChild(ArtNode* node, ArtNode** nodeRef, ArtNode** leafPlace,
+                uint8_t keyByte, Alloc& alloc,
+                const ShrinkPolicy& policy = ShrinkPolicy()) {
+    // Remove the child in slot leafPlace (with key byte keyByte) from an inner
+    // node of any type, *nodeRef is replaced if the node shrinks
+    switch (node->type) {
+        case NodeType4:
+            eraseNode4(static_cast<Node4*>(node), nodeRef, leafPlace, alloc);
+            break;
+        case NodeType16:
+            eraseNode16(static_cast<Node16*>(node), nodeRef, leafPlace, alloc,
+                        policy.node16);
+            break;
+        case NodeType48:
+            eraseNode48(static_cast<Node48*>(node), nodeRef, keyByte, alloc,
+                        policy.node48);
+            break;
+        case NodeType256:
+            eraseNode256(static_cast<Node256*>(node), nodeRef, keyByte, alloc,
+                         policy.node256);
+            break;
+    }
+}
+
+void appendChild(ArtNode* n, uint8_t keyByte, ArtNode* child) {
+    // Add a child whose key byte is greater than those of all present
+    // children to a node with room for it, used when building a tree bottom-up
+    switch (n->type) {
+        case NodeType4: {
+            Node4* node = static_cast<Node4*>(n);
+            node->key[node->count] = keyByte;
+            node->child[node->count] = child;
+            break;
+        }
+        case NodeType16: {
+            Node16* node = static_cast<Node16*>(n);
+            node->key[node->count] = flipSign(keyByte);
+            node->child[node->count] = child;
+            break;
+        }
+        case NodeType48: {
+            Node48* node = static_cast<Node48*>(n);
+            node->childIndex[keyByte] = node->count;
+            node->child[node->count] = child;
+            break;
         }
-        delete node;
+        case NodeType256:
+            static_cast<Node256*>(n)->child[keyByte] = child;
+            break;
     }
+    n->count++;
+}
+
+template <typename Alloc>
+void growNode(ArtNode* node, ArtNode** nodeRef, unsigned children,
+              Alloc& alloc) {
+    // Replace a node by the smallest type with room for children, which
+    // takes several grows at once when many children are about to come
+    assert(children > node->count && children <= 256);
+    ArtNode* newNode;
+    if (children <= 16)
+        newNode = alloc.template allocate<Node16>();
+    else if (children <= 48)
+        newNode = alloc.template allocate<Node48>();
+    else
+        newNode = alloc.template allocate<Node256>();
+    assert(newNode->type > node->type);
+    copyPrefix(node, newNode);
+    for (int pos = nextChild(node, -1); pos >= 0; pos = nextChild(node, pos))
+        appendChild(newNode, keyByteAt(node, pos), childAt(node, pos));
+    *nodeRef = newNode;
+    alloc.deallocate(node);
 }
-}  // namespace ART
\ No newline at end of file
+
+// Key and leaf handling shared by the tree variants. The KeyLoader turns a
+// Key into its binary-comparable bytes (encode) and, for pseudo-leaves,
+// reconstructs the key of a stored tuple from the value in a leaf (load).
+// Keys are at most KeyLoader::keyLength bytes; the bound is a compile-time
+// constant so leaf and prefix comparisons of fixed-size keys are unrolled.
+// A longer key (e.g. a string the loader could not encode in the bound)
+// is never present: lookups miss, insert and erase return false. Neither
+// is a key that is a proper prefix of a present key or has one as its
+// prefix: insert and upsert return false and leave the tree unchanged, in
+// Tree, OLC::Tree and ROWEX::Tree alike.
+// With StoredLeaves the key bytes live in the leaf and the value can be any
+// trivially copyable type.
+template <typename Key, typename Value, typename KeyLoader, typename Leaves>
+class TreeBase {
+   public:
+    static const bool storedLeaves = std::is_same<Leaves, StoredLeaves>::value;
+    static const unsigned maxKeyLength = KeyLoader::keyLength;
+
+    static_assert(storedLeaves || std::is_same<Leaves, PseudoLeaves>::value,
+                  "Leaves must be PseudoLeaves or StoredLeaves");
+    static_assert(storedLeaves || (std::is_integral<Value>::value &&
+                                   sizeof(Value) <= sizeof(uintptr_t)),
+                  "pseudo-leaves store the value in a tagged pointer");
+    static_assert(std::is_trivially_copyable<Value>::value,
+                  "leaf values are copied bytewise");
+
+    typedef LeafRecord<Value> Leaf;
+
+    explicit TreeBase(KeyLoader loader) : loader(loader) {}
+
+    static Value value(ArtNode* leaf) {
+        // The value stored in a leaf returned by lookup
+        if constexpr (storedLeaves)
+            return leafRecord(leaf)->value;
+        else
+            return static_cast<Value>(getLeafValue(leaf));
+    }
+
+    const uint8_t* leafKey(ArtNode* leaf, uint8_t buffer[]) const {
+        // The key bytes of a leaf; stored leaves return their own bytes,
+        // pseudo-leaves load the key into the buffer (maxKeyLength bytes)
+        if constexpr (storedLeaves) {
+            (void)buffer;
+            return leafRecord(leaf)->key();
+        } else {
+            loader.load(getLeafValue(leaf), buffer);
+            return buffer;
+        }
+    }
+
+    static unsigned leafKeyLength(ArtNode* leaf) {
+        if constexpr (storedLeaves)
+            return leafRecord(leaf)->keyLength;
+        else
+            return (void)leaf, maxKeyLength;
+    }
+
+    static Leaf* leafRecord(ArtNode* leaf) {
+        // The out-of-line record behind a tagged stored leaf
+        return reinterpret_cast<Leaf*>(reinterpret_cast<uintptr_t>(leaf) &
+                                       ~uintptr_t(1));
+    }
+
+    static int compareKeys(const uint8_t a[], unsigned aLength,
+                           const uint8_t b[], unsigned bLength) {
+        // Lexicographic comparison of key bytes, a proper prefix sorts first
+        int c = memcmp(a, b, min(aLength, bLength));
+        if (c) return c;
+        return (aLength > bLength) - (aLength < bLength);
+    }
+
+    static unsigned withinKey(unsigned length, unsigned depth) {
+        // A compare length from depth on, cut to the maxKeyLength bytes of
+        // any key. The compared key ends within them already; the cut lets
+        // the compiler bound compares against a loaded key.
+        return min(length, maxKeyLength > depth ? maxKeyLength - depth : 0);
+    }
+
+    static unsigned commonBytes(const uint8_t a[], const uint8_t b[],
+                                unsigned limit, unsigned depth) {
+        // Number of equal bytes of two keys from depth up to limit, their
+        // shorter length; the keys are equal above depth. They are compared
+        // from the first byte, which bounds the compare by maxKeyLength
+        // where limit is known to be within it.
+        return depth < limit ? mismatch(a, b, limit) - depth : 0;
+    }
+
+    const KeyLoader& keyLoader() const { return loader; }
+
+   protected:
+    template <typename Alloc>
+    static ArtNode* newLeaf(const uint8_t key[], unsigned keyLength,
+                            Value value, Alloc& alloc) {
+        // Create the leaf for a new key
+        assert(keyLength <= maxKeyLength);
+        if constexpr (storedLeaves) {
+            Leaf* leaf = static_cast<Leaf*>(
+                alloc.allocateLeaf(Leaf::size(keyLength)));
+            leaf->value = value;
+            leaf->keyLength = keyLength;
+            memcpy(leaf->key(), key, keyLength);
+            return reinterpret_cast<ArtNode*>(
+                reinterpret_cast<uintptr_t>(leaf) | 1);
+        } else {
+            (void)key, (void)keyLength, (void)alloc;
+            return makeLeaf(static_cast<uintptr_t>(value));
+        }
+    }
+
+    template <typename Alloc>
+    static void freeLeaf(ArtNode* leaf, Alloc& alloc) {
+        // Release an erased leaf, pseudo-leaves own no memory
+        if constexpr (storedLeaves)
+            alloc.deallocateLeaf(leafRecord(leaf),
+                                 Leaf::size(leafRecord(leaf)->keyLength));
+        else
+            (void)leaf, (void)alloc;
+    }
+
+    bool leafMatches(ArtNode* leaf, const uint8_t key[], unsigned keyLength,
+                     unsigned depth) const {
+        // Check if the key of the leaf is equal to the searched key, the
+        // bytes before depth are known to match
+        if constexpr (storedLeaves) {
+            // A single compare against the bytes in the leaf
+            (void)depth;
+            const Leaf* l = leafRecord(leaf);
+            return l->keyLength == keyLength &&
+                   mismatch(l->key(), key, keyLength) == keyLength;
+        } else {
+            // A key longer than the loaded ones matches none of them
+            if (keyLength > maxKeyLength) return false;
+            if (depth < keyLength) {
+                uint8_t leafKey[maxKeyLength];
+                loader.load(getLeafValue(leaf), leafKey);
+                if (keyLength == maxKeyLength)
+                    // Fixed-size compare of the whole key
+                    return memcmp(leafKey, key, maxKeyLength) == 0;
+                return mismatch(leafKey, key, keyLength) == keyLength;
+            }
+            return true;
+        }
+    }
+
+    KeyLoader loader;
+};
+
+// Adaptive radix tree, see TreeBase for the key and leaf parameters and
+// InlinePrefixes for the Prefixes parameter. Each tree owns its nodes,
+// leaves and prefixes.
+template <typename Key, typename Value = uintptr_t,
+          typename KeyLoader = IntegerKeyLoader<Key>,
+          typename Leaves = PseudoLeaves, typename Prefixes = InlinePrefixes>
+class Tree : public TreeBase<Key, Value, KeyLoader, Leaves> {
+    typedef TreeBase<Key, Value, KeyLoader, Leaves> Base;
+
+   public:
+    using Base::compareKeys;
+    using Base::leafKey;
+    using Base::leafKeyLength;
+    using Base::maxKeyLength;
+    using Base::storedLeaves;
+    using Base::value;
+    typedef typename Base::Leaf Leaf;
+
+    static const bool storedPrefixes =
+        std::is_same<Prefixes, StoredPrefixes>::value;
+    static_assert(storedPrefixes ||
+                      std::is_same<Prefixes, InlinePrefixes>::value,
+                  "Prefixes must be InlinePrefixes or StoredPrefixes");
+
+    // Widest jump table, in key bytes (256^3 entries)
+    static const unsigned maxJumpBytes = 3;
+
+    explicit Tree(KeyLoader loader = KeyLoader(),
+                  const MemoryOptions& memory = MemoryOptions())
+        : Base(loader), root(NULL), alloc(memory) {}
+
+    explicit Tree(const MemoryOptions& memory)
+        : Base(KeyLoader()), root(NULL), alloc(memory) {}
+
+    Tree(const Tree&) = delete;
+    Tree& operator=(const Tree&) = delete;
+
+    // Trees move in O(1): the nodes and leaves change owner in place. The
+    // tree moved from is left empty and can be used again, with its own
+    // memory options; BackgroundReclaimer::retire relies on both.
+    Tree(Tree&& other) noexcept
+        : Base(other.loader),
+          root(NULL),
+          alloc(other.alloc.memoryOptions()) {
+        swap(other);
+    }
+
+    Tree& operator=(Tree&& other) noexcept {
+        // The nodes of this tree are freed with the temporary
+        Tree moved(std::move(other));
+        swap(moved);
+        return *this;
+    }
+
+    void swap(Tree& other) noexcept {
+        std::swap(loader, other.loader);
+        std::swap(root, other.root);
+        alloc.swap(other.alloc);
+        std::swap(jump, other.jump);
+        std::swap(shrink, other.shrink);
+        std::swap(transitionCounts, other.transitionCounts);
+        filter.swap(other.filter);
+    }
+
+    void clear() {
+        // Free all nodes and leaves; the allocator returns its chunks
+        // (unmaps its arena), O(chunks) instead of a walk over the nodes.
+        // The destructor does the same. Options and the jump table width
+        // are kept.
+        alloc.release();
+        root = NULL;
+        rebuildJump();
+        filter.clear();
+    }
+
+    ArtNode* lookup(const uint8_t key[],
+                    unsigned keyLength = maxKeyLength) const {
+        // Find the leaf with a matching key, optimistic version
+        if (keyLength > maxKeyLength) return NULL;
+        if (filter.enabled() && !filter.mayContain(key, keyLength))
+            return NULL;
+        unsigned depth;
+        ArtNode* node = start(key, keyLength, depth);
+        return lookup(node, key, keyLength, depth);
+    }
+
+    ArtNode* lookup(const Key& key) const {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return lookup(k, keyLength);
+    }
+
+    void enableJumpTable(unsigned keyBytes) {
+        // Index the subtrees below the first keyBytes key bytes after the
+        // prefix shared by all keys (the root prefix) in a table of
+        // 256^keyBytes entries, 0 drops the table. Lookups of keys that
+        // long start at the entry of their bytes instead of the root, which
+        // skips the top levels of dense trees; insert and erase refresh the
+        // entries below the nodes they replace. Call again after the root
+        // was set by other means, e.g. loadSnapshot.
+        assert(keyBytes <= maxJumpBytes);
+        jump.bytes = keyBytes;
+        std::vector<JumpEntry>().swap(jump.entries);
+        if (keyBytes) jump.entries.resize(size_t(1) << (8 * keyBytes));
+        rebuildJump();
+    }
+
+    unsigned jumpTableBytes() const { return jump.bytes; }
+
+    void enableFilter(size_t keys = 0, unsigned countersPerKey = 8) {
+        // Keep a counting Bloom filter of the keys that lookups check
+        // first, so most lookups of missing keys return without a
+        // traversal; insert and erase keep it current. It takes
+        // countersPerKey / 2 bytes per key it is sized for, keys, or twice
+        // the keys present for 0 (counted by stats()). False positives grow
+        // once more keys are in it, call again to rebuild it larger, and
+        // after the root was set by other means, e.g. loadSnapshot.
+        if (keys == 0) keys = 2 * std::max<size_t>(stats().leaves, 1);
+        filter.reset(keys, countersPerKey);
+        if (!root) return;
+        uint8_t buffer[maxKeyLength];
+        std::vector<ArtNode*> stack(1, root);
+        while (!stack.empty()) {
+            ArtNode* node = stack.back();
+            stack.pop_back();
+            if (isLeaf(node)) {
+                filter.add(leafKey(node, buffer), leafKeyLength(node));
+                continue;
+            }
+            for (int pos = nextChild(node, -1); pos >= 0;
+                 pos = nextChild(node, pos))
+                stack.push_back(childAt(node, pos));
+        }
+    }
+
+    void disableFilter() { filter.release(); }
+
+    const CountingBloomFilter& membershipFilter() const { return filter; }
+
+    ArtNode* lookupPessimistic(const uint8_t key[],
+                               unsigned keyLength = maxKeyLength) const {
+        // Find the leaf with a matching key, checking every prefix
+        if (keyLength > maxKeyLength) return NULL;
+        if (filter.enabled() && !filter.mayContain(key, keyLength))
+            return NULL;
+        return lookupPessimistic(root, key, keyLength, 0);
+    }
+
+    void lookupBatch(const uint8_t* const keys[], const unsigned keyLengths[],
+                     size_t n, ArtNode* results[]) const {
+        // Look up n keys at once, results[i] is what lookup(keys[i],
+        // keyLengths[i]) returns. Up to batchWidth traversals are
+        // interleaved (AMAC): each step handles one node of one key and
+        // prefetches its child, then moves on to the next key while the
+        // child is loaded. keyLengths may be NULL for full-length keys.
+        BatchState state[batchWidth];
+        unsigned active = 0;
+        size_t next = 0;
+        while (active < batchWidth && next < n)
+            startLookup(state[active++], keys, keyLengths, next++);
+
+        unsigned i = 0;
+        while (active) {
+            BatchState& s = state[i];
+            ArtNode* result;
+            if (lookupStep(s, result)) {
+                results[s.index] = result;
+                if (next < n) {
+                    startLookup(s, keys, keyLengths, next++);
+                } else {
+                    // Fill the hole with the last traversal
+                    s = state[--active];
+                    if (i == active) i = 0;
+                    continue;
+                }
+            }
+            if (++i == active) i = 0;
+        }
+    }
+
+    void lookupBatch(const uint8_t* const keys[], size_t n,
+                     ArtNode* results[]) const {
+        lookupBatch(keys, NULL, n, results);
+    }
+
+    void lookupBatch(const Key keys[], size_t n, ArtNode* results[]) const {
+        // Encode the keys one group at a time and look the group up
+        static const size_t group = 64;
+        uint8_t buffer[group][maxKeyLength];
+        const uint8_t* k[group];
+        unsigned keyLengths[group];
+        for (size_t start = 0; start < n; start += group) {
+            size_t count = std::min(n - start, group);
+            for (size_t i = 0; i < count; i++) {
+                keyLengths[i] = loader.encode(keys[start + i], buffer[i]);
+                k[i] = buffer[i];
+            }
+            lookupBatch(k, keyLengths, count, results + start);
+        }
+    }
+
+    bool insert(const uint8_t key[], Value value) {
+        // Insert the value with the given key bytes, return false (and leave
+        // the tree unchanged) if the key is already present
+        return insert(&root, 0, key, maxKeyLength, value, KeepExisting,
+                      NULL);
+    }
+
+    bool insert(const uint8_t key[], unsigned keyLength, Value value) {
+        return insert(&root, 0, key, keyLength, value, KeepExisting, NULL);
+    }
+
+    bool insert(const Key& key, Value value) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return insert(&root, 0, k, keyLength, value, KeepExisting, NULL);
+    }
+
+    size_t insertBatch(const uint8_t* const keys[], const unsigned keyLengths[],
+                       const Value values[], size_t n) {
+        // Insert n keys, return the number that were not present yet; the
+        // result is the same as inserting them one by one in order, into a
+        // tree of any content. Sorted (or nearly sorted) batches are faster:
+        // every insert resumes at the deepest slot the previous key passed
+        // within the key bytes both share, and a node that has to grow takes
+        // room for the children the next keys bring along. keyLengths may
+        // be NULL for full-length keys.
+        InsertBatch batch;
+        return insertBatch(batch, keys, keyLengths, values, n);
+    }
+
+    size_t insertBatch(const Key keys[], const Value values[], size_t n) {
+        // Encode the keys one group at a time, alternating between two
+        // buffers so the previous key outlives its group
+        static const size_t group = batchLookahead;
+        uint8_t buffer[2][group][maxKeyLength];
+        const uint8_t* k[group];
+        unsigned keyLengths[group];
+        InsertBatch batch;
+        size_t inserted = 0;
+        for (size_t start = 0; start < n; start += group) {
+            size_t count = std::min(n - start, group);
+            uint8_t(*b)[maxKeyLength] = buffer[(start / group) % 2];
+            for (size_t i = 0; i < count; i++) {
+                keyLengths[i] = loader.encode(keys[start + i], b[i]);
+                k[i] = b[i];
+            }
+            inserted +=
+                insertBatch(batch, k, keyLengths, values + start, count);
+        }
+        return inserted;
+    }
+
+    bool insertIfAbsent(const uint8_t key[], unsigned keyLength, Value value,
+                        Value& existing) {
+        // Insert like insert, or return the value of the present key in
+        // existing
+        return insert(&root, 0, key, keyLength, value, KeepExisting,
+                      &existing);
+    }
+
+    bool insertIfAbsent(const Key& key, Value value, Value& existing) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return insertIfAbsent(k, keyLength, value, existing);
+    }
+
+    bool upsert(const uint8_t key[], unsigned keyLength, Value value) {
+        // Insert the value, or overwrite the value of the present key in its
+        // leaf; return true if the key was new. One traversal, no node
+        // changes for a present key. With pseudo-leaves the new value has to
+        // load the same key, e.g. another tuple identifier of the same key;
+        // one that does not is not stored.
+        return insert(&root, 0, key, keyLength, value, ReplaceExisting,
+                      NULL);
+    }
+
+    bool upsert(const uint8_t key[], unsigned keyLength, Value value,
+                Value& previous) {
+        // Upsert, the value replaced is returned in previous
+        return insert(&root, 0, key, keyLength, value, ReplaceExisting,
+                      &previous);
+    }
+
+    bool upsert(const Key& key, Value value) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return upsert(k, keyLength, value);
+    }
+
+    bool upsert(const Key& key, Value value, Value& previous) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return upsert(k, keyLength, value, previous);
+    }
+
+    bool compareExchange(const uint8_t key[], unsigned keyLength,
+                         Value& expected, Value desired) {
+        // Replace the value of a present key with desired if it equals
+        // expected. Otherwise return false, with the current value in
+        // expected if the key is present; absent keys are not inserted.
+        // With pseudo-leaves a desired value that does not load the key is
+        // refused the same way, the key keeps expected.
+        unsigned slotDepth;
+        ArtNode** slot = leafSlot(key, keyLength, slotDepth);
+        if (!slot) return false;
+        Value current = value(*slot);
+        if (memcmp(&current, &expected, sizeof(Value)) != 0) {
+            expected = current;
+            return false;
+        }
+        return replaceValue(slot, slotDepth, key, keyLength, desired);
+    }
+
+    bool compareExchange(const Key& key, Value& expected, Value desired) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return compareExchange(k, keyLength, expected, desired);
+    }
+
+    void bulkLoad(const uint8_t* const keys[], const unsigned keyLengths[],
+                  const Value values[], size_t n, unsigned threads = 1) {
+        // Build the tree from n keys in strictly increasing order, none a
+        // prefix of another or longer than maxKeyLength; the tree must be
+        // empty. keyLengths may be NULL for full-length keys. Each inner
+        // node is allocated once at its final type. With threads > 1 the
+        // subtrees below the root are built in parallel, every thread from
+        // its own allocator.
+        assert(root == NULL);
+        if (n == 0) return;
+        BulkInput in = {keys, keyLengths, values};
+        if (threads <= 1 || n == 1) {
+            root = bulkBuild(in, 0, n, 0, alloc);
+            rebuildJump();
+            filterBulk(keys, keyLengths, n);
+            return;
+        }
+
+        BulkRuns runs;
+        root = bulkNode(in, 0, n, 0, runs, alloc);
+        ArtNode* children[256];
+        std::vector<Allocator> allocs;
+        allocs.reserve(threads);
+        for (unsigned t = 0; t < threads; t++)
+            allocs.emplace_back(alloc.memoryOptions());
+        std::vector<std::thread> workers;
+        std::atomic<unsigned> nextRun(0);
+        for (unsigned t = 0; t < threads; t++)
+            workers.emplace_back([&, t] {
+                // Runs are claimed one at a time to balance skewed partitions
+                for (unsigned i = nextRun++; i < runs.count; i = nextRun++)
+                    children[i] = bulkBuild(in, i ? runs.end[i - 1] : 0,
+                                            runs.end[i], runs.depth + 1,
+                                            allocs[t]);
+            });
+        for (std::thread& worker : workers) worker.join();
+        for (unsigned i = 0; i < runs.count; i++)
+            appendChild(root, runs.byte[i], children[i]);
+        for (Allocator& a : allocs) alloc.merge(a);
+        rebuildJump();
+        filterBulk(keys, keyLengths, n);
+    }
+
+    void bulkLoad(const Key keys[], const Value values[], size_t n,
+                  unsigned threads = 1) {
+        // Encode the keys up front, then build from the bytes; keys that
+        // are too long are left out
+        std::vector<uint8_t> buffer(n * maxKeyLength);
+        std::vector<const uint8_t*> k(n);
+        std::vector<unsigned> keyLengths(n);
+        std::vector<Value> kept;  // values of the kept keys, once one is out
+        bool dropped = false;
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++) {
+            k[m] = &buffer[i * maxKeyLength];
+            keyLengths[m] = loader.encode(keys[i], &buffer[i * maxKeyLength]);
+            if (keyLengths[m] <= maxKeyLength) {
+                if (dropped) kept.push_back(values[i]);
+                m++;
+            } else if (!dropped) {
+                dropped = true;
+                kept.assign(values, values + i);
+            }
+        }
+        bulkLoad(k.data(), keyLengths.data(), dropped ? kept.data() : values,
+                 m, threads);
+    }
+
+    bool erase(const uint8_t key[], unsigned keyLength = maxKeyLength) {
+        // Delete the leaf with the given key bytes, return false if the key
+        // is not present
+        return erase(key, keyLength, static_cast<Value*>(NULL));
+    }
+
+    bool erase(const uint8_t key[], unsigned keyLength, Value& erased) {
+        // Delete the leaf and return its value in erased
+        return erase(key, keyLength, &erased);
+    }
+
+    bool erase(const Key& key) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return erase(k, keyLength, static_cast<Value*>(NULL));
+    }
+
+    bool erase(const Key& key, Value& erased) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return erase(k, keyLength, &erased);
+    }
+
+    ArtNode* minimum() const { return ART::minimum(root); }
+    ArtNode* maximum() const { return ART::maximum(root); }
+
+    // Bidirectional iterator over the leaves in key order. The path from the
+    // root is kept on an explicit stack, each inner node consumes at least
+    // one key byte so maxKeyLength frames suffice.
+    class Iterator {
+       public:
+        Iterator() : tree(NULL), current(NULL), height(0) {}
+
+        bool valid() const { return current != NULL; }
+        ArtNode* leaf() const { return current; }
+        ArtNode* operator*() const { return current; }
+        Value value() const { return Base::value(current); }
+
+        const uint8_t* key(uint8_t buffer[]) const {
+            // Key bytes of the current leaf, see Tree::leafKey
+            return tree->leafKey(current, buffer);
+        }
+        unsigned keyLength() const { return Tree::leafKeyLength(current); }
+
+        Iterator& operator++() {
+            // Advance to the next leaf, past the last leaf becomes end()
+            while (height) {
+                Frame& f = stack[height - 1];
+                int pos = nextChild(f.node, f.pos);
+                if (pos >= 0) {
+                    f.pos = pos;
+                    descendFirst(childAt(f.node, pos));
+                    return *this;
+                }
+                height--;
+            }
+            current = NULL;
+            return *this;
+        }
+
+        Iterator& operator--() {
+            // Step back to the previous leaf, end() steps to the last leaf
+            if (!current) {
+                descendLast(tree->root);
+                return *this;
+            }
+            while (height) {
+                Frame& f = stack[height - 1];
+                int pos = prevChild(f.node, f.pos);
+                if (pos >= 0) {
+                    f.pos = pos;
+                    descendLast(childAt(f.node, pos));
+                    return *this;
+                }
+                height--;
+            }
+            current = NULL;
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const {
+            return current == other.current;
+        }
+        bool operator!=(const Iterator& other) const {
+            return current != other.current;
+        }
+
+       private:
+        friend class Tree;
+
+        struct Frame {
+            ArtNode* node;
+            int pos;
+        };
+
+        explicit Iterator(const Tree* tree)
+            : tree(tree), current(NULL), height(0) {}
+
+        void push(ArtNode* node, int pos) {
+            assert(height < maxKeyLength);
+            stack[height].node = node;
+            stack[height].pos = pos;
+            height++;
+        }
+
+        void descendFirst(ArtNode* node) {
+            // Follow the smallest children down to a leaf
+            if (!node) {
+                current = NULL;
+                return;
+            }
+            while (!isLeaf(node)) {
+                int pos = nextChild(node, -1);
+                push(node, pos);
+                node = childAt(node, pos);
+            }
+            current = node;
+        }
+
+        void descendLast(ArtNode* node) {
+            // Follow the largest children down to a leaf
+            if (!node) {
+                current = NULL;
+                return;
+            }
+            while (!isLeaf(node)) {
+                int pos = prevChild(node, 256);
+                push(node, pos);
+                node = childAt(node, pos);
+            }
+            current = node;
+        }
+
+        void seek(const uint8_t key[], unsigned keyLength) {
+            // Position on the first leaf whose key is >= key
+            ArtNode* node = tree->root;
+            unsigned depth = 0;
+            height = 0;
+            if (!node) {
+                current = NULL;
+                return;
+            }
+            while (!isLeaf(node)) {
+                if (node->prefixLength) {
+                    uint8_t buffer[maxKeyLength];
+                    const uint8_t* prefix = prefixBytes(node);
+                    if (!storedPrefixes && node->prefixLength > maxPrefixLength)
+                        prefix = tree->leafKey(ART::minimum(node), buffer) +
+                                 depth;
+                    unsigned length = min(
+                        depth < keyLength ? keyLength - depth : 0,
+                        node->prefixLength);
+                    int c = memcmp(key + depth, prefix, length);
+                    // A key that ends inside the prefix sorts before it
+                    if (c < 0 || (c == 0 && length < node->prefixLength))
+                        return descendFirst(node);
+                    if (c > 0) {
+                        // Every key below the node is smaller
+                        ++*this;
+                        return;
+                    }
+                    depth += node->prefixLength;
+                }
+                if (depth >= keyLength) return descendFirst(node);
+                int pos = lowerChild(node, key[depth]);
+                if (pos < 0) {
+                    ++*this;
+                    return;
+                }
+                push(node, pos);
+                if (keyByteAt(node, pos) != key[depth])
+                    return descendFirst(childAt(node, pos));
+                node = childAt(node, pos);
+                depth++;
+            }
+            current = node;
+            uint8_t buffer[maxKeyLength];
+            if (compareKeys(tree->leafKey(node, buffer), leafKeyLength(node),
+                            key, keyLength) < 0)
+                ++*this;
+        }
+
+        const Tree* tree;
+        ArtNode* current;
+        unsigned height;
+        Frame stack[maxKeyLength];
+    };
+
+    Iterator begin() const {
+        // Iterator at the smallest key
+        Iterator it(this);
+        it.descendFirst(root);
+        return it;
+    }
+
+    Iterator end() const { return Iterator(this); }
+
+    Iterator lowerBound(const uint8_t key[],
+                        unsigned keyLength = maxKeyLength) const {
+        // Iterator at the first key >= key
+        Iterator it(this);
+        it.seek(key, keyLength);
+        return it;
+    }
+
+    Iterator lowerBound(const Key& key) const {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return lowerBound(k, keyLength);
+    }
+
+    Iterator upperBound(const uint8_t key[],
+                        unsigned keyLength = maxKeyLength) const {
+        // Iterator at the first key > key
+        Iterator it = lowerBound(key, keyLength);
+        if (it.valid()) {
+            uint8_t buffer[maxKeyLength];
+            if (compareKeys(it.key(buffer), it.keyLength(), key, keyLength) ==
+                0)
+                ++it;
+        }
+        return it;
+    }
+
+    Iterator upperBound(const Key& key) const {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return upperBound(k, keyLength);
+    }
+
+    template <typename Callback>
+    size_t scan(const uint8_t lo[], unsigned loLength, const uint8_t hi[],
+                unsigned hiLength, Callback callback,
+                size_t limit = SIZE_MAX) const {
+        // Call callback(leaf) for the leaves with keys in [lo, hi] in key
+        // order, at most limit of them; return the number visited
+        size_t n = 0;
+        uint8_t buffer[maxKeyLength];
+        for (Iterator it = lowerBound(lo, loLength); it.valid() && n < limit;
+             ++it) {
+            if (compareKeys(it.key(buffer), it.keyLength(), hi, hiLength) > 0)
+                break;
+            callback(it.leaf());
+            n++;
+        }
+        return n;
+    }
+
+    template <typename Callback>
+    size_t scan(const Key& lo, const Key& hi, Callback callback,
+                size_t limit = SIZE_MAX) const {
+        uint8_t l[maxKeyLength], h[maxKeyLength];
+        unsigned loLength = loader.encode(lo, l);
+        unsigned hiLength = loader.encode(hi, h);
+        return scan(l, loLength, h, hiLength, callback, limit);
+    }
+
+    bool empty() const { return root == NULL; }
+    ArtNode* getRoot() const { return root; }
+    const Allocator& allocator() const { return alloc; }
+
+    void setShrinkPolicy(const ShrinkPolicy& policy) {
+        // When erase shrinks nodes from now on; present nodes keep their
+        // types until erase reaches the new counts. Counts set directly on
+        // the policy are clamped like those of its constructor.
+        shrink = ShrinkPolicy(policy.node16, policy.node48, policy.node256);
+    }
+
+    const ShrinkPolicy& shrinkPolicy() const { return shrink; }
+    const TransitionCounts& transitions() const { return transitionCounts; }
+
+    size_t compact() {
+        // Shrink every node that erase kept larger than eager shrinking
+        // would have, e.g. while the tree is idle after a burst of erases;
+        // return the number of nodes replaced. O(nodes).
+        if (!root) return 0;
+        size_t replaced = compact(&root);
+        transitionCounts.compacted += replaced;
+        if (replaced) rebuildJump();
+        return replaced;
+    }
+
+    TreeStats stats() const {
+        // Walk the tree for node counts and histograms, O(nodes); the
+        // allocator keeps the node and leaf counts without a walk
+        TreeStats stats;
+        stats.reservedBytes = alloc.bytesReserved();
+        stats.filterBytes = filter.bytes();
+        stats.transitions = transitionCounts;
+        if (!root) return stats;
+        std::vector<std::pair<ArtNode*, unsigned>> stack;
+        stack.emplace_back(root, 0);
+        while (!stack.empty()) {
+            ArtNode* node = stack.back().first;
+            unsigned depth = stack.back().second;
+            stack.pop_back();
+            if (isLeaf(node)) {
+                stats.leaves++;
+                if (stats.depth.size() <= depth) stats.depth.resize(depth + 1);
+                stats.depth[depth]++;
+                if constexpr (storedLeaves)
+                    stats.leafBytes += Leaf::size(leafKeyLength(node));
+                continue;
+            }
+            stats.nodes[node->type]++;
+            switch (node->type) {
+                case NodeType4:
+                    stats.nodeBytes += sizeof(Node4);
+                    break;
+                case NodeType16:
+                    stats.nodeBytes += sizeof(Node16);
+                    break;
+                case NodeType48:
+                    stats.nodeBytes += sizeof(Node48);
+                    break;
+                case NodeType256:
+                    stats.nodeBytes += sizeof(Node256);
+                    break;
+            }
+            if (stats.prefixLength.size() <= node->prefixLength)
+                stats.prefixLength.resize(node->prefixLength + 1);
+            stats.prefixLength[node->prefixLength]++;
+            if (hasStoredPrefix(node))
+                stats.prefixBytes += node->prefixLength;
+            else if (node->prefixLength > maxPrefixLength)
+                stats.longPrefixes++;
+            for (int pos = nextChild(node, -1); pos >= 0;
+                 pos = nextChild(node, pos))
+                stack.emplace_back(childAt(node, pos), depth + 1);
+        }
+        return stats;
+    }
+
+   private:
+    friend struct SnapshotAccess;
+
+    using Base::leafMatches;
+    using Base::loader;
+
+    ArtNode* newLeaf(const uint8_t key[], unsigned keyLength, Value value) {
+        return Base::newLeaf(key, keyLength, value, alloc);
+    }
+
+    void freeLeaf(ArtNode* leaf) { Base::freeLeaf(leaf, alloc); }
+
+    size_t compact(ArtNode** nodeRef) {
+        // Compact the subtree in a slot, children first
+        ArtNode* node = *nodeRef;
+        if (isLeaf(node)) return 0;
+        size_t replaced = 0;
+        for (int pos = nextChild(node, -1); pos >= 0;
+             pos = nextChild(node, pos))
+            replaced += compact(findChild(node, keyByteAt(node, pos)));
+        return replaced + compactNode(nodeRef, alloc);
+    }
+
+    static bool hasStoredPrefix(const ArtNode* node) {
+        // Are the prefix bytes of the node out-of-line?
+        return storedPrefixes && node->prefixLength > maxPrefixLength;
+    }
+
+    static const uint8_t* prefixBytes(const ArtNode* node) {
+        // The prefix bytes of a node; inline prefixes only hold the first
+        // maxPrefixLength of them
+        if (hasStoredPrefix(node)) {
+            const uint8_t* bytes;
+            memcpy(&bytes, node->prefix, sizeof(bytes));
+            return bytes;
+        }
+        return node->prefix;
+    }
+
+    template <typename Alloc>
+    static void setPrefix(ArtNode* node, const uint8_t bytes[],
+                          unsigned length, Alloc& alloc) {
+        // Replace the prefix of a node, bytes may point into the old prefix
+        if (!storedPrefixes || length <= maxPrefixLength) {
+            const uint8_t* old = prefixBytes(node);
+            memmove(node->prefix, bytes, min(length, maxPrefixLength));
+            freePrefix(node, old, alloc);
+        } else {
+            uint8_t* copy = alloc.allocatePrefix(length);
+            memcpy(copy, bytes, length);
+            freePrefix(node, prefixBytes(node), alloc);
+            memcpy(node->prefix, &copy, sizeof(copy));
+        }
+        node->prefixLength = length;
+    }
+
+    template <typename Alloc>
+    static void freePrefix(ArtNode* node, const uint8_t* bytes, Alloc& alloc) {
+        // Release the out-of-line prefix of a node, bytes is prefixBytes(node)
+        if (hasStoredPrefix(node))
+            alloc.deallocatePrefix(const_cast<uint8_t*>(bytes),
+                                   node->prefixLength);
+    }
+
+    void collapseNode4(Node4* node, ArtNode** nodeRef, unsigned pos) {
+        // Replace a Node4 by its inner child at pos, the child takes over
+        // the prefix of the node and the key byte in front of it
+        ArtNode* child = node->child[pos];
+        uint8_t prefix[maxKeyLength];
+        unsigned length = node->prefixLength;
+        memcpy(prefix, prefixBytes(node), length);
+        prefix[length++] = node->key[pos];
+        memcpy(prefix + length, prefixBytes(child), child->prefixLength);
+        setPrefix(child, prefix, length + child->prefixLength, alloc);
+        freePrefix(node, prefixBytes(node), alloc);
+        *nodeRef = child;
+        alloc.deallocate(node);
+    }
+
+    unsigned prefixMismatch(ArtNode* node, const uint8_t key[],
+                            unsigned keyLength, unsigned depth) const {
+        // Compare the key with the prefix of the node, return the number
+        // matching bytes; a key ending inside the prefix matches up to its
+        // end
+        unsigned length = Base::withinKey(
+            min(node->prefixLength, keyLength > depth ? keyLength - depth : 0),
+            depth);
+        if (hasStoredPrefix(node) || node->prefixLength <= maxPrefixLength)
+            return mismatch(key + depth, prefixBytes(node), length);
+        unsigned pos = mismatch(key + depth, node->prefix,
+                                min(length, maxPrefixLength));
+        if (pos < maxPrefixLength) return pos;
+        // The rest of the prefix is read from the key of the minimum leaf
+        unsigned from = depth + pos;
+        if (from >= maxKeyLength) return pos;
+        uint8_t buffer[maxKeyLength];
+        const uint8_t* minKey = leafKey(ART::minimum(node), buffer);
+        return pos + mismatch(key + from, minKey + from,
+                              Base::withinKey(length - pos, from));
+    }
+
+    // Sorted input of bulkLoad
+    struct BulkInput {
+        const uint8_t* const* keys;
+        const unsigned* keyLengths;
+        const Value* values;
+
+        unsigned length(size_t i) const {
+            return keyLengths ? keyLengths[i] : maxKeyLength;
+        }
+    };
+
+    // Partition of a key range by the first byte after the common prefix,
+    // run i holds the keys before end[i] with key byte byte[i]
+    struct BulkRuns {
+        unsigned depth;
+        unsigned count;
+        uint8_t byte[256];
+        size_t end[256];
+    };
+
+    template <typename Alloc>
+    ArtNode* bulkBuild(const BulkInput& in, size_t lo, size_t hi,
+                       unsigned depth, Alloc& alloc) {
+        // Build the subtree of the keys [lo, hi), which agree on the bytes
+        // before depth
+        if (hi - lo == 1)
+            return Base::newLeaf(in.keys[lo], in.length(lo), in.values[lo],
+                                 alloc);
+        BulkRuns runs;
+        ArtNode* node = bulkNode(in, lo, hi, depth, runs, alloc);
+        for (unsigned i = 0; i < runs.count; i++)
+            appendChild(node, runs.byte[i],
+                        bulkBuild(in, i ? runs.end[i - 1] : lo, runs.end[i],
+                                  runs.depth + 1, alloc));
+        return node;
+    }
+
+    template <typename Alloc>
+    ArtNode* bulkNode(const BulkInput& in, size_t lo, size_t hi,
+                      unsigned depth, BulkRuns& runs, Alloc& alloc) {
+        // Create the inner node for keys [lo, hi) without its children: the
+        // common prefix is that of the first and the last key, then the runs
+        // of equal bytes after it decide the node type
+        const uint8_t* first = in.keys[lo];
+        const uint8_t* last = in.keys[hi - 1];
+        unsigned limit = min(in.length(lo), in.length(hi - 1));
+        unsigned prefixLength =
+            mismatch(first + depth, last + depth, limit - depth);
+        assert(depth + prefixLength < limit);
+        unsigned d = depth + prefixLength;
+
+        runs.depth = d;
+        runs.count = 0;
+        for (size_t start = lo; start < hi;) {
+            // Gallop to the end of the run, then binary search within the
+            // last step
+            uint8_t keyByte = in.keys[start][d];
+            size_t inRun = start, step = 1, probe = start + 1;
+            while (probe < hi && in.keys[probe][d] == keyByte) {
+                inRun = probe;
+                step *= 2;
+                probe = inRun + step;
+            }
+            size_t a = inRun + 1, b = probe < hi ? probe : hi;
+            while (a < b) {
+                size_t mid = a + (b - a) / 2;
+                if (in.keys[mid][d] == keyByte)
+                    a = mid + 1;
+                else
+                    b = mid;
+            }
+            runs.byte[runs.count] = keyByte;
+            runs.end[runs.count++] = a;
+            start = a;
+        }
+
+        ArtNode* node;
+        if (runs.count <= 4)
+            node = alloc.template allocate<Node4>();
+        else if (runs.count <= 16)
+            node = alloc.template allocate<Node16>();
+        else if (runs.count <= 48)
+            node = alloc.template allocate<Node48>();
+        else
+            node = alloc.template allocate<Node256>();
+        setPrefix(node, first + depth, prefixLength, alloc);
+        return node;
+    }
+
+    ArtNode* lookup(ArtNode* node, const uint8_t key[], unsigned keyLength,
+                    unsigned depth) const {
+        // Find the node with a matching key, optimistic version
+
+        bool skippedPrefix = false;  // Did we optimistically skip some prefix
+                                     // without checking it?
+
+        while (node != NULL) {
+            if (isLeaf(node)) {
+                if (!storedLeaves && !skippedPrefix && depth == keyLength)
+                    return node;  // No check required
+
+                // Check leaf, skipped prefix bytes have to be verified too
+                if (leafMatches(node, key, keyLength,
+                                skippedPrefix ? 0 : depth))
+                    return node;
+                return NULL;
+            }
+
+            if (node->prefixLength) {
+                // Keys below are longer than the prefix and the child byte
+                if (depth + node->prefixLength >= keyLength) return NULL;
+                if (storedPrefixes || node->prefixLength < maxPrefixLength) {
+                    if (mismatch(key + depth, prefixBytes(node),
+                                 node->prefixLength) != node->prefixLength)
+                        return NULL;
+                } else
+                    skippedPrefix = true;
+                depth += node->prefixLength;
+            }
+
+            ArtNode** child = findChild(node, key[depth]);
+            node = child ? *child : NULL;
+            depth++;
+        }
+
+        return NULL;
+    }
+
+    // Jump table: entry i is where lookups of keys whose bytes after the
+    // root prefix spell i start, the node in the slot of the first key byte
+    // past the table (or a shallower node whose prefix reaches past it, or
+    // a leaf) and its depth. Entries without keys are NULL.
+    struct JumpEntry {
+        ArtNode* node;
+        unsigned depth;
+    };
+
+    struct JumpTable {
+        JumpTable() : bytes(0), offset(0), active(false) {}
+
+        unsigned bytes;   // key bytes indexed, 0 without a table
+        unsigned offset;  // length of the root prefix
+        bool active;      // does the root prefix leave room for the bytes?
+        uint8_t prefix[maxKeyLength];  // root prefix
+        std::vector<JumpEntry> entries;
+
+        unsigned end() const { return offset + bytes; }
+
+        size_t index(const uint8_t key[], unsigned length) const {
+            // The first entry for keys starting with length bytes of key
+            size_t i = 0;
+            for (unsigned d = offset; d < end(); d++)
+                i = (i << 8) | (d < length ? key[d] : 0);
+            return i;
+        }
+    };
+
+    ArtNode* start(const uint8_t key[], unsigned keyLength,
+                   unsigned& depth) const {
+        // The node a lookup of the key starts at, and its depth
+        if (!jump.active || keyLength < jump.end()) {
+            depth = 0;
+            return root;
+        }
+        for (unsigned d = 0; d < jump.offset; d++)
+            if (key[d] != jump.prefix[d]) {
+                depth = 0;
+                return NULL;
+            }
+        const JumpEntry& e = jump.entries[jump.index(key, keyLength)];
+        depth = e.depth;
+        return e.node;
+    }
+
+    void jumpChanged(const uint8_t key[], unsigned depth) {
+        // The node in the slot after depth key bytes was replaced, or a
+        // child hangs off a new slot at that depth; refresh the entries of
+        // the keys sharing those bytes. Changes below the table need none.
+        if (!jump.bytes) return;
+        if (depth == 0) return rebuildJump();
+        if (!jump.active || depth > jump.end()) return;
+        uint8_t path[maxKeyLength];
+        memcpy(path, key, depth);
+        size_t first = jump.index(key, depth);
+        size_t count = size_t(1) << (8 * (jump.end() - depth));
+        std::fill_n(&jump.entries[first], count, JumpEntry{NULL, 0});
+        fillJump(root, 0, path, depth);
+    }
+
+    void rebuildJump() {
+        // Recompute the root prefix and every entry
+        std::fill(jump.entries.begin(), jump.entries.end(),
+                  JumpEntry{NULL, 0});
+        jump.active = jump.bytes && root && !isLeaf(root) &&
+                      root->prefixLength + jump.bytes <= maxKeyLength;
+        if (!jump.active) return;
+        jump.offset = root->prefixLength;
+        uint8_t path[maxKeyLength];
+        fillJump(root, 0, path, 0);
+        memcpy(jump.prefix, path, jump.offset);
+    }
+
+    void fillJump(ArtNode* node, unsigned depth, uint8_t path[],
+                  unsigned fixed) {
+        // Set the entries of the subtree in the slot after depth key bytes,
+        // which path leads to. Only the part of the subtree matching the
+        // bytes before fixed is visited, the other bytes of path are filled
+        // in on the way down.
+        if (!node) return;
+        if (isLeaf(node) || depth + node->prefixLength >= jump.end()) {
+            // All keys below start here, a lookup checks the prefix
+            unsigned known = std::max(fixed, depth);
+            std::fill_n(&jump.entries[jump.index(path, known)],
+                        size_t(1) << (8 * (jump.end() - known)),
+                        JumpEntry{node, depth});
+            return;
+        }
+
+        uint8_t buffer[maxKeyLength];
+        const uint8_t* prefix = prefixBytes(node);
+        if (!storedPrefixes && node->prefixLength > maxPrefixLength)
+            prefix = leafKey(ART::minimum(node), buffer) + depth;
+        for (unsigned pos = 0; pos < node->prefixLength; pos++) {
+            if (depth + pos >= fixed)
+                path[depth + pos] = prefix[pos];
+            else if (path[depth + pos] != prefix[pos])
+                return;
+        }
+        depth += node->prefixLength;
+        if (depth < fixed) {
+            ArtNode** child = findChild(node, path[depth]);
+            if (child) fillJump(*child, depth + 1, path, fixed);
+            return;
+        }
+        for (int pos = nextChild(node, -1); pos >= 0;
+             pos = nextChild(node, pos)) {
+            path[depth] = keyByteAt(node, pos);
+            fillJump(childAt(node, pos), depth + 1, path, fixed);
+        }
+    }
+
+    // Traversals interleaved by lookupBatch, enough to cover the latency of
+    // a cache miss with the work of the other steps
+    static const unsigned batchWidth = 16;
+
+    struct BatchState {
+        ArtNode* node;
+        const uint8_t* key;
+        unsigned keyLength;
+        unsigned depth;
+        bool skippedPrefix;
+        size_t index;
+    };
+
+    void startLookup(BatchState& s, const uint8_t* const keys[],
+                     const unsigned keyLengths[], size_t index) const {
+        s.key = keys[index];
+        s.keyLength = keyLengths ? keyLengths[index] : maxKeyLength;
+        if (s.keyLength > maxKeyLength ||
+            (filter.enabled() && !filter.mayContain(s.key, s.keyLength))) {
+            // Known to be missing, the first step returns NULL
+            s.node = NULL;
+            s.depth = 0;
+        } else {
+            s.node = start(s.key, s.keyLength, s.depth);
+        }
+        s.skippedPrefix = false;
+        s.index = index;
+        __builtin_prefetch(s.node);
+    }
+
+    bool lookupStep(BatchState& s, ArtNode*& result) const {
+        // Advance one traversal of lookupBatch by one node, the same steps as
+        // lookup; return true once the result is known
+        ArtNode* node = s.node;
+        if (node == NULL) {
+            result = NULL;
+            return true;
+        }
+
+        if (isLeaf(node)) {
+            if ((!storedLeaves && !s.skippedPrefix && s.depth == s.keyLength) ||
+                leafMatches(node, s.key, s.keyLength,
+                            s.skippedPrefix ? 0 : s.depth))
+                result = node;
+            else
+                result = NULL;
+            return true;
+        }
+
+        if (node->prefixLength) {
+            if (s.depth + node->prefixLength >= s.keyLength ||
+                ((storedPrefixes || node->prefixLength < maxPrefixLength) &&
+                 mismatch(s.key + s.depth, prefixBytes(node),
+                          node->prefixLength) != node->prefixLength)) {
+                result = NULL;
+                return true;
+            }
+            if (!storedPrefixes && node->prefixLength >= maxPrefixLength)
+                s.skippedPrefix = true;
+            s.depth += node->prefixLength;
+        }
+
+        ArtNode** child = findChild(node, s.key[s.depth]);
+        s.node = child ? *child : NULL;
+        s.depth++;
+        if (s.node) {
+            // Stored leaves are read through the untagged record pointer
+            if (isLeaf(s.node)) {
+                if constexpr (storedLeaves)
+                    __builtin_prefetch(Base::leafRecord(s.node));
+            } else {
+                __builtin_prefetch(s.node);
+            }
+        }
+        return false;
+    }
+
+    ArtNode* lookupPessimistic(ArtNode* node, const uint8_t key[],
+                               unsigned keyLength, unsigned depth) const {
+        // Find the node with a matching key, alternative pessimistic version
+
+        while (node != NULL) {
+            if (isLeaf(node)) {
+                if (leafMatches(node, key, keyLength, depth)) return node;
+                return NULL;
+            }
+
+            if (prefixMismatch(node, key, keyLength, depth) !=
+                node->prefixLength)
+                return NULL;
+            else
+                depth += node->prefixLength;
+            if (depth >= keyLength) return NULL;
+
+            ArtNode** child = findChild(node, key[depth]);
+            node = child ? *child : NULL;
+            depth++;
+        }
+
+        return NULL;
+    }
+
+    // What insert does with a key that is already present
+    enum ExistingKey { KeepExisting, ReplaceExisting };
+
+    // Keys of a batch that a growing node looks at for its coming children
+    static const size_t batchLookahead = 64;
+
+    // The state of insertBatch between keys: the slots the previous key
+    // passed with the key bytes above each (every slot is one key byte
+    // deeper at least), and the keys still to come
+    struct InsertBatch {
+        ArtNode** slot[maxKeyLength + 1];
+        unsigned slotDepth[maxKeyLength + 1];
+        unsigned pathLength;
+        const uint8_t* lastKey;
+        unsigned lastKeyLength;
+        const uint8_t* const* keys;
+        const unsigned* keyLengths;
+        size_t next, end;
+
+        InsertBatch()
+            : pathLength(0),
+              lastKey(NULL),
+              lastKeyLength(0),
+              keys(NULL),
+              keyLengths(NULL),
+              next(0),
+              end(0) {}
+    };
+
+    size_t insertBatch(InsertBatch& batch, const uint8_t* const keys[],
+                       const unsigned keyLengths[], const Value values[],
+                       size_t n) {
+        // Insert the keys in turn, each starting at the last slot of the
+        // path whose key bytes it shares with the previous key
+        batch.keys = keys;
+        batch.keyLengths = keyLengths;
+        batch.end = n;
+        size_t inserted = 0;
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t* key = keys[i];
+            unsigned keyLength = keyLengths ? keyLengths[i] : maxKeyLength;
+            if (keyLength > maxKeyLength) continue;
+            ArtNode** nodeRef = &root;
+            unsigned depth = 0;
+            if (batch.lastKey) {
+                unsigned shared =
+                    mismatch(batch.lastKey, key,
+                             min(batch.lastKeyLength, keyLength));
+                while (batch.pathLength &&
+                       batch.slotDepth[batch.pathLength - 1] > shared)
+                    batch.pathLength--;
+                if (batch.pathLength) {
+                    batch.pathLength--;
+                    nodeRef = batch.slot[batch.pathLength];
+                    depth = batch.slotDepth[batch.pathLength];
+                }
+            }
+            batch.next = i + 1;
+            inserted += insert(nodeRef, depth, key, keyLength, values[i],
+                               KeepExisting, NULL, &batch);
+            batch.lastKey = key;
+            batch.lastKeyLength = keyLength;
+        }
+        return inserted;
+    }
+
+    static unsigned childrenAhead(ArtNode* node, const InsertBatch& batch,
+                                  const uint8_t key[], unsigned depth) {
+        // Children the next keys of a batch add to a node that key reaches
+        // with depth key bytes: those in a run of keys sharing the bytes,
+        // up to batchLookahead keys on
+        uint64_t seen[4] = {0, 0, 0, 0};
+        seen[key[depth] >> 6] |= uint64_t(1) << (key[depth] & 63);
+        unsigned children = 0;
+        size_t end = std::min(batch.end, batch.next + batchLookahead);
+        for (size_t i = batch.next; i < end; i++) {
+            const uint8_t* k = batch.keys[i];
+            unsigned length =
+                batch.keyLengths ? batch.keyLengths[i] : maxKeyLength;
+            if (length <= depth || mismatch(k, key, depth) != depth) break;
+            uint8_t b = k[depth];
+            if ((seen[b >> 6] >> (b & 63)) & 1) continue;
+            seen[b >> 6] |= uint64_t(1) << (b & 63);
+            ArtNode** child = findChild(node, b);
+            children += !child || !*child;
+        }
+        return children;
+    }
+
+    ArtNode** leafSlot(const uint8_t key[], unsigned keyLength,
+                       unsigned& slotDepth) {
+        // The slot holding the leaf of a key and the key bytes above it,
+        // NULL if the key is not present; prefixes are checked as in
+        // lookupPessimistic
+        if (keyLength > maxKeyLength) return NULL;
+        ArtNode** slot = &root;
+        unsigned depth = 0;
+        while (*slot) {
+            ArtNode* node = *slot;
+            if (isLeaf(node)) {
+                slotDepth = depth;
+                return leafMatches(node, key, keyLength, depth) ? slot : NULL;
+            }
+            if (prefixMismatch(node, key, keyLength, depth) !=
+                node->prefixLength)
+                return NULL;
+            depth += node->prefixLength;
+            if (depth >= keyLength) return NULL;
+            slot = findChild(node, key[depth]);
+            if (!slot) return NULL;
+            depth++;
+        }
+        return NULL;
+    }
+
+    bool replaceValue(ArtNode** slot, unsigned slotDepth, const uint8_t key[],
+                      unsigned keyLength, Value value) {
+        // Overwrite the value of the leaf in a slot: stored leaves in their
+        // record, pseudo-leaves by a new leaf for the same key. A value that
+        // does not load the key would make it unreachable, the leaf is kept
+        // and false returned.
+        if constexpr (storedLeaves) {
+            (void)slotDepth, (void)key, (void)keyLength;
+            Base::leafRecord(*slot)->value = value;
+        } else {
+            ArtNode* leaf = makeLeaf(static_cast<uintptr_t>(value));
+            if (!leafMatches(leaf, key, keyLength, 0)) return false;
+            *slot = leaf;
+            jumpChanged(key, slotDepth);
+        }
+        return true;
+    }
+
+    bool insert(ArtNode** nodeRef, unsigned depth, const uint8_t key[],
+                unsigned keyLength, Value value, ExistingKey existing,
+                Value* previous, InsertBatch* batch = NULL) {
+        // Insert and add a new key to the filter, keys that are too long
+        // are not inserted
+        if (keyLength > maxKeyLength) return false;
+        bool inserted = insertAt(nodeRef, depth, key, keyLength, value,
+                                 existing, previous, batch);
+        if (inserted && filter.enabled()) filter.add(key, keyLength);
+        return inserted;
+    }
+
+    bool insertAt(ArtNode** nodeRef, unsigned depth, const uint8_t key[],
+                  unsigned keyLength, Value value, ExistingKey existing,
+                  Value* previous, InsertBatch* batch) {
+        // Insert the leaf value into the tree, return false if the key is
+        // already present; its value is returned in *previous (if not NULL)
+        // and replaced if existing says so. nodeRef is the slot pointing to
+        // the current node, all changes happen at that node; the walk starts
+        // at a slot below depth key bytes, and within a batch records the
+        // slots it passes.
+        while (true) {
+            ArtNode* node = *nodeRef;
+            unsigned slotDepth = depth;  // key bytes above *nodeRef
+            if (batch) {
+                batch->slot[batch->pathLength] = nodeRef;
+                batch->slotDepth[batch->pathLength++] = slotDepth;
+            }
+            if (node == NULL) {
+                *nodeRef = newLeaf(key, keyLength, value);
+                jumpChanged(key, slotDepth);
+                return true;
+            }
+
+            if (isLeaf(node)) {
+                // Replace leaf with Node4 and store both leaves in it
+                uint8_t buffer[maxKeyLength];
+                const uint8_t* existingKey = leafKey(node, buffer);
+                unsigned limit = min(keyLength, leafKeyLength(node));
+                unsigned newPrefixLength =
+                    Base::commonBytes(existingKey, key, limit, depth);
+                if (depth + newPrefixLength == limit) {
+                    // Same key, or one is a proper prefix of the other,
+                    // which is not inserted and leaves the leaf alone
+                    if (keyLength != leafKeyLength(node)) return false;
+                    if (previous) *previous = Base::value(node);
+                    if (existing == ReplaceExisting)
+                        replaceValue(nodeRef, slotDepth, key, keyLength,
+                                     value);
+                    return false;
+                }
+
+                Node4* newNode = alloc.allocate<Node4>();
+                setPrefix(newNode, key + depth, newPrefixLength, alloc);
+                *nodeRef = newNode;
+
+                insertNode4(newNode, nodeRef,
+                            existingKey[depth + newPrefixLength], node, alloc);
+                insertNode4(newNode, nodeRef, key[depth + newPrefixLength],
+                            newLeaf(key, keyLength, value), alloc);
+                jumpChanged(key, slotDepth);
+                return true;
+            }
+
+            // Handle prefix of inner node
+            if (node->prefixLength) {
+                unsigned mismatchPos =
+                    prefixMismatch(node, key, keyLength, depth);
+                if (mismatchPos != node->prefixLength) {
+                    // A key ending inside the prefix is not inserted
+                    if (depth + mismatchPos >= keyLength) return false;
+                    // Prefix differs, create new node
+                    Node4* newNode = alloc.allocate<Node4>();
+                    *nodeRef = newNode;
+                    const uint8_t* prefix = prefixBytes(node);
+                    setPrefix(newNode, prefix, mismatchPos, alloc);
+                    // Break up prefix
+                    if (storedPrefixes ||
+                        node->prefixLength < maxPrefixLength) {
+                        insertNode4(newNode, nodeRef, prefix[mismatchPos],
+                                    node, alloc);
+                        setPrefix(node, prefix + mismatchPos + 1,
+                                  node->prefixLength - (mismatchPos + 1),
+                                  alloc);
+                    } else {
+                        node->prefixLength -= (mismatchPos + 1);
+                        uint8_t buffer[maxKeyLength];
+                        const uint8_t* minKey =
+                            leafKey(ART::minimum(node), buffer);
+                        insertNode4(newNode, nodeRef,
+                                    minKey[depth + mismatchPos], node, alloc);
+                        memmove(node->prefix, minKey + depth + mismatchPos + 1,
+                                min(node->prefixLength, maxPrefixLength));
+                    }
+                    insertNode4(newNode, nodeRef, key[depth + mismatchPos],
+                                newLeaf(key, keyLength, value), alloc);
+                    jumpChanged(key, slotDepth);
+                    return true;
+                }
+                depth += node->prefixLength;
+            }
+            // Nor is one ending at an inner node
+            if (depth >= keyLength) return false;
+
+            // Descend
+            ArtNode** child = findChild(node, key[depth]);
+            if (child && *child) {
+                nodeRef = child;
+                depth++;
+                continue;
+            }
+
+            // Insert leaf into inner node; a node that grows is replaced,
+            // with room for the children the rest of a batch adds
+            bool grows = insertGrows(node);
+            transitionCounts.grows += grows;
+            unsigned changed = grows ? slotDepth : depth + 1;
+            if (grows && batch) {
+                unsigned ahead = childrenAhead(node, *batch, key, depth);
+                if (ahead) {
+                    growNode(node, nodeRef, node->count + 1 + ahead, alloc);
+                    node = *nodeRef;
+                }
+            }
+            insertChild(node, nodeRef, key[depth],
+                        newLeaf(key, keyLength, value), alloc);
+            jumpChanged(key, changed);
+            return true;
+        }
+    }
+
+    bool erase(const uint8_t key[], unsigned keyLength, Value* erased) {
+        // Erase and remove the key from the filter
+        if (keyLength > maxKeyLength) return false;
+        bool found = eraseLeaf(key, keyLength, erased);
+        if (found && filter.enabled()) filter.remove(key, keyLength);
+        return found;
+    }
+
+    void filterBulk(const uint8_t* const keys[], const unsigned keyLengths[],
+                    size_t n) {
+        // Add the keys of a bulk load to the filter
+        if (!filter.enabled()) return;
+        for (size_t i = 0; i < n; i++)
+            filter.add(keys[i], keyLengths ? keyLengths[i] : maxKeyLength);
+    }
+
+    bool eraseLeaf(const uint8_t key[], unsigned keyLength, Value* erased) {
+        // Delete a leaf from the tree and return its value in *erased (if
+        // not NULL), return false if the key is not present. nodeRef is the
+        // slot pointing to the node holding the leaf, which may be replaced
+        // when the node shrinks.
+        ArtNode* node = root;
+        if (!node) return false;
+        if (isLeaf(node)) {
+            if (!leafMatches(node, key, keyLength, 0)) return false;
+            if (erased) *erased = value(node);
+            root = NULL;
+            freeLeaf(node);
+            jumpChanged(key, 0);
+            return true;
+        }
+
+        ArtNode** nodeRef = &root;
+        unsigned depth = 0;
+        while (true) {
+            unsigned slotDepth = depth;  // key bytes above *nodeRef
+            // Handle prefix
+            if (node->prefixLength) {
+                if (prefixMismatch(node, key, keyLength, depth) !=
+                    node->prefixLength)
+                    return false;
+                depth += node->prefixLength;
+            }
+            if (depth >= keyLength) return false;
+
+            ArtNode** child = findChild(node, key[depth]);
+            if (!child || !*child) return false;
+            if (isLeaf(*child)) {
+                // Make sure we have the right leaf, then delete it in the
+                // inner node
+                ArtNode* leaf = *child;
+                if (!leafMatches(leaf, key, keyLength, depth)) return false;
+                if (erased) *erased = value(leaf);
+                // A node that shrinks is replaced
+                bool shrinks = eraseShrinks(node, shrink);
+                if (node->type != NodeType4) {
+                    // Deferred: the count where eager shrinking happens
+                    static const ShrinkPolicy eager;
+                    transitionCounts.shrinks += shrinks;
+                    transitionCounts.deferredShrinks +=
+                        !shrinks &&
+                        node->count - 1u == eager.count(node->type);
+                }
+                unsigned changed = shrinks ? slotDepth : depth + 1;
+                if (storedPrefixes && node->type == NodeType4 &&
+                    node->count == 2) {
+                    // The node goes away, eraseNode4 would merge prefixes
+                    // inline only
+                    Node4* n = static_cast<Node4*>(node);
+                    unsigned other = child == &n->child[0] ? 1 : 0;
+                    if (!isLeaf(n->child[other])) {
+                        collapseNode4(n, nodeRef, other);
+                        freeLeaf(leaf);
+                        jumpChanged(key, changed);
+                        return true;
+                    }
+                    freePrefix(node, prefixBytes(node), alloc);
+                }
+                eraseChild(node, nodeRef, child, key[depth], alloc, shrink);
+                freeLeaf(leaf);
+                jumpChanged(key, changed);
+                return true;
+            }
+            nodeRef = child;
+            node = *child;
+            depth++;
+        }
+    }
+
+    ArtNode* root;
+    Allocator alloc;
+    JumpTable jump;
+    ShrinkPolicy shrink;
+    TransitionCounts transitionCounts;
+    CountingBloomFilter filter;
+};
+}  // namespace ART
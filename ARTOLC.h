@@ -0,0 +1,569 @@
+/*
+  Adaptive Radix Tree with optimistic lock coupling, after Leis et al.,
+  "The ART of Practical Synchronization", DaMoN 2016
+ */
+
+#pragma once
+
+#include <memory>  // std::unique_ptr
+#include <mutex>
+#include <vector>
+
+#include "ART.h"
+#include "Epoch.h"
+
+namespace ART {
+namespace OLC {
+
+// ArtNode::version is a version lock: bit 0 marks a node that has been
+// unlinked (obsolete), bit 1 is held by a writer, and every write unlock
+// bumps the version so optimistic readers can validate what they read
+static const uint32_t obsoleteBit = 1;
+static const uint32_t lockedBit = 2;
+
+inline void cpuRelax() {
+    // Back off while another thread holds the lock
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+inline uint32_t readLockOrRestart(const ArtNode* node, bool& needRestart) {
+    // Start an optimistic read of the node
+    uint32_t version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+    if (version & (lockedBit | obsoleteBit)) {
+        cpuRelax();
+        needRestart = true;
+    }
+    return version;
+}
+
+inline void checkOrRestart(const ArtNode* node, uint32_t version,
+                           bool& needRestart) {
+    // Validate everything read from the node since readLockOrRestart
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&node->version, __ATOMIC_RELAXED) != version)
+        needRestart = true;
+}
+
+inline void upgradeToWriteLockOrRestart(ArtNode* node, uint32_t& version,
+                                        bool& needRestart) {
+    // Take the write lock if the node is unchanged since version was read
+    uint32_t expected = version;
+    if (!__atomic_compare_exchange_n(&node->version, &expected,
+                                     version + lockedBit, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        cpuRelax();
+        needRestart = true;
+        return;
+    }
+    version += lockedBit;
+}
+
+inline void writeLockOrRestart(ArtNode* node, bool& needRestart) {
+    uint32_t version = readLockOrRestart(node, needRestart);
+    if (needRestart) return;
+    upgradeToWriteLockOrRestart(node, version, needRestart);
+}
+
+inline void writeUnlock(ArtNode* node) {
+    __atomic_fetch_add(&node->version, lockedBit, __ATOMIC_RELEASE);
+}
+
+inline void writeUnlockObsolete(ArtNode* node) {
+    // Release the lock of a node that has been unlinked from the tree
+    __atomic_fetch_add(&node->version, lockedBit | obsoleteBit,
+                       __ATOMIC_RELEASE);
+}
+
+// Concurrent adaptive radix tree. Readers never write shared memory: they
+// validate node versions and restart on conflicts. Writers lock only the
+// node they modify, plus its parent when the node is replaced (grow, shrink,
+// prefix split). Replaced nodes and erased leaves are retired through an
+// EpochManager. The root is a Node256 that is never replaced. Every thread
+// operates through its own ThreadInfo, see getThreadInfo().
+template <typename Key, typename Value = uintptr_t,
+          typename KeyLoader = IntegerKeyLoader<Key>,
+          typename Leaves = PseudoLeaves>
+class Tree : public TreeBase<Key, Value, KeyLoader, Leaves> {
+    typedef TreeBase<Key, Value, KeyLoader, Leaves> Base;
+
+   public:
+    using Base::compareKeys;
+    using Base::leafKey;
+    using Base::leafKeyLength;
+    using Base::maxKeyLength;
+    using Base::storedLeaves;
+
+    // Threads free retired memory into their own pools, which only works
+    // for slab-backed leaves
+    static_assert(!storedLeaves || Base::Leaf::size(maxKeyLength) <=
+                                       SizeClassPool::maxClassBytes,
+                  "stored leaves of the concurrent tree must fit a size class");
+
+    // Per-thread node pools and epoch registration
+    class ThreadInfo {
+       public:
+        ThreadInfo(const ThreadInfo&) = delete;
+        ThreadInfo& operator=(const ThreadInfo&) = delete;
+
+       private:
+        friend class Tree;
+
+        ThreadInfo(EpochManager::Participant* epoch,
+                   const MemoryOptions& memory)
+            : alloc(memory), epoch(epoch) {}
+
+        Allocator alloc;
+        EpochManager::Participant* epoch;
+    };
+
+    explicit Tree(KeyLoader loader = KeyLoader(),
+                  const MemoryOptions& memory = MemoryOptions())
+        : Base(loader), rootAlloc(memory) {
+        root = rootAlloc.allocate<Node256>();
+    }
+
+    explicit Tree(const MemoryOptions& memory) : Tree(KeyLoader(), memory) {}
+
+    Tree(const Tree&) = delete;
+    Tree& operator=(const Tree&) = delete;
+
+    ThreadInfo& getThreadInfo() {
+        // Register the calling thread, the result stays valid for the
+        // lifetime of the tree and must not be shared between threads
+        std::lock_guard<std::mutex> guard(threadsMutex);
+        threads.emplace_back(
+            new ThreadInfo(epoch.join(), rootAlloc.memoryOptions()));
+        return *threads.back();
+    }
+
+    bool lookup(const uint8_t key[], unsigned keyLength, Value& value,
+                ThreadInfo& info) const {
+        // Find the value of a key, optimistic prefix checks as in
+        // ART::Tree::lookup
+        if (keyLength > maxKeyLength) return false;
+        EpochGuard guard(epoch, info.epoch);
+    restart:
+        bool needRestart = false;
+        ArtNode* node = root;
+        unsigned depth = 0;
+        bool skippedPrefix = false;
+        uint32_t v = readLockOrRestart(node, needRestart);
+        if (needRestart) goto restart;
+
+        while (true) {
+            if (!checkPrefix(node, key, keyLength, depth, skippedPrefix)) {
+                checkOrRestart(node, v, needRestart);
+                if (needRestart) goto restart;
+                return false;
+            }
+
+            ArtNode** slot = findChild(node, key[depth]);
+            ArtNode* child = slot ? *slot : NULL;
+            checkOrRestart(node, v, needRestart);
+            if (needRestart) goto restart;
+            if (!child) return false;
+
+            if (isLeaf(child)) {
+                // Leaves are immutable and kept alive by the epoch
+                if (!leafMatches(child, key, keyLength,
+                                 skippedPrefix ? 0 : depth + 1))
+                    return false;
+                value = Base::value(child);
+                return true;
+            }
+
+            uint32_t childVersion = readLockOrRestart(child, needRestart);
+            if (needRestart) goto restart;
+            checkOrRestart(node, v, needRestart);
+            if (needRestart) goto restart;
+            node = child;
+            v = childVersion;
+            depth++;
+        }
+    }
+
+    bool lookup(const Key& key, Value& value, ThreadInfo& info) const {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return lookup(k, keyLength, value, info);
+    }
+
+    bool insert(const uint8_t key[], unsigned keyLength, Value value,
+                ThreadInfo& info) {
+        // Insert a new key, return false if it is already present (or too
+        // long, see TreeBase)
+        if (keyLength > maxKeyLength) return false;
+        EpochGuard guard(epoch, info.epoch);
+        Retiring alloc{*this, info};
+    restart:
+        bool needRestart = false;
+        ArtNode* node = NULL;
+        ArtNode* nextNode = root;
+        ArtNode* parent = NULL;
+        uint8_t parentKey = 0, nodeKey = 0;
+        uint32_t parentVersion = 0;
+        unsigned depth = 0;
+
+        while (true) {
+            parent = node;
+            parentKey = nodeKey;
+            node = nextNode;
+            uint32_t v = readLockOrRestart(node, needRestart);
+            if (needRestart) goto restart;
+
+            if (node->prefixLength) {
+                uint8_t buffer[maxKeyLength];
+                const uint8_t* fullKey = NULL;
+                unsigned mismatchPos = prefixMismatch(
+                    node, v, key, keyLength, depth, buffer, fullKey,
+                    needRestart);
+                if (needRestart) goto restart;
+                if (mismatchPos != node->prefixLength) {
+                    // A key ending inside the prefix is not inserted, see
+                    // TreeBase; prefixMismatch validated what it read
+                    if (depth + mismatchPos >= keyLength) return false;
+                    // Prefix differs, put a new Node4 above the node
+                    upgradeToWriteLockOrRestart(parent, parentVersion,
+                                                needRestart);
+                    if (needRestart) goto restart;
+                    upgradeToWriteLockOrRestart(node, v, needRestart);
+                    if (needRestart) {
+                        writeUnlock(parent);
+                        goto restart;
+                    }
+                    ArtNode** parentSlot = findChild(parent, parentKey);
+                    Node4* newNode = info.alloc.template allocate<Node4>();
+                    newNode->prefixLength = mismatchPos;
+                    memcpy(newNode->prefix, key + depth,
+                           min(mismatchPos, maxPrefixLength));
+                    // Break up prefix
+                    uint8_t nodeByte;
+                    unsigned prefixLength = node->prefixLength;
+                    node->prefixLength -= (mismatchPos + 1);
+                    if (prefixLength <= maxPrefixLength) {
+                        nodeByte = node->prefix[mismatchPos];
+                        memmove(node->prefix, node->prefix + mismatchPos + 1,
+                                node->prefixLength);
+                    } else {
+                        nodeByte = fullKey[depth + mismatchPos];
+                        memcpy(node->prefix, fullKey + depth + mismatchPos + 1,
+                               min(node->prefixLength, maxPrefixLength));
+                    }
+                    insertNode4(newNode, parentSlot, nodeByte, node, alloc);
+                    insertNode4(newNode, parentSlot, key[depth + mismatchPos],
+                                newLeaf(key, keyLength, value, info), alloc);
+                    *parentSlot = newNode;
+                    writeUnlock(node);
+                    writeUnlock(parent);
+                    return true;
+                }
+                depth += node->prefixLength;
+            }
+
+            if (depth >= keyLength) {
+                // Nor is one ending at an inner node
+                checkOrRestart(node, v, needRestart);
+                if (needRestart) goto restart;
+                return false;
+            }
+            nodeKey = key[depth];
+            ArtNode** slot = findChild(node, nodeKey);
+            nextNode = slot ? *slot : NULL;
+            checkOrRestart(node, v, needRestart);
+            if (needRestart) goto restart;
+
+            if (!nextNode) {
+                if (insertGrows(node)) {
+                    // The node is replaced by a larger one, lock the parent
+                    upgradeToWriteLockOrRestart(parent, parentVersion,
+                                                needRestart);
+                    if (needRestart) goto restart;
+                    upgradeToWriteLockOrRestart(node, v, needRestart);
+                    if (needRestart) {
+                        writeUnlock(parent);
+                        goto restart;
+                    }
+                    insertChild(node, findChild(parent, parentKey), nodeKey,
+                                newLeaf(key, keyLength, value, info), alloc);
+                    writeUnlock(parent);
+                } else {
+                    if (parent) {
+                        checkOrRestart(parent, parentVersion, needRestart);
+                        if (needRestart) goto restart;
+                    }
+                    upgradeToWriteLockOrRestart(node, v, needRestart);
+                    if (needRestart) goto restart;
+                    insertChild(node, static_cast<ArtNode**>(NULL), nodeKey,
+                                newLeaf(key, keyLength, value, info), alloc);
+                    writeUnlock(node);
+                }
+                return true;
+            }
+
+            if (parent) {
+                checkOrRestart(parent, parentVersion, needRestart);
+                if (needRestart) goto restart;
+            }
+
+            if (isLeaf(nextNode)) {
+                // Replace leaf with Node4 and store both leaves in it
+                upgradeToWriteLockOrRestart(node, v, needRestart);
+                if (needRestart) goto restart;
+                uint8_t buffer[maxKeyLength];
+                const uint8_t* existingKey = leafKey(nextNode, buffer);
+                unsigned limit = min(keyLength, leafKeyLength(nextNode));
+                depth++;
+                unsigned newPrefixLength =
+                    Base::commonBytes(existingKey, key, limit, depth);
+                if (depth + newPrefixLength == limit) {
+                    // Same key, or one is a proper prefix of the other,
+                    // which is not inserted either
+                    writeUnlock(node);
+                    return false;
+                }
+
+                Node4* newNode = info.alloc.template allocate<Node4>();
+                newNode->prefixLength = newPrefixLength;
+                memcpy(newNode->prefix, key + depth,
+                       min(newPrefixLength, maxPrefixLength));
+                insertNode4(newNode, slot,
+                            existingKey[depth + newPrefixLength], nextNode,
+                            alloc);
+                insertNode4(newNode, slot, key[depth + newPrefixLength],
+                            newLeaf(key, keyLength, value, info), alloc);
+                *slot = newNode;
+                writeUnlock(node);
+                return true;
+            }
+
+            depth++;
+            parentVersion = v;
+        }
+    }
+
+    bool insert(const Key& key, Value value, ThreadInfo& info) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return insert(k, keyLength, value, info);
+    }
+
+    bool erase(const uint8_t key[], unsigned keyLength, ThreadInfo& info) {
+        // Delete a key, return false if it is not present
+        if (keyLength > maxKeyLength) return false;
+        EpochGuard guard(epoch, info.epoch);
+        Retiring alloc{*this, info};
+    restart:
+        bool needRestart = false;
+        ArtNode* node = NULL;
+        ArtNode* nextNode = root;
+        ArtNode* parent = NULL;
+        uint8_t parentKey = 0, nodeKey = 0;
+        uint32_t parentVersion = 0;
+        unsigned depth = 0;
+        bool skippedPrefix = false;
+
+        while (true) {
+            parent = node;
+            parentKey = nodeKey;
+            node = nextNode;
+            uint32_t v = readLockOrRestart(node, needRestart);
+            if (needRestart) goto restart;
+
+            if (!checkPrefix(node, key, keyLength, depth, skippedPrefix)) {
+                checkOrRestart(node, v, needRestart);
+                if (needRestart) goto restart;
+                return false;
+            }
+
+            nodeKey = key[depth];
+            ArtNode** slot = findChild(node, nodeKey);
+            nextNode = slot ? *slot : NULL;
+            checkOrRestart(node, v, needRestart);
+            if (needRestart) goto restart;
+            if (!nextNode) return false;
+
+            if (isLeaf(nextNode)) {
+                if (!leafMatches(nextNode, key, keyLength,
+                                 skippedPrefix ? 0 : depth + 1))
+                    return false;
+                ArtNode* leaf = nextNode;
+                if (node == root) {
+                    // The root never shrinks
+                    upgradeToWriteLockOrRestart(node, v, needRestart);
+                    if (needRestart) goto restart;
+                    *slot = NULL;
+                    node->count--;
+                    writeUnlock(node);
+                } else if (eraseShrinks(node)) {
+                    // The node is replaced, lock the parent
+                    upgradeToWriteLockOrRestart(parent, parentVersion,
+                                                needRestart);
+                    if (needRestart) goto restart;
+                    upgradeToWriteLockOrRestart(node, v, needRestart);
+                    if (needRestart) {
+                        writeUnlock(parent);
+                        goto restart;
+                    }
+                    ArtNode* sibling = NULL;
+                    if (node->type == NodeType4) {
+                        // The remaining child absorbs the prefix of the node
+                        Node4* n = static_cast<Node4*>(node);
+                        sibling = n->child[n->child[0] == leaf ? 1 : 0];
+                        if (isLeaf(sibling)) {
+                            sibling = NULL;
+                        } else {
+                            writeLockOrRestart(sibling, needRestart);
+                            if (needRestart) {
+                                writeUnlock(node);
+                                writeUnlock(parent);
+                                goto restart;
+                            }
+                        }
+                    }
+                    eraseChild(node, findChild(parent, parentKey), slot,
+                               nodeKey, alloc);
+                    if (sibling) writeUnlock(sibling);
+                    writeUnlock(parent);
+                } else {
+                    if (parent) {
+                        checkOrRestart(parent, parentVersion, needRestart);
+                        if (needRestart) goto restart;
+                    }
+                    upgradeToWriteLockOrRestart(node, v, needRestart);
+                    if (needRestart) goto restart;
+                    eraseChild(node, static_cast<ArtNode**>(NULL), slot,
+                               nodeKey, alloc);
+                    writeUnlock(node);
+                }
+                if constexpr (storedLeaves) retire(leaf, info);
+                return true;
+            }
+
+            depth++;
+            parentVersion = v;
+        }
+    }
+
+    bool erase(const Key& key, ThreadInfo& info) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return erase(k, keyLength, info);
+    }
+
+   private:
+    using Base::leafMatches;
+    using Base::loader;
+
+    // Allocator handed to the node-level grow and shrink functions: new
+    // nodes come from the thread's pools, the node being replaced is
+    // unlocked as obsolete and retired instead of freed
+    struct Retiring {
+        Tree& tree;
+        ThreadInfo& info;
+
+        template <typename N>
+        N* allocate() {
+            return info.alloc.template allocate<N>();
+        }
+
+        void deallocate(ArtNode* node) {
+            writeUnlockObsolete(node);
+            tree.retire(node, info);
+        }
+    };
+
+    ArtNode* newLeaf(const uint8_t key[], unsigned keyLength, Value value,
+                     ThreadInfo& info) {
+        return Base::newLeaf(key, keyLength, value, info.alloc);
+    }
+
+    void retire(ArtNode* node, ThreadInfo& info) {
+        // Free an unlinked node or leaf once no reader can reach it
+        Allocator& alloc = info.alloc;
+        epoch.retire(info.epoch, node, [&alloc](void* p) {
+            ArtNode* n = static_cast<ArtNode*>(p);
+            if (isLeaf(n))
+                Base::freeLeaf(n, alloc);
+            else
+                alloc.deallocate(n);
+        });
+    }
+
+    bool checkPrefix(ArtNode* node, const uint8_t key[], unsigned keyLength,
+                     unsigned& depth, bool& skippedPrefix) const {
+        // Optimistic prefix check, advances depth past the prefix; prefixes
+        // longer than the header are skipped and verified at the leaf
+        unsigned prefixLength = node->prefixLength;
+        if (depth + prefixLength >= keyLength) return false;
+        if (prefixLength <= maxPrefixLength) {
+            unsigned length = Base::withinKey(prefixLength, depth);
+            if (mismatch(key + depth, node->prefix, length) != length)
+                return false;
+        } else {
+            skippedPrefix = true;
+        }
+        depth += prefixLength;
+        return true;
+    }
+
+    ArtNode* anyLeaf(ArtNode* node, bool& needRestart) const {
+        // Some leaf below node, every step validated
+        while (!isLeaf(node)) {
+            uint32_t v = readLockOrRestart(node, needRestart);
+            if (needRestart) return NULL;
+            ArtNode* next = NULL;
+            int pos = nextChild(node, -1);
+            if (pos >= 0) {
+                if (node->type == NodeType48) {
+                    Node48* n = static_cast<Node48*>(node);
+                    uint8_t index = n->childIndex[pos];
+                    if (index < 48) next = n->child[index];
+                } else {
+                    next = childAt(node, pos);
+                }
+            }
+            checkOrRestart(node, v, needRestart);
+            if (!next) needRestart = true;
+            if (needRestart) return NULL;
+            node = next;
+        }
+        return node;
+    }
+
+    unsigned prefixMismatch(ArtNode* node, uint32_t v, const uint8_t key[],
+                            unsigned keyLength, unsigned depth,
+                            uint8_t buffer[], const uint8_t*& fullKey,
+                            bool& needRestart) const {
+        // Pessimistic prefix check, return the number of matching bytes.
+        // Prefixes longer than the header are compared against the key of
+        // some leaf below the node, which is returned in fullKey.
+        unsigned prefixLength = node->prefixLength;
+        unsigned limit = keyLength - depth;
+        unsigned pos = 0;
+        if (prefixLength > maxPrefixLength) {
+            ArtNode* leaf = anyLeaf(node, needRestart);
+            if (needRestart) return 0;
+            fullKey = leafKey(leaf, buffer);
+            limit = min(limit, leafKeyLength(leaf) - depth);
+            pos = mismatch(key + depth, fullKey + depth,
+                           min(prefixLength, limit));
+        } else {
+            pos = mismatch(key + depth, node->prefix, min(prefixLength, limit));
+        }
+        checkOrRestart(node, v, needRestart);
+        return pos;
+    }
+
+    ArtNode* root;
+    Allocator rootAlloc;
+    mutable EpochManager epoch;
+    std::mutex threadsMutex;
+    std::vector<std::unique_ptr<ThreadInfo>> threads;
+};
+
+}  // namespace OLC
+}  // namespace ART
@@ -0,0 +1,463 @@
+/*
+  Adaptive Radix Tree with one writer and lock-free readers, a single-writer
+  form of ROWEX (Leis et al., "The ART of Practical Synchronization",
+  DaMoN 2016)
+ */
+
+#pragma once
+
+#include <memory>  // std::unique_ptr
+#include <mutex>
+#include <vector>
+
+#include "ART.h"
+#include "Epoch.h"
+
+namespace ART {
+namespace ROWEX {
+
+// Adaptive radix tree for one writing thread and any number of reading
+// threads. Readers take no locks and never restart: every change is either
+// a single atomic store of a child slot or index, or builds a new node and
+// publishes it with one release store into the parent slot. Node4 and
+// Node16 keep their keys sorted, so their keys and count are copy-on-write,
+// but a child slot is replaced in place, as is any slot of Node48 and
+// Node256, which also gain and lose children in place. Readers load every
+// child slot with acquire. Replaced nodes and erased leaves are retired
+// through an EpochManager. The root is a Node256 that is never replaced.
+//
+// insert and erase must not run concurrently with each other; lookup may
+// run on any number of threads at the same time, each through its own
+// ThreadInfo (see getThreadInfo()).
+template <typename Key, typename Value = uintptr_t,
+          typename KeyLoader = IntegerKeyLoader<Key>,
+          typename Leaves = PseudoLeaves>
+class Tree : public TreeBase<Key, Value, KeyLoader, Leaves> {
+    typedef TreeBase<Key, Value, KeyLoader, Leaves> Base;
+
+   public:
+    using Base::compareKeys;
+    using Base::leafKey;
+    using Base::leafKeyLength;
+    using Base::maxKeyLength;
+    using Base::storedLeaves;
+
+    // Epoch registration of a reading thread
+    class ThreadInfo {
+       public:
+        ThreadInfo(const ThreadInfo&) = delete;
+        ThreadInfo& operator=(const ThreadInfo&) = delete;
+
+       private:
+        friend class Tree;
+
+        explicit ThreadInfo(EpochManager::Participant* epoch)
+            : epoch(epoch) {}
+
+        EpochManager::Participant* epoch;
+    };
+
+    explicit Tree(KeyLoader loader = KeyLoader(),
+                  const MemoryOptions& memory = MemoryOptions())
+        : Base(loader), alloc(memory) {
+        root = alloc.allocate<Node256>();
+        writer = epoch.join();
+    }
+
+    explicit Tree(const MemoryOptions& memory) : Tree(KeyLoader(), memory) {}
+
+    Tree(const Tree&) = delete;
+    Tree& operator=(const Tree&) = delete;
+
+    ThreadInfo& getThreadInfo() {
+        // Register a reading thread, the result stays valid for the
+        // lifetime of the tree and must not be shared between threads
+        std::lock_guard<std::mutex> guard(threadsMutex);
+        threads.emplace_back(new ThreadInfo(epoch.join()));
+        return *threads.back();
+    }
+
+    bool lookup(const uint8_t key[], unsigned keyLength, Value& value,
+                ThreadInfo& info) const {
+        // Find the value of a key without locks, safe against the writer.
+        // A reader may follow a Node48 index whose slot is being reused, so
+        // the leaf is always compared against the whole key.
+        if (keyLength > maxKeyLength) return false;
+        EpochGuard guard(epoch, info.epoch);
+        ArtNode* node = root;
+        unsigned depth = 0;
+        while (true) {
+            unsigned prefixLength = node->prefixLength;
+            if (depth + prefixLength >= keyLength) return false;
+            if (prefixLength <= maxPrefixLength &&
+                mismatch(key + depth, node->prefix, prefixLength) !=
+                    prefixLength)
+                return false;
+            depth += prefixLength;
+
+            ArtNode* child = loadChild(node, key[depth]);
+            if (!child) return false;
+            if (isLeaf(child)) {
+                // Leaves are immutable and kept alive by the epoch
+                if (!leafMatches(child, key, keyLength, 0)) return false;
+                value = Base::value(child);
+                return true;
+            }
+            node = child;
+            depth++;
+        }
+    }
+
+    bool lookup(const Key& key, Value& value, ThreadInfo& info) const {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return lookup(k, keyLength, value, info);
+    }
+
+    bool insert(const uint8_t key[], unsigned keyLength, Value value) {
+        // Insert a new key, return false if it is already present (or too
+        // long, see TreeBase); writer thread only
+        if (keyLength > maxKeyLength) return false;
+        ArtNode* node = root;
+        ArtNode** nodeRef = NULL;  // slot of node in its parent
+        unsigned depth = 0;
+        while (true) {
+            if (node->prefixLength) {
+                unsigned mismatchPos =
+                    prefixMismatch(node, key, keyLength, depth);
+                if (mismatchPos != node->prefixLength) {
+                    // A key ending inside the prefix is not inserted
+                    if (depth + mismatchPos >= keyLength) return false;
+                    // Prefix differs: a new Node4 above a copy of the node
+                    // with the rest of the prefix
+                    uint8_t buffer[maxKeyLength];
+                    const uint8_t* prefix = node->prefix;
+                    if (node->prefixLength > maxPrefixLength)
+                        prefix = leafKey(ART::minimum(node), buffer) + depth;
+                    Node4* newNode = alloc.allocate<Node4>();
+                    newNode->prefixLength = mismatchPos;
+                    memcpy(newNode->prefix, key + depth,
+                           min(mismatchPos, maxPrefixLength));
+                    ArtNode* copy = copyNode(node);
+                    copy->prefixLength -= mismatchPos + 1;
+                    memcpy(copy->prefix, prefix + mismatchPos + 1,
+                           min(copy->prefixLength, maxPrefixLength));
+                    insertNode4(newNode, nodeRef, prefix[mismatchPos], copy,
+                                alloc);
+                    insertNode4(newNode, nodeRef, key[depth + mismatchPos],
+                                newLeaf(key, keyLength, value), alloc);
+                    publish(nodeRef, newNode);
+                    retire(node);
+                    return true;
+                }
+                depth += node->prefixLength;
+            }
+            // Nor is one ending at an inner node
+            if (depth >= keyLength) return false;
+
+            ArtNode** slot = findChild(node, key[depth]);
+            ArtNode* child = slot ? *slot : NULL;
+            if (!child) {
+                addChild(node, nodeRef, key[depth],
+                         newLeaf(key, keyLength, value));
+                return true;
+            }
+
+            if (isLeaf(child)) {
+                // Replace the leaf with a Node4 holding both leaves
+                uint8_t buffer[maxKeyLength];
+                const uint8_t* existingKey = leafKey(child, buffer);
+                unsigned limit = min(keyLength, leafKeyLength(child));
+                depth++;
+                unsigned newPrefixLength =
+                    Base::commonBytes(existingKey, key, limit, depth);
+                if (depth + newPrefixLength == limit) {
+                    // Same key, or one is a proper prefix of the other,
+                    // which is not inserted either
+                    return false;
+                }
+                Node4* newNode = alloc.allocate<Node4>();
+                newNode->prefixLength = newPrefixLength;
+                memcpy(newNode->prefix, key + depth,
+                       min(newPrefixLength, maxPrefixLength));
+                insertNode4(newNode, slot, existingKey[depth + newPrefixLength],
+                            child, alloc);
+                insertNode4(newNode, slot, key[depth + newPrefixLength],
+                            newLeaf(key, keyLength, value), alloc);
+                publish(slot, newNode);
+                return true;
+            }
+
+            nodeRef = slot;
+            node = child;
+            depth++;
+        }
+    }
+
+    bool insert(const Key& key, Value value) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return insert(k, keyLength, value);
+    }
+
+    bool erase(const uint8_t key[], unsigned keyLength) {
+        // Delete a key, return false if it is not present; writer thread
+        // only
+        if (keyLength > maxKeyLength) return false;
+        ArtNode* node = root;
+        ArtNode** nodeRef = NULL;
+        unsigned depth = 0;
+        while (true) {
+            if (node->prefixLength) {
+                if (prefixMismatch(node, key, keyLength, depth) !=
+                    node->prefixLength)
+                    return false;
+                depth += node->prefixLength;
+            }
+            if (depth >= keyLength) return false;
+
+            ArtNode** slot = findChild(node, key[depth]);
+            ArtNode* child = slot ? *slot : NULL;
+            if (!child) return false;
+            if (isLeaf(child)) {
+                if (!leafMatches(child, key, keyLength, 0)) return false;
+                removeChild(node, nodeRef, key[depth], slot);
+                if constexpr (storedLeaves) retire(child);
+                return true;
+            }
+            nodeRef = slot;
+            node = child;
+            depth++;
+        }
+    }
+
+    bool erase(const Key& key) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return erase(k, keyLength);
+    }
+
+    const Allocator& allocator() const { return alloc; }
+
+   private:
+    using Base::leafMatches;
+    using Base::loader;
+
+    ArtNode* newLeaf(const uint8_t key[], unsigned keyLength, Value value) {
+        return Base::newLeaf(key, keyLength, value, alloc);
+    }
+
+    static ArtNode* loadChild(ArtNode* n, uint8_t keyByte) {
+        // The child for keyByte as a reader sees it: the keys of Node4 and
+        // Node16 do not change once reachable, but their slots are
+        // published into like any other, so every slot is loaded with
+        // acquire, the Node48 index before the slot it names
+        switch (n->type) {
+            case NodeType4:
+            case NodeType16: {
+                ArtNode** slot = findChild(n, keyByte);
+                return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
+            }
+            case NodeType48: {
+                Node48* node = static_cast<Node48*>(n);
+                uint8_t index = __atomic_load_n(&node->childIndex[keyByte],
+                                                __ATOMIC_ACQUIRE);
+                if (index == emptyMarker) return NULL;
+                return __atomic_load_n(&node->child[index], __ATOMIC_ACQUIRE);
+            }
+            case NodeType256:
+                return __atomic_load_n(
+                    &static_cast<Node256*>(n)->child[keyByte],
+                    __ATOMIC_ACQUIRE);
+        }
+        throw;  // Unreachable
+    }
+
+    void publish(ArtNode** slot, ArtNode* node) {
+        // Make a fully built node (or leaf) reachable, slot is never NULL
+        // here since the root is not replaced
+        assert(slot);
+        __atomic_store_n(slot, node, __ATOMIC_RELEASE);
+    }
+
+    void retire(ArtNode* node) {
+        // Free an unlinked node or leaf once no reader can reach it
+        Allocator& a = alloc;
+        epoch.retire(writer, node, [&a](void* p) {
+            ArtNode* n = static_cast<ArtNode*>(p);
+            if (isLeaf(n))
+                Base::freeLeaf(n, a);
+            else
+                a.deallocate(n);
+        });
+    }
+
+    ArtNode* newNode(int8_t type) {
+        switch (type) {
+            case NodeType4:
+                return alloc.allocate<Node4>();
+            case NodeType16:
+                return alloc.allocate<Node16>();
+            case NodeType48:
+                return alloc.allocate<Node48>();
+            case NodeType256:
+                return alloc.allocate<Node256>();
+        }
+        throw;  // Unreachable
+    }
+
+    ArtNode* copyNode(ArtNode* node) {
+        // An unpublished copy of a node; only the writer changes nodes, so
+        // the source is stable
+        ArtNode* copy = newNode(node->type);
+        switch (node->type) {
+            case NodeType4:
+                memcpy(static_cast<void*>(copy), node, sizeof(Node4));
+                break;
+            case NodeType16:
+                memcpy(static_cast<void*>(copy), node, sizeof(Node16));
+                break;
+            case NodeType48:
+                memcpy(static_cast<void*>(copy), node, sizeof(Node48));
+                break;
+            case NodeType256:
+                memcpy(static_cast<void*>(copy), node, sizeof(Node256));
+                break;
+        }
+        return copy;
+    }
+
+    ArtNode* rebuild(ArtNode* node, int8_t type, int addByte,
+                     ArtNode* added, int skipByte) {
+        // An unpublished node of the given type with the prefix and
+        // children of node, plus added at addByte and without the child at
+        // skipByte (-1 for none)
+        ArtNode* n = newNode(type);
+        copyPrefix(node, n);
+        for (int pos = nextChild(node, -1); pos >= 0;
+             pos = nextChild(node, pos)) {
+            int keyByte = keyByteAt(node, pos);
+            if (addByte >= 0 && addByte < keyByte) {
+                appendChild(n, addByte, added);
+                addByte = -1;
+            }
+            if (keyByte != skipByte)
+                appendChild(n, keyByte, childAt(node, pos));
+        }
+        if (addByte >= 0) appendChild(n, addByte, added);
+        return n;
+    }
+
+    void addChild(ArtNode* node, ArtNode** nodeRef, uint8_t keyByte,
+                  ArtNode* child) {
+        // Add a child for a key byte the node has no child for
+        if (node->type == NodeType256) {
+            // The slot is the only thing readers see change
+            node->count++;
+            __atomic_store_n(&static_cast<Node256*>(node)->child[keyByte],
+                             child, __ATOMIC_RELEASE);
+            return;
+        }
+        if (node->type == NodeType48 && !insertGrows(node)) {
+            // Fill a free slot first, then publish its index
+            Node48* n = static_cast<Node48*>(node);
+            unsigned pos = 0;
+            while (n->child[pos]) pos++;
+            __atomic_store_n(&n->child[pos], child, __ATOMIC_RELEASE);
+            __atomic_store_n(&n->childIndex[keyByte], uint8_t(pos),
+                             __ATOMIC_RELEASE);
+            n->count++;
+            return;
+        }
+        // Node4 and Node16 are rebuilt, full nodes grow
+        int8_t type = insertGrows(node) ? node->type + 1 : node->type;
+        publish(nodeRef, rebuild(node, type, keyByte, child, -1));
+        retire(node);
+    }
+
+    void removeChild(ArtNode* node, ArtNode** nodeRef, uint8_t keyByte,
+                     ArtNode** slot) {
+        // Remove the child at slot (for keyByte) from the node
+        if (node->type == NodeType4 && node->count == 2) {
+            // The remaining child replaces the node, an inner child is
+            // copied with the prefix of the node and the key byte in front
+            Node4* n = static_cast<Node4*>(node);
+            unsigned other = slot == &n->child[0] ? 1 : 0;
+            ArtNode* child = n->child[other];
+            if (!isLeaf(child)) {
+                ArtNode* copy = copyNode(child);
+                uint8_t prefix[maxPrefixLength];
+                unsigned l = min(node->prefixLength, maxPrefixLength);
+                memcpy(prefix, node->prefix, l);
+                if (l < maxPrefixLength) prefix[l++] = n->key[other];
+                unsigned l2 = min(child->prefixLength, maxPrefixLength - l);
+                memcpy(prefix + l, child->prefix, l2);
+                memcpy(copy->prefix, prefix, l + l2);
+                copy->prefixLength += node->prefixLength + 1;
+                publish(nodeRef, copy);
+                retire(child);
+            } else {
+                publish(nodeRef, child);
+            }
+            retire(node);
+            return;
+        }
+        if (node != root && eraseShrinks(node)) {
+            publish(nodeRef,
+                    rebuild(node, node->type - 1, -1, NULL, keyByte));
+            retire(node);
+            return;
+        }
+        switch (node->type) {
+            case NodeType256:
+                __atomic_store_n(slot, static_cast<ArtNode*>(NULL),
+                                 __ATOMIC_RELEASE);
+                node->count--;
+                break;
+            case NodeType48: {
+                // Unpublish the index first; the slot is cleared for reuse
+                Node48* n = static_cast<Node48*>(node);
+                __atomic_store_n(&n->childIndex[keyByte], emptyMarker,
+                                 __ATOMIC_RELEASE);
+                __atomic_store_n(slot, static_cast<ArtNode*>(NULL),
+                                 __ATOMIC_RELEASE);
+                node->count--;
+                break;
+            }
+            default:
+                publish(nodeRef, rebuild(node, node->type, -1, NULL, keyByte));
+                retire(node);
+                break;
+        }
+    }
+
+    unsigned prefixMismatch(ArtNode* node, const uint8_t key[],
+                            unsigned keyLength, unsigned depth) const {
+        // Compare the key with the prefix of the node, return the number
+        // of matching bytes; long prefixes are completed from a leaf
+        unsigned length = Base::withinKey(
+            min(node->prefixLength, keyLength > depth ? keyLength - depth : 0),
+            depth);
+        if (node->prefixLength <= maxPrefixLength)
+            return mismatch(key + depth, node->prefix, length);
+        unsigned pos = mismatch(key + depth, node->prefix,
+                                min(length, maxPrefixLength));
+        if (pos < maxPrefixLength) return pos;
+        unsigned from = depth + pos;
+        if (from >= maxKeyLength) return pos;
+        uint8_t buffer[maxKeyLength];
+        const uint8_t* minKey = leafKey(ART::minimum(node), buffer);
+        return pos + mismatch(key + from, minKey + from,
+                              Base::withinKey(length - pos, from));
+    }
+
+    ArtNode* root;
+    Allocator alloc;  // used by the writer only
+    mutable EpochManager epoch;
+    EpochManager::Participant* writer;
+    std::mutex threadsMutex;
+    std::vector<std::unique_ptr<ThreadInfo>> threads;
+};
+
+}  // namespace ROWEX
+}  // namespace ART
@@ -0,0 +1,494 @@
+/*
+  Slab allocation for tree nodes
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>  // size_t
+#include <stdint.h>  // integer types
+#include <stdlib.h>  // malloc, free
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <new>  // std::bad_alloc
+#include <utility>  // std::swap
+#include <vector>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+namespace ART {
+
+// Page sizes for node memory, see MemoryOptions. Explicit huge pages need
+// pages reserved in the kernel's hugetlb pool (vm.nr_hugepages); without
+// them the arena falls back to transparent huge pages.
+enum HugePages {
+    HugePagesNone,         // system allocator, base pages
+    HugePagesTransparent,  // 2 MB aligned regions with MADV_HUGEPAGE
+    HugePages2MB,          // MAP_HUGETLB 2 MB pages
+    HugePages1GB           // MAP_HUGETLB 1 GB pages
+};
+
+// NUMA placement of node memory, see MemoryOptions
+enum NumaPolicy {
+    NumaDefault,     // first touch, the kernel's default
+    NumaInterleave,  // pages interleaved over all allowed nodes
+    NumaBind         // pages bound to MemoryOptions::numaNode
+};
+
+// How a tree obtains its node and leaf memory
+struct MemoryOptions {
+    HugePages hugePages;
+    NumaPolicy numa;
+    int numaNode;  // node for NumaBind
+
+    MemoryOptions(HugePages hugePages = HugePagesNone,
+                  NumaPolicy numa = NumaDefault, int numaNode = 0)
+        : hugePages(hugePages), numa(numa), numaNode(numaNode) {}
+
+    bool usesArena() const {
+        // Anything but the defaults needs memory mapped by a PageArena
+        return hugePages != HugePagesNone || numa != NumaDefault;
+    }
+};
+
+// Memory mapped in large regions with the page size and NUMA placement of
+// MemoryOptions. Regions are carved by bumping and are only returned all at
+// once by release(); SlabPools take their chunks from an arena instead of
+// the system allocator.
+class PageArena {
+   public:
+    explicit PageArena(const MemoryOptions& options)
+        : options(options), bump(NULL), end(NULL), fallbacks(0) {}
+
+    PageArena(const PageArena&) = delete;
+    PageArena& operator=(const PageArena&) = delete;
+
+    ~PageArena() { release(); }
+
+    void* allocate(size_t bytes, size_t alignment) {
+        // Memory for a chunk, aligned to a power of two
+        uint8_t* p = alignUp(bump, alignment);
+        if (!bump || p + bytes > end) {
+            size_t regionBytes = this->regionBytes();
+            map(((bytes + alignment + regionBytes - 1) / regionBytes) *
+                regionBytes);
+            p = alignUp(bump, alignment);
+        }
+        bump = p + bytes;
+        return p;
+    }
+
+    void release() {
+        // Unmap every region, invalidating all memory handed out
+        for (const Region& r : regions) munmap(r.base, r.bytes);
+        regions.clear();
+        bump = end = NULL;
+    }
+
+    void merge(PageArena& other) {
+        // Take over the regions of another arena, the rest of its current
+        // region stays unused
+        regions.insert(regions.end(), other.regions.begin(),
+                       other.regions.end());
+        fallbacks += other.fallbacks;
+        other.regions.clear();
+        other.bump = other.end = NULL;
+    }
+
+    size_t bytesMapped() const {
+        size_t bytes = 0;
+        for (const Region& r : regions) bytes += r.bytes;
+        return bytes;
+    }
+
+    // Regions that did not get the requested page size or placement
+    size_t fallbackCount() const { return fallbacks; }
+
+    const MemoryOptions options;
+
+   private:
+    struct Region {
+        uint8_t* base;
+        size_t bytes;
+    };
+
+    static const size_t hugePageBytes = size_t(2) << 20;
+
+    // Linux memory policy modes and flags (linux/mempolicy.h)
+    static const int mpolBind = 2;
+    static const int mpolInterleave = 3;
+    static const unsigned long mpolMemsAllowed = 1 << 2;
+
+    static uint8_t* alignUp(uint8_t* p, size_t alignment) {
+        return reinterpret_cast<uint8_t*>(
+            (reinterpret_cast<uintptr_t>(p) + alignment - 1) &
+            ~uintptr_t(alignment - 1));
+    }
+
+    size_t regionBytes() const {
+        return options.hugePages == HugePages1GB ? size_t(1) << 30
+                                                 : hugePageBytes;
+    }
+
+    void map(size_t bytes) {
+        // Map a region and make it the current one
+        uint8_t* base = NULL;
+        if (options.hugePages == HugePages2MB ||
+            options.hugePages == HugePages1GB) {
+            int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                        (options.hugePages == HugePages1GB ? MAP_HUGE_1GB
+                                                           : MAP_HUGE_2MB);
+            void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if (p != MAP_FAILED)
+                base = static_cast<uint8_t*>(p);
+            else
+                fallbacks++;
+        }
+        if (!base) {
+            // Over-map, then trim to a huge page boundary so that THP can
+            // back the whole region
+            size_t mapped = bytes + hugePageBytes;
+            void* p = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) throw std::bad_alloc();
+            uint8_t* raw = static_cast<uint8_t*>(p);
+            base = alignUp(raw, hugePageBytes);
+            if (base != raw) munmap(raw, base - raw);
+            if (raw + mapped != base + bytes)
+                munmap(base + bytes, raw + mapped - (base + bytes));
+            if (options.hugePages != HugePagesNone)
+                madvise(base, bytes, MADV_HUGEPAGE);
+        }
+        if (options.numa != NumaDefault && !place(base, bytes)) fallbacks++;
+        regions.push_back(Region{base, bytes});
+        bump = base;
+        end = base + bytes;
+    }
+
+    bool place(uint8_t* base, size_t bytes) const {
+        // Set the NUMA policy of a region before it is touched
+#if defined(SYS_mbind) && defined(SYS_get_mempolicy)
+        unsigned long mask[16] = {0};
+        const unsigned long maxNode = sizeof(mask) * 8;
+        if (options.numa == NumaBind) {
+            if (options.numaNode < 0 || unsigned(options.numaNode) >= maxNode)
+                return false;
+            mask[options.numaNode / 64] = 1ul << (options.numaNode % 64);
+        } else if (syscall(SYS_get_mempolicy, NULL, mask, maxNode, NULL,
+                           mpolMemsAllowed) != 0) {
+            return false;
+        }
+        int mode = options.numa == NumaBind ? mpolBind : mpolInterleave;
+        return syscall(SYS_mbind, base, bytes, mode, mask, maxNode, 0) == 0;
+#else
+        (void)base, (void)bytes;
+        return false;
+#endif
+    }
+
+    std::vector<Region> regions;
+    uint8_t* bump;
+    uint8_t* end;
+    size_t fallbacks;
+};
+
+// Pool of fixed-size slots. Slots are carved from large chunks and freed
+// slots are kept on an intrusive free list for reuse, so steady-state
+// allocation never reaches the system allocator. All chunks are returned at
+// once by release(), which costs O(chunks) instead of O(slots). Slots are
+// aligned to the given power of two, at least 8. Chunks come from the
+// system allocator, or from an arena which then owns them.
+class SlabPool {
+   public:
+    SlabPool(size_t slotSize, size_t alignment = 8, PageArena* arena = NULL)
+        : arena(arena),
+          alignment(alignment < 8 ? 8 : alignment),
+          slotSize(roundUp(slotSize < sizeof(FreeSlot) ? sizeof(FreeSlot)
+                                                       : slotSize,
+                           this->alignment)),
+          headerBytes(roundUp(sizeof(Chunk), this->alignment)),
+          slotsPerChunk(chunkBytes / this->slotSize < minSlotsPerChunk
+                            ? minSlotsPerChunk
+                            : chunkBytes / this->slotSize),
+          chunks(NULL),
+          freeList(NULL),
+          bump(NULL),
+          end(NULL),
+          chunkCount(0) {}
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    SlabPool(SlabPool&& other) noexcept
+        : arena(other.arena),
+          alignment(other.alignment),
+          slotSize(other.slotSize),
+          headerBytes(other.headerBytes),
+          slotsPerChunk(other.slotsPerChunk),
+          chunks(other.chunks),
+          freeList(other.freeList),
+          bump(other.bump),
+          end(other.end),
+          chunkCount(other.chunkCount) {
+        other.forget();
+    }
+
+    ~SlabPool() { release(); }
+
+    void* allocate() {
+        // Hand out a recycled slot if there is one, otherwise bump-allocate
+        // from the current chunk
+        if (freeList) {
+            FreeSlot* slot = freeList;
+            freeList = slot->next;
+            return slot;
+        }
+        if (bump == end) refill();
+        void* slot = bump;
+        bump += slotSize;
+        return slot;
+    }
+
+    void deallocate(void* slot) {
+        // Push the slot onto the free list
+        FreeSlot* s = static_cast<FreeSlot*>(slot);
+        s->next = freeList;
+        freeList = s;
+    }
+
+    void release() {
+        // Return every chunk to the system, invalidating all slots; arena
+        // chunks go back with the arena
+        while (chunks && !arena) {
+            Chunk* next = chunks->next;
+            free(chunks);
+            chunks = next;
+        }
+        forget();
+    }
+
+    void merge(SlabPool& other) {
+        // Take over the chunks of a pool with the same slot size, its free
+        // slots and the unused rest of its current chunk become free slots
+        // of this pool
+        assert(other.slotSize == slotSize && other.alignment == alignment);
+        for (uint8_t* slot = other.bump; slot != other.end; slot += slotSize)
+            deallocate(slot);
+        while (other.freeList) {
+            FreeSlot* slot = other.freeList;
+            other.freeList = slot->next;
+            deallocate(slot);
+        }
+        if (other.chunks) {
+            Chunk* last = other.chunks;
+            while (last->next) last = last->next;
+            last->next = chunks;
+            chunks = other.chunks;
+        }
+        chunkCount += other.chunkCount;
+        other.forget();
+    }
+
+    void swap(SlabPool& other) {
+        // Exchange all slots and chunks with another pool, O(1)
+        std::swap(arena, other.arena);
+        std::swap(alignment, other.alignment);
+        std::swap(slotSize, other.slotSize);
+        std::swap(headerBytes, other.headerBytes);
+        std::swap(slotsPerChunk, other.slotsPerChunk);
+        std::swap(chunks, other.chunks);
+        std::swap(freeList, other.freeList);
+        std::swap(bump, other.bump);
+        std::swap(end, other.end);
+        std::swap(chunkCount, other.chunkCount);
+    }
+
+    size_t bytesReserved() const {
+        // Memory obtained from the system, including unused slots
+        return chunkCount * (headerBytes + slotsPerChunk * slotSize);
+    }
+
+   private:
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    // Header in front of the slots of each chunk
+    struct alignas(16) Chunk {
+        Chunk* next;
+    };
+
+    static const size_t chunkBytes = 64 * 1024;
+    static const size_t minSlotsPerChunk = 16;
+
+    static size_t roundUp(size_t size, size_t alignment) {
+        return (size + alignment - 1) & ~(alignment - 1);
+    }
+
+    void refill() {
+        // Start a new chunk, the slots follow the header padded to the
+        // alignment
+        void* memory;
+        size_t bytes = headerBytes + slotsPerChunk * slotSize;
+        size_t chunkAlignment =
+            alignment < alignof(Chunk) ? alignof(Chunk) : alignment;
+        if (arena)
+            memory = arena->allocate(bytes, chunkAlignment);
+        else if (posix_memalign(&memory, chunkAlignment, bytes))
+            throw std::bad_alloc();
+        Chunk* chunk = static_cast<Chunk*>(memory);
+        chunk->next = chunks;
+        chunks = chunk;
+        chunkCount++;
+        bump = reinterpret_cast<uint8_t*>(chunk) + headerBytes;
+        end = bump + slotsPerChunk * slotSize;
+    }
+
+    void forget() {
+        chunks = NULL;
+        freeList = NULL;
+        bump = end = NULL;
+        chunkCount = 0;
+    }
+
+    PageArena* arena;
+    size_t alignment;
+    size_t slotSize;
+    size_t headerBytes;
+    size_t slotsPerChunk;
+    Chunk* chunks;
+    FreeSlot* freeList;
+    uint8_t* bump;
+    uint8_t* end;
+    size_t chunkCount;
+};
+
+// Variable-size blocks rounded up to 16-byte size classes, each class backed
+// by its own SlabPool. Blocks larger than the biggest class come from malloc
+// and are kept on a list, so release() frees them together with the slabs.
+class SizeClassPool {
+   public:
+    static const size_t granularity = 16;
+    static const size_t maxClassBytes = 256;
+
+    explicit SizeClassPool(PageArena* arena = NULL)
+        : large(NULL), largeBytes(0) {
+        // Size classes take their chunks from the arena, if any
+        classes.reserve(maxClassBytes / granularity);
+        for (size_t size = granularity; size <= maxClassBytes;
+             size += granularity)
+            classes.emplace_back(size, size_t(granularity), arena);
+    }
+
+    SizeClassPool(const SizeClassPool&) = delete;
+    SizeClassPool& operator=(const SizeClassPool&) = delete;
+
+    SizeClassPool(SizeClassPool&& other) noexcept
+        : classes(std::move(other.classes)),
+          large(other.large),
+          largeBytes(other.largeBytes) {
+        other.large = NULL;
+        other.largeBytes = 0;
+    }
+
+    ~SizeClassPool() { release(); }
+
+    void* allocate(size_t bytes) {
+        // Allocate a block of at least the given size, 16-byte aligned
+        if (bytes <= maxClassBytes) return classes[index(bytes)].allocate();
+        LargeBlock* block =
+            static_cast<LargeBlock*>(malloc(sizeof(LargeBlock) + bytes));
+        if (!block) throw std::bad_alloc();
+        block->prev = NULL;
+        block->next = large;
+        block->bytes = bytes;
+        if (large) large->prev = block;
+        large = block;
+        largeBytes += bytes;
+        return block + 1;
+    }
+
+    void deallocate(void* p, size_t bytes) {
+        // Free a block, bytes must be the size it was allocated with
+        if (bytes <= maxClassBytes) return classes[index(bytes)].deallocate(p);
+        LargeBlock* block = static_cast<LargeBlock*>(p) - 1;
+        if (block->prev)
+            block->prev->next = block->next;
+        else
+            large = block->next;
+        if (block->next) block->next->prev = block->prev;
+        largeBytes -= block->bytes;
+        free(block);
+    }
+
+    void release() {
+        // Free all blocks at once
+        for (SlabPool& pool : classes) pool.release();
+        while (large) {
+            LargeBlock* next = large->next;
+            free(large);
+            large = next;
+        }
+        largeBytes = 0;
+    }
+
+    void merge(SizeClassPool& other) {
+        // Take over all blocks of another pool
+        for (size_t i = 0; i < classes.size(); i++)
+            classes[i].merge(other.classes[i]);
+        if (other.large) {
+            LargeBlock* last = other.large;
+            while (last->next) last = last->next;
+            last->next = large;
+            if (large) large->prev = last;
+            large = other.large;
+        }
+        largeBytes += other.largeBytes;
+        other.large = NULL;
+        other.largeBytes = 0;
+    }
+
+    void swap(SizeClassPool& other) {
+        // Exchange all blocks with another pool, O(1)
+        classes.swap(other.classes);
+        std::swap(large, other.large);
+        std::swap(largeBytes, other.largeBytes);
+    }
+
+    size_t bytesReserved() const {
+        size_t bytes = largeBytes;
+        for (const SlabPool& pool : classes) bytes += pool.bytesReserved();
+        return bytes;
+    }
+
+    // Bytes of the blocks above the size classes, which always come from
+    // malloc, also with an arena
+    size_t largeBlockBytes() const { return largeBytes; }
+
+   private:
+    struct alignas(16) LargeBlock {
+        LargeBlock* prev;
+        LargeBlock* next;
+        size_t bytes;
+    };
+
+    static size_t index(size_t bytes) {
+        return bytes ? (bytes - 1) / granularity : 0;
+    }
+
+    std::vector<SlabPool> classes;
+    LargeBlock* large;
+    size_t largeBytes;
+};
+
+}  // namespace ART
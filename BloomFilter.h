@@ -0,0 +1,158 @@
+/*
+  Counting Bloom filter over key bytes, kept by a tree to answer most
+  lookups of missing keys without a traversal
+ */
+
+#pragma once
+
+#include <stddef.h>  // size_t
+#include <stdint.h>  // integer types
+#include <string.h>  // memcpy
+
+#include <utility>  // std::swap
+#include <vector>
+
+namespace ART {
+
+// Blocked counting Bloom filter: a key hashes to one 64-byte block (one
+// cache line) and sets probes 4-bit counters in it, so a query costs one
+// cache miss. Counters make erase possible; one that reaches its maximum
+// stays there (erase leaves it alone), which can only add false positives.
+// There are no false negatives for keys added and not removed.
+class CountingBloomFilter {
+   public:
+    static const unsigned counterBits = 4;
+    static const unsigned countersPerBlock = 64 * 8 / counterBits;
+    static const unsigned probes = 4;
+    static const uint8_t counterMax = (1 << counterBits) - 1;
+
+    CountingBloomFilter() : keyCount(0) {}
+
+    void reset(size_t keys, unsigned countersPerKey) {
+        // Size the filter for a number of keys and drop all of them; 8
+        // counters per key give about 3% false positives at that load
+        size_t counters = keys * countersPerKey;
+        size_t count = (counters + countersPerBlock - 1) / countersPerBlock;
+        blocks.assign(count ? count : 1, Block());
+        keyCount = 0;
+    }
+
+    void release() {
+        // Free the counters, the filter passes every key until reset
+        std::vector<Block>().swap(blocks);
+        keyCount = 0;
+    }
+
+    void clear() {
+        // Remove every key, keeping the size
+        blocks.assign(blocks.size(), Block());
+        keyCount = 0;
+    }
+
+    void swap(CountingBloomFilter& other) {
+        blocks.swap(other.blocks);
+        std::swap(keyCount, other.keyCount);
+    }
+
+    bool enabled() const { return !blocks.empty(); }
+
+    // Keys added and not removed
+    size_t keys() const { return keyCount; }
+
+    size_t bytes() const { return blocks.size() * sizeof(Block); }
+
+    void add(const uint8_t key[], unsigned keyLength) {
+        uint64_t h = hash(key, keyLength);
+        Block& b = block(h);
+        for (unsigned i = 0; i < probes; i++) {
+            unsigned pos = probe(h, i);
+            if (counter(b, pos) != counterMax)
+                b.counters[pos / 2] += unit(pos);
+        }
+        keyCount++;
+    }
+
+    void remove(const uint8_t key[], unsigned keyLength) {
+        // Undo add of a key that is in the filter
+        uint64_t h = hash(key, keyLength);
+        Block& b = block(h);
+        for (unsigned i = 0; i < probes; i++) {
+            unsigned pos = probe(h, i);
+            uint8_t c = counter(b, pos);
+            if (c != counterMax && c != 0) b.counters[pos / 2] -= unit(pos);
+        }
+        keyCount--;
+    }
+
+    bool mayContain(const uint8_t key[], unsigned keyLength) const {
+        // False only if the key was never added (or was removed)
+        uint64_t h = hash(key, keyLength);
+        const Block& b = block(h);
+        for (unsigned i = 0; i < probes; i++)
+            if (counter(b, probe(h, i)) == 0) return false;
+        return true;
+    }
+
+    void prefetch(const uint8_t key[], unsigned keyLength) const {
+        __builtin_prefetch(&block(hash(key, keyLength)));
+    }
+
+    static uint64_t hash(const uint8_t key[], unsigned keyLength) {
+        // 64-bit hash of the key bytes, 8 at a time with a
+        // multiply-xorshift step each and a final avalanche
+        uint64_t h = 0x9E3779B97F4A7C15ull ^ keyLength;
+        unsigned i = 0;
+        for (; i + 8 <= keyLength; i += 8) {
+            uint64_t word;
+            memcpy(&word, key + i, 8);
+            h = mix(h ^ word);
+        }
+        if (i < keyLength) {
+            uint64_t word = 0;
+            memcpy(&word, key + i, keyLength - i);
+            h = mix(h ^ word);
+        }
+        return mix(h);
+    }
+
+   private:
+    struct alignas(64) Block {
+        uint8_t counters[countersPerBlock / 2];  // two counters per byte
+
+        Block() { memset(counters, 0, sizeof(counters)); }
+    };
+
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    Block& block(uint64_t h) {
+        // The high half of the hash picks the block, without a division
+        return blocks[((h >> 32) * blocks.size()) >> 32];
+    }
+
+    const Block& block(uint64_t h) const {
+        return blocks[((h >> 32) * blocks.size()) >> 32];
+    }
+
+    static unsigned probe(uint64_t h, unsigned i) {
+        // Counter i of a key within its block, from the low half of the hash
+        return (h >> (7 * i)) & (countersPerBlock - 1);
+    }
+
+    static uint8_t counter(const Block& b, unsigned pos) {
+        return (b.counters[pos / 2] >> (pos % 2 * counterBits)) & counterMax;
+    }
+
+    static uint8_t unit(unsigned pos) { return 1 << (pos % 2 * counterBits); }
+
+    std::vector<Block> blocks;
+    size_t keyCount;
+};
+
+}  // namespace ART
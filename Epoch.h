@@ -0,0 +1,127 @@
+/*
+  Epoch-based memory reclamation for the concurrent tree variants
+ */
+
+#pragma once
+
+#include <stdint.h>  // integer types
+
+#include <atomic>
+#include <memory>  // std::unique_ptr
+#include <mutex>
+#include <utility>  // std::pair
+#include <vector>
+
+namespace ART {
+
+// Deferred freeing of memory that writers unlinked while readers may still
+// hold pointers to it. Each thread joins once and brackets every operation
+// with enter()/exit() (see EpochGuard). Memory retired in epoch e is handed
+// back once every thread inside an operation entered after e.
+class EpochManager {
+   public:
+    // Epoch of a participant that is not inside an operation
+    static const uint64_t idle = UINT64_MAX;
+    // Retired entries a participant buffers before it tries to collect
+    static const size_t collectThreshold = 256;
+
+    struct Participant {
+        std::atomic<uint64_t> epoch{idle};
+        std::vector<std::pair<uint64_t, void*>> retired;
+    };
+
+    EpochManager() : globalEpoch(0) {}
+
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
+
+    Participant* join() {
+        // Register a thread, the participant lives as long as the manager
+        std::lock_guard<std::mutex> guard(mutex);
+        participants.emplace_back(new Participant());
+        return participants.back().get();
+    }
+
+    void enter(Participant* p) {
+        // Announce the epoch before the first shared pointer is read
+        p->epoch.store(globalEpoch.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void exit(Participant* p) {
+        p->epoch.store(idle, std::memory_order_release);
+    }
+
+    template <typename Free>
+    void retire(Participant* p, void* ptr, Free free) {
+        // Free ptr once no reader can reach it anymore, ptr must already be
+        // unlinked from the tree
+        p->retired.emplace_back(globalEpoch.load(std::memory_order_relaxed),
+                                ptr);
+        if (p->retired.size() >= collectThreshold) collect(p, free);
+    }
+
+    template <typename Free>
+    void collect(Participant* p, Free free) {
+        // Advance the epoch and free the entries retired before the oldest
+        // epoch still in use
+        globalEpoch.fetch_add(1, std::memory_order_seq_cst);
+        uint64_t safe = oldestEpoch();
+        size_t kept = 0;
+        for (auto& entry : p->retired) {
+            if (entry.first < safe)
+                free(entry.second);
+            else
+                p->retired[kept++] = entry;
+        }
+        p->retired.resize(kept);
+    }
+
+    template <typename Free>
+    void drain(Free free) {
+        // Free everything that was retired, no thread may be inside an
+        // operation
+        std::lock_guard<std::mutex> guard(mutex);
+        for (auto& p : participants) {
+            for (auto& entry : p->retired) free(entry.second);
+            p->retired.clear();
+        }
+    }
+
+   private:
+    uint64_t oldestEpoch() {
+        // Smallest epoch announced by a thread inside an operation
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::lock_guard<std::mutex> guard(mutex);
+        uint64_t oldest = idle;
+        for (auto& p : participants) {
+            uint64_t e = p->epoch.load(std::memory_order_acquire);
+            if (e < oldest) oldest = e;
+        }
+        return oldest;
+    }
+
+    std::atomic<uint64_t> globalEpoch;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Participant>> participants;
+};
+
+// Keeps the calling thread inside an epoch for its lifetime
+class EpochGuard {
+   public:
+    EpochGuard(EpochManager& manager, EpochManager::Participant* p)
+        : manager(manager), p(p) {
+        manager.enter(p);
+    }
+    ~EpochGuard() { manager.exit(p); }
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+
+   private:
+    EpochManager& manager;
+    EpochManager::Participant* p;
+};
+
+}  // namespace ART
@@ -0,0 +1,564 @@
+/*
+  Compact read-only trees: the nodes of a built tree packed breadth-first
+  into one array with 32-bit child offsets, served from memory or from a
+  mapping of a saved image
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "ART.h"
+#include "MappedFile.h"
+
+namespace ART {
+
+// Frozen node layout, fields unaligned in native byte order:
+//   uint8  kind               frozenList or frozenBitmap
+//   uint8  count - 1          number of children, 1..256
+//   uint16 prefixLength
+//   uint8  prefix[prefixLength]  the whole prefix, none is skipped
+//   frozenList (count <= 16):
+//     uint8  keys[count]      sorted key bytes
+//     uint16 leafMask         bit i set if child i is a leaf
+//   frozenBitmap (count > 16), one group per 64 key bytes, so a search
+//   reads 17 adjacent bytes:
+//     uint64 present          bit b set if there is a child for key byte b
+//     uint64 leaves           bit b set if that child is a leaf
+//     uint8  rank             children in the groups before
+//   slot   child[count]       the children in key order: the offset of an
+//                             inner node, the value of a pseudo-leaf or
+//                             the offset of a stored leaf record in the
+//                             leaf region
+// Nodes hold no empty child slots and no pointers, and a child is found
+// with at most one population count. Leaves live in their parent; a tree
+// that is a single leaf gets a list root with one child.
+static const uint8_t frozenList = 0;
+static const uint8_t frozenBitmap = 1;
+static const unsigned frozenListMax = 16;
+static const unsigned frozenHeaderBytes = 4;
+static const unsigned frozenGroupBytes = 17;
+static const unsigned frozenBitmapBytes = 4 * frozenGroupBytes;
+
+// File and memory layout: the header, the nodes breadth-first from the
+// root, then the leaf region (stored leaf records, aligned as in memory)
+// and padding for the 16-byte key search of list nodes
+struct FrozenHeader {
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t keyLength;     // KeyLoader::keyLength
+    uint32_t storedLeaves;  // 1 for StoredLeaves
+    uint32_t slotBytes;     // size of a leaf slot
+    uint32_t leafBytes;     // sizeof of the leaf record header
+    uint32_t root;          // offset of the root, 0 for an empty tree
+    uint64_t byteOrder;     // frozenByteOrder as written
+    uint64_t leafRegion;    // offset of the leaf records
+    uint64_t fileBytes;
+    uint64_t leaves;
+};
+
+static const char frozenMagic[8] = {'A', 'R', 'T', 'F', 'R', 'O', 'Z', 0};
+static const uint32_t frozenFormatVersion = 1;
+static const uint64_t frozenByteOrder = 0x0102030405060708ull;
+static const size_t frozenPadding = 16;
+
+template <typename T>
+static inline T loadUnaligned(const uint8_t* p) {
+    T v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Read-only tree built once from a Tree (freeze) or mapped from an image
+// (open). Lookups return leaves like Tree::lookup does: pseudo-leaves as
+// leaf values, stored leaves as tagged pointers to records inside the
+// image. All prefixes are complete, so a lookup reaching a leaf only has
+// to check the key bytes after the leaf's position; pseudo-leaves load
+// their key for that whenever the key continues past it.
+template <typename Key, typename Value = uintptr_t,
+          typename KeyLoader = IntegerKeyLoader<Key>,
+          typename Leaves = PseudoLeaves>
+class FrozenTree : public TreeBase<Key, Value, KeyLoader, Leaves> {
+    typedef TreeBase<Key, Value, KeyLoader, Leaves> Base;
+
+   public:
+    using Base::compareKeys;
+    using Base::leafKey;
+    using Base::leafKeyLength;
+    using Base::maxKeyLength;
+    using Base::storedLeaves;
+    using Base::value;
+    typedef typename Base::Leaf Leaf;
+
+    // Child slots hold a 32-bit offset or a pseudo-leaf value
+    static const unsigned slotBytes =
+        storedLeaves || sizeof(Value) < sizeof(uint32_t) ? sizeof(uint32_t)
+                                                         : sizeof(Value);
+
+    static_assert(maxKeyLength <= UINT16_MAX, "prefix lengths are 16-bit");
+    static_assert(alignof(Leaf) <= frozenPadding,
+                  "leaf records are aligned within the image");
+
+    explicit FrozenTree(KeyLoader loader = KeyLoader())
+        : Base(loader), base(NULL), root(0), leafRegion(0), bytes(0),
+          leaves(0), leafCount(0) {}
+
+    FrozenTree(const FrozenTree&) = delete;
+    FrozenTree& operator=(const FrozenTree&) = delete;
+
+    template <typename T>
+    bool freeze(const T& tree) {
+        // Pack a Tree with the same key and leaf types, return false (and
+        // stay empty) if the nodes do not fit 32-bit offsets
+        static_assert(T::maxKeyLength == maxKeyLength &&
+                          T::storedLeaves == storedLeaves,
+                      "the tree must have the key and leaf types of the "
+                      "frozen tree");
+        clear();
+        std::vector<uint8_t> records;
+        std::vector<Pending> queue;
+        storage.resize(sizeof(FrozenHeader));
+        if (ArtNode* r = tree.getRoot()) {
+            queue.push_back({r, 0, storage.size()});
+            storage.resize(storage.size() + frozenBytes(r));
+        }
+        for (size_t head = 0; head < queue.size(); head++) {
+            // Children are placed at the end as their parent is written,
+            // which is the order they are written in
+            if (storage.size() > UINT32_MAX) {
+                clear();
+                return false;
+            }
+            write(tree, queue[head], queue, records);
+        }
+        if (records.size() > UINT32_MAX) {
+            clear();
+            return false;
+        }
+
+        size_t region = (storage.size() + frozenPadding - 1) &
+                        ~(frozenPadding - 1);
+        storage.resize(region);
+        storage.insert(storage.end(), records.begin(), records.end());
+        storage.resize(storage.size() + frozenPadding);
+
+        FrozenHeader header = frozenHeader();
+        header.root = queue.empty() ? 0 : sizeof(FrozenHeader);
+        header.leafRegion = region;
+        header.fileBytes = storage.size();
+        header.leaves = leafCount;
+        memcpy(storage.data(), &header, sizeof(header));
+        return attach(storage.data());
+    }
+
+    bool save(const char* path) const {
+        // Write the image to a file, return false on I/O errors
+        FILE* out = fopen(path, "wb");
+        if (!out) return false;
+        bool ok = !bytes || fwrite(base, bytes, 1, out) == 1;
+        return fclose(out) == 0 && ok;
+    }
+
+    bool open(const char* path, int advice = MADV_RANDOM) {
+        // Map an image written by save for this tree type, advice is passed
+        // to madvise
+        clear();
+        if (!file.open(path, advice)) return false;
+        FrozenHeader header, expected = frozenHeader();
+        if (file.bytes < sizeof(header)) {
+            clear();
+            return false;
+        }
+        memcpy(&header, file.data, sizeof(header));
+        if (memcmp(header.magic, expected.magic, sizeof(header.magic)) ||
+            header.formatVersion != expected.formatVersion ||
+            header.keyLength != expected.keyLength ||
+            header.storedLeaves != expected.storedLeaves ||
+            header.slotBytes != expected.slotBytes ||
+            header.leafBytes != expected.leafBytes ||
+            header.byteOrder != expected.byteOrder ||
+            header.fileBytes != file.bytes || header.root >= file.bytes ||
+            header.leafRegion > file.bytes) {
+            clear();
+            return false;
+        }
+        return attach(file.data);
+    }
+
+    ArtNode* lookup(const uint8_t key[],
+                    unsigned keyLength = maxKeyLength) const {
+        // Find the leaf with a matching key; every prefix is compared, so
+        // the leaf is only checked for the bytes after its position
+        if (!root || keyLength > maxKeyLength) return NULL;
+        const uint8_t* node = base + root;
+        unsigned depth = 0;
+        while (true) {
+            View v(node);
+            if (v.prefixLength) {
+                if (depth + v.prefixLength >= keyLength) return NULL;
+                unsigned length = Base::withinKey(v.prefixLength, depth);
+                if (mismatch(key + depth, v.prefix, length) != length)
+                    return NULL;
+                depth += v.prefixLength;
+            }
+            if (depth >= keyLength) return NULL;
+            int pos = v.find(key[depth]);
+            if (pos < 0) return NULL;
+            depth++;
+            if (v.leafAt(pos)) {
+                ArtNode* leaf = this->leaf(v, pos);
+                return leafMatches(leaf, key, keyLength, depth) ? leaf : NULL;
+            }
+            node = inner(v, pos);
+        }
+    }
+
+    ArtNode* lookup(const Key& key) const {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return lookup(k, keyLength);
+    }
+
+    template <typename Callback>
+    size_t scan(const uint8_t lo[], unsigned loLength, const uint8_t hi[],
+                unsigned hiLength, Callback callback,
+                size_t limit = SIZE_MAX) const {
+        // Call callback(leaf) for the leaves with keys in [lo, hi] in key
+        // order, at most limit of them; return the number visited
+        Scan<Callback> s = {lo, loLength, hi, hiLength, callback, 0, limit};
+        if (root && limit) scanNode(base + root, 0, true, s);
+        return s.n;
+    }
+
+    template <typename Callback>
+    size_t scan(const Key& lo, const Key& hi, Callback callback,
+                size_t limit = SIZE_MAX) const {
+        uint8_t l[maxKeyLength], h[maxKeyLength];
+        unsigned loLength = loader.encode(lo, l);
+        unsigned hiLength = loader.encode(hi, h);
+        return scan(l, loLength, h, hiLength, callback, limit);
+    }
+
+    bool empty() const { return root == 0; }
+    size_t size() const { return leaves; }
+    size_t imageBytes() const { return bytes; }
+
+   private:
+    using Base::leafMatches;
+    using Base::loader;
+
+    // A node of the tree being frozen and where it goes
+    struct Pending {
+        ArtNode* node;  // inner node, or a root leaf
+        unsigned depth;
+        size_t offset;
+    };
+
+    template <typename Callback>
+    struct Scan {
+        const uint8_t* lo;
+        unsigned loLength;
+        const uint8_t* hi;
+        unsigned hiLength;
+        Callback& callback;
+        size_t n;
+        size_t limit;
+    };
+
+    // Parsed header of a frozen node. A child position is the index in a
+    // list node and the key byte in a bitmap node; positions increase
+    // with the key byte.
+    struct View {
+        explicit View(const uint8_t* node)
+            : kind(node[0]),
+              count(node[1] + 1),
+              prefixLength(loadUnaligned<uint16_t>(node + 2)),
+              prefix(node + frozenHeaderBytes),
+              index(prefix + prefixLength),
+              leafMask(kind == frozenList
+                           ? loadUnaligned<uint16_t>(index + count)
+                           : 0),
+              slots(kind == frozenList ? index + count + sizeof(uint16_t)
+                                       : index + frozenBitmapBytes) {}
+
+        const uint8_t* group(unsigned word) const {
+            return index + word * frozenGroupBytes;
+        }
+        uint64_t present(unsigned word) const {
+            return loadUnaligned<uint64_t>(group(word));
+        }
+        uint64_t leaves(unsigned word) const {
+            return loadUnaligned<uint64_t>(group(word) + 8);
+        }
+
+        int find(uint8_t keyByte) const {
+            // Position of the child for a key byte, -1 if there is none
+            if (kind == frozenList) {
+                uint32_t mask =
+                    equalMask16(index, keyByte) & ((1u << count) - 1);
+                return mask ? int(ctz(uint16_t(mask))) : -1;
+            }
+            return (present(keyByte >> 6) >> (keyByte & 63)) & 1 ? keyByte
+                                                                  : -1;
+        }
+
+        int lower(unsigned keyByte) const {
+            // Position of the first child whose key byte is >= keyByte, -1
+            // if there is none
+            if (kind == frozenList) {
+                for (unsigned i = 0; i < count; i++)
+                    if (index[i] >= keyByte) return i;
+                return -1;
+            }
+            for (unsigned word = keyByte >> 6; word < 4; word++) {
+                uint64_t bits = present(word);
+                if (word == keyByte >> 6) bits &= ~0ull << (keyByte & 63);
+                if (bits) return word * 64 + ctz64(bits);
+            }
+            return -1;
+        }
+
+        int next(int pos) const {
+            // Position of the child after pos, -1 if there is none
+            if (kind == frozenList) return pos + 1 < int(count) ? pos + 1 : -1;
+            return pos < 255 ? lower(pos + 1) : -1;
+        }
+
+        uint8_t keyByte(int pos) const {
+            return kind == frozenList ? index[pos] : pos;
+        }
+
+        bool leafAt(int pos) const {
+            if (kind == frozenList) return (leafMask >> pos) & 1;
+            return (leaves(pos >> 6) >> (pos & 63)) & 1;
+        }
+
+        const uint8_t* slot(int pos) const {
+            // The child slot at a position
+            if (kind == frozenList) return slots + pos * slotBytes;
+            uint64_t below = (1ull << (pos & 63)) - 1;
+            unsigned rank = group(pos >> 6)[16] +
+                            popcount64(present(pos >> 6) & below);
+            return slots + rank * slotBytes;
+        }
+
+        uint8_t kind;
+        unsigned count;
+        unsigned prefixLength;
+        const uint8_t* prefix;
+        const uint8_t* index;  // list keys or bitmap words
+        uint16_t leafMask;     // list nodes only
+        const uint8_t* slots;
+    };
+
+    static FrozenHeader frozenHeader() {
+        // Header describing images of this tree type, before root and
+        // counts are known
+        FrozenHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, frozenMagic, sizeof(frozenMagic));
+        header.formatVersion = frozenFormatVersion;
+        header.keyLength = maxKeyLength;
+        header.storedLeaves = storedLeaves;
+        header.slotBytes = slotBytes;
+        header.leafBytes = sizeof(Leaf);
+        header.byteOrder = frozenByteOrder;
+        return header;
+    }
+
+    bool attach(const uint8_t* image) {
+        // Serve queries from an image with a checked header
+        FrozenHeader header;
+        memcpy(&header, image, sizeof(header));
+        base = image;
+        root = header.root;
+        leafRegion = header.leafRegion;
+        bytes = header.fileBytes;
+        leaves = header.leaves;
+        return true;
+    }
+
+    void clear() {
+        // Drop the image
+        file.close();
+        std::vector<uint8_t>().swap(storage);
+        base = NULL;
+        root = 0;
+        leafRegion = bytes = leaves = leafCount = 0;
+    }
+
+    ArtNode* leaf(const View& v, int pos) const {
+        // The leaf at a position, tagged like the leaves of Tree
+        const uint8_t* slot = v.slot(pos);
+        if constexpr (storedLeaves)
+            return reinterpret_cast<ArtNode*>(
+                reinterpret_cast<uintptr_t>(
+                    base + leafRegion + loadUnaligned<uint32_t>(slot)) |
+                1);
+        else
+            return makeLeaf(static_cast<uintptr_t>(loadUnaligned<Value>(slot)));
+    }
+
+    const uint8_t* inner(const View& v, int pos) const {
+        // The inner child at a position
+        return base + loadUnaligned<uint32_t>(v.slot(pos));
+    }
+
+    template <typename Callback>
+    bool scanNode(const uint8_t* node, unsigned depth, bool bounded,
+                  Scan<Callback>& s) const {
+        // Visit the leaves below node in key order, return false once the
+        // scan is over; bounded: the key bytes before depth equal those of
+        // lo, so children before lo are skipped
+        View v(node);
+        if (bounded) {
+            unsigned length = min(s.loLength > depth ? s.loLength - depth : 0,
+                                  v.prefixLength);
+            int cmp = memcmp(v.prefix, s.lo + depth, length);
+            if (cmp < 0) return true;
+            // Past lo, or lo ends inside the prefix
+            if (cmp > 0 || length < v.prefixLength) bounded = false;
+        }
+        depth += v.prefixLength;
+        if (depth >= s.loLength) bounded = false;
+        uint8_t buffer[maxKeyLength];
+        for (int pos = bounded ? v.lower(s.lo[depth]) : v.lower(0); pos >= 0;
+             pos = v.next(pos)) {
+            bool childBounded = bounded && v.keyByte(pos) == s.lo[depth];
+            if (!v.leafAt(pos)) {
+                if (!scanNode(inner(v, pos), depth + 1, childBounded, s))
+                    return false;
+                continue;
+            }
+            ArtNode* l = leaf(v, pos);
+            const uint8_t* k = leafKey(l, buffer);
+            if (childBounded &&
+                compareKeys(k, leafKeyLength(l), s.lo, s.loLength) < 0)
+                continue;
+            if (compareKeys(k, leafKeyLength(l), s.hi, s.hiLength) > 0)
+                return false;
+            s.callback(l);
+            if (++s.n == s.limit) return false;
+        }
+        return true;
+    }
+
+    template <typename T>
+    static void children(const T& tree, const Pending& p, uint8_t keys[],
+                         ArtNode* child[], unsigned& count) {
+        // The children of a node to freeze in key order; a root leaf is
+        // its own only child
+        count = 0;
+        if (isLeaf(p.node)) {
+            uint8_t buffer[maxKeyLength];
+            keys[0] = tree.leafKey(p.node, buffer)[0];
+            child[count++] = p.node;
+            return;
+        }
+        for (int pos = nextChild(p.node, -1); pos >= 0;
+             pos = nextChild(p.node, pos)) {
+            keys[count] = keyByteAt(p.node, pos);
+            child[count++] = childAt(p.node, pos);
+        }
+    }
+
+    static size_t frozenBytes(ArtNode* node) {
+        // Size of the frozen form of an inner node (or root leaf)
+        unsigned count = 1, prefixLength = 0;
+        if (!isLeaf(node)) {
+            count = node->count;
+            prefixLength = node->prefixLength;
+        }
+        size_t index = count <= frozenListMax ? count + sizeof(uint16_t)
+                                              : frozenBitmapBytes;
+        return frozenHeaderBytes + prefixLength + index + count * slotBytes;
+    }
+
+    template <typename T>
+    void write(const T& tree, Pending p, std::vector<Pending>& queue,
+               std::vector<uint8_t>& records) {
+        // Write one node at its offset and place its inner children
+        uint8_t keys[256];
+        ArtNode* child[256];
+        unsigned count;
+        children(tree, p, keys, child, count);
+        unsigned prefixLength = isLeaf(p.node) ? 0 : p.node->prefixLength;
+        uint8_t buffer[maxKeyLength];
+        const uint8_t* prefix = NULL;
+        if (prefixLength > maxPrefixLength)
+            prefix = tree.leafKey(ART::minimum(p.node), buffer) + p.depth;
+        else if (prefixLength)
+            prefix = p.node->prefix;
+
+        std::vector<uint8_t> node(frozenBytes(p.node), 0);
+        node[0] = count <= frozenListMax ? frozenList : frozenBitmap;
+        node[1] = count - 1;
+        uint16_t length = prefixLength;
+        memcpy(&node[2], &length, sizeof(length));
+        if (prefixLength)
+            memcpy(&node[frozenHeaderBytes], prefix, prefixLength);
+        uint8_t* index = &node[frozenHeaderBytes + prefixLength];
+        uint8_t* slot;
+        if (node[0] == frozenList) {
+            uint16_t leafMask = 0;
+            for (unsigned i = 0; i < count; i++) {
+                index[i] = keys[i];
+                leafMask |= uint16_t(isLeaf(child[i])) << i;
+            }
+            memcpy(index + count, &leafMask, sizeof(leafMask));
+            slot = index + count + sizeof(leafMask);
+        } else {
+            uint64_t present[4] = {0}, leafBits[4] = {0};
+            for (unsigned i = 0; i < count; i++) {
+                present[keys[i] >> 6] |= 1ull << (keys[i] & 63);
+                if (isLeaf(child[i]))
+                    leafBits[keys[i] >> 6] |= 1ull << (keys[i] & 63);
+            }
+            unsigned rank = 0;
+            for (unsigned w = 0; w < 4; w++) {
+                uint8_t* group = index + w * frozenGroupBytes;
+                memcpy(group, &present[w], sizeof(present[w]));
+                memcpy(group + 8, &leafBits[w], sizeof(leafBits[w]));
+                group[16] = rank;
+                rank += popcount64(present[w]);
+            }
+            slot = index + frozenBitmapBytes;
+        }
+
+        unsigned childDepth = p.depth + prefixLength + 1;
+        for (unsigned i = 0; i < count; i++) {
+            if (!isLeaf(child[i])) {
+                uint32_t offset = storage.size();
+                memcpy(slot, &offset, sizeof(offset));
+                queue.push_back({child[i], childDepth, storage.size()});
+                storage.resize(storage.size() + frozenBytes(child[i]));
+            } else if constexpr (storedLeaves) {
+                // Copy the record into the leaf region
+                const Leaf* record = Base::leafRecord(child[i]);
+                size_t at = (records.size() + alignof(Leaf) - 1) &
+                            ~(alignof(Leaf) - 1);
+                records.resize(at + Leaf::size(record->keyLength));
+                memcpy(&records[at], record, Leaf::size(record->keyLength));
+                uint32_t offset = at;
+                memcpy(slot, &offset, sizeof(offset));
+            } else {
+                Value v = Base::value(child[i]);
+                memcpy(slot, &v, sizeof(v));
+            }
+            leafCount += isLeaf(child[i]);
+            slot += slotBytes;
+        }
+        memcpy(&storage[p.offset], node.data(), node.size());
+    }
+
+    std::vector<uint8_t> storage;  // image built by freeze
+    MappedFile file;               // image mapped by open
+    const uint8_t* base;
+    uint32_t root;
+    size_t leafRegion;
+    size_t bytes;
+    size_t leaves;
+    size_t leafCount;  // leaves written so far by freeze
+};
+
+}  // namespace ART
@@ -0,0 +1,120 @@
+/*
+  Latency histogram with bounded relative error, for per-operation
+  percentiles in the drivers
+ */
+
+#pragma once
+
+#include <stdint.h>  // integer types
+#include <stdio.h>
+#include <string.h>  // memset
+
+namespace ART {
+
+// Log-linear buckets in the manner of HdrHistogram: values below
+// subBuckets are counted exactly, above that every power of two is split
+// into subBuckets linear buckets, so a reported percentile is within
+// 1/subBuckets (about 3%) of the recorded value. All of uint64_t fits in
+// a fixed array, recording is a few instructions and histograms of
+// several threads merge by adding counts.
+class Histogram {
+   public:
+    static const unsigned subBucketBits = 5;
+    static const unsigned subBuckets = 1 << subBucketBits;
+    static const unsigned bucketCount = (64 - subBucketBits + 1) * subBuckets;
+
+    Histogram() { reset(); }
+
+    void reset() {
+        memset(counts, 0, sizeof(counts));
+        total = 0;
+        sum = 0;
+        minimum = UINT64_MAX;
+        maximum = 0;
+    }
+
+    void record(uint64_t value) {
+        counts[bucket(value)]++;
+        total++;
+        sum += value;
+        if (value < minimum) minimum = value;
+        if (value > maximum) maximum = value;
+    }
+
+    void merge(const Histogram& other) {
+        // Add the values recorded by another histogram
+        for (unsigned i = 0; i < bucketCount; i++) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        if (other.minimum < minimum) minimum = other.minimum;
+        if (other.maximum > maximum) maximum = other.maximum;
+    }
+
+    uint64_t count() const { return total; }
+
+    uint64_t min() const { return total ? minimum : 0; }
+
+    uint64_t max() const { return maximum; }
+
+    double mean() const { return total ? double(sum) / total : 0.0; }
+
+    uint64_t percentile(double p) const {
+        // The smallest value at or above p percent of the recorded ones,
+        // as the upper end of its bucket, capped by the exact maximum
+        if (total == 0) return 0;
+        uint64_t rank = uint64_t(p / 100 * total + 0.5);
+        if (rank == 0) rank = 1;
+        if (rank > total) rank = total;
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < bucketCount; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                uint64_t high = highestEquivalent(i);
+                return high < maximum ? high : maximum;
+            }
+        }
+        return maximum;
+    }
+
+    static void printHeader(FILE* out) {
+        fprintf(out, "op,count,mean,p50,p90,p99,p999,max\n");
+    }
+
+    void print(FILE* out, const char* op) const {
+        // One csv row in the columns of printHeader, values in the
+        // recorded unit
+        fprintf(out, "%s,%llu,%.1f,%llu,%llu,%llu,%llu,%llu\n", op,
+                (unsigned long long)total, mean(),
+                (unsigned long long)percentile(50),
+                (unsigned long long)percentile(90),
+                (unsigned long long)percentile(99),
+                (unsigned long long)percentile(99.9),
+                (unsigned long long)max());
+    }
+
+    static unsigned bucket(uint64_t value) {
+        // Index of the bucket counting value
+        if (value < subBuckets) return unsigned(value);
+        unsigned magnitude = 63 - __builtin_clzll(value);
+        unsigned shift = magnitude - subBucketBits;
+        return (shift + 1) * subBuckets +
+               unsigned((value >> shift) - subBuckets);
+    }
+
+    static uint64_t highestEquivalent(unsigned index) {
+        // The largest value counted by a bucket
+        if (index < subBuckets) return index;
+        unsigned shift = index / subBuckets - 1;
+        uint64_t low = uint64_t(subBuckets + index % subBuckets) << shift;
+        return low + ((uint64_t(1) << shift) - 1);
+    }
+
+   private:
+    uint64_t counts[bucketCount];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t minimum;
+    uint64_t maximum;
+};
+
+}  // namespace ART
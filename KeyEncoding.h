@@ -0,0 +1,164 @@
+/*
+  Binary-comparable key encodings for integers, floating point numbers,
+  strings and tuples of them
+ */
+
+#pragma once
+
+#include <stddef.h>  // size_t
+#include <stdint.h>  // integer types
+#include <string.h>  // memchr, memcpy
+
+#include <algorithm>  // std::min
+#include <limits>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+#include "ART.h"
+
+namespace ART {
+
+// KeyEncoder<T>::encode(value, out, capacity) writes the key bytes of a
+// value and returns their count: comparing the bytes (a proper prefix
+// first) orders them like the values, and no encoding is a proper prefix of
+// another one of the same type, so values of any length go into one tree.
+// Bytes past capacity are not written, a result above capacity means the
+// key did not fit and out holds the first capacity bytes of its encoding.
+// maxLength bounds the count, 0 if the type is unbounded.
+template <typename T, typename Enable = void>
+struct KeyEncoder;
+
+// Integers: big-endian, the sign bit of signed types flipped so negative
+// values sort first
+template <typename T>
+struct KeyEncoder<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               !std::is_same<T, bool>::value>::type> {
+    typedef typename std::make_unsigned<T>::type Unsigned;
+    static const unsigned maxLength = sizeof(T);
+
+    static unsigned encode(T value, uint8_t out[],
+                           size_t capacity = maxLength) {
+        Unsigned bits = static_cast<Unsigned>(value);
+        if (std::is_signed<T>::value)
+            bits ^= Unsigned(1) << (8 * sizeof(T) - 1);
+        if (capacity >= sizeof(T)) {
+            IntegerKeyLoader<Unsigned>::encode(bits, out);
+        } else {
+            uint8_t bytes[sizeof(T)];
+            IntegerKeyLoader<Unsigned>::encode(bits, bytes);
+            memcpy(out, bytes, capacity);
+        }
+        return sizeof(T);
+    }
+};
+
+// IEEE 754 floats and doubles: the bits of positive numbers with the sign
+// bit set, those of negative numbers inverted, so -inf < negative numbers <
+// 0 < positive numbers < inf < NaN. -0 encodes as 0 and every NaN as the
+// same one, as the values compare equal respectively have no order.
+template <typename T>
+struct KeyEncoder<
+    T, typename std::enable_if<std::is_floating_point<T>::value &&
+                               (sizeof(T) == 4 || sizeof(T) == 8)>::type> {
+    typedef typename std::conditional<sizeof(T) == 8, uint64_t,
+                                      uint32_t>::type Bits;
+    static const unsigned maxLength = sizeof(T);
+
+    static unsigned encode(T value, uint8_t out[],
+                           size_t capacity = maxLength) {
+        if (value == 0) value = 0;
+        if (value != value) value = std::numeric_limits<T>::quiet_NaN();
+        Bits bits;
+        memcpy(&bits, &value, sizeof(bits));
+        static const Bits sign = Bits(1) << (8 * sizeof(T) - 1);
+        bits = (bits & sign) ? ~bits : bits | sign;
+        return KeyEncoder<Bits>::encode(bits, out, capacity);
+    }
+};
+
+// Strings: the bytes with every 0 escaped as 0 0xFF, then the terminator
+// 0 0. The terminator sorts before every byte and escape, so a string sorts
+// before its extensions without being a prefix of them. At most 2 * size + 2
+// bytes, size + 2 without embedded zeros.
+template <>
+struct KeyEncoder<std::string_view> {
+    static const unsigned maxLength = 0;
+
+    static unsigned encode(std::string_view value, uint8_t out[],
+                           size_t capacity = SIZE_MAX) {
+        // Copy the runs between zeros, zeros are rare in most keys
+        const char* bytes = value.data();
+        size_t length = value.size(), n = 0;
+        while (true) {
+            const void* zero = memchr(bytes, 0, length);
+            size_t run = zero ? static_cast<const char*>(zero) - bytes
+                              : length;
+            if (n < capacity)
+                memcpy(out + n, bytes, std::min(run, capacity - n));
+            n += run;
+            uint8_t tail = zero ? 0xFF : 0;  // escape or terminator
+            if (n < capacity) out[n] = 0;
+            if (n + 1 < capacity) out[n + 1] = tail;
+            n += 2;
+            if (!zero) return n;
+            bytes += run + 1;
+            length -= run + 1;
+        }
+    }
+};
+
+template <>
+struct KeyEncoder<std::string> : KeyEncoder<std::string_view> {};
+
+// Tuples: the encodings of the members in order. Every member encoding is
+// prefix-free, so tuples compare member by member, like std::tuple.
+template <typename... T>
+struct KeyEncoder<std::tuple<T...>> {
+    static const unsigned maxLength =
+        (KeyEncoder<T>::maxLength && ...) ? (KeyEncoder<T>::maxLength + ...)
+                                          : 0;
+
+    static unsigned encode(const std::tuple<T...>& value, uint8_t out[],
+                           size_t capacity = SIZE_MAX) {
+        return std::apply(
+            [&](const T&... member) {
+                size_t n = 0;
+                ((n += KeyEncoder<T>::encode(member, out + n,
+                                             capacity > n ? capacity - n : 0)),
+                 ...);
+                return unsigned(n);
+            },
+            value);
+    }
+};
+
+// Key loader for keys with a KeyEncoder. keyLength bounds the encoded
+// length, it must be given for keys containing strings (e.g. 2 * size + 2
+// for strings with zeros). With pseudo-leaves an integer key is its own
+// tuple identifier, as with IntegerKeyLoader; 64-bit keys have to fit into
+// the 63 bits of a pseudo-leaf.
+template <typename Key, unsigned KeyLength = KeyEncoder<Key>::maxLength>
+struct EncodedKeyLoader {
+    static_assert(KeyLength > 0,
+                  "variable-length keys need a bound on their length");
+
+    static const unsigned keyLength = KeyLength;
+
+    unsigned encode(const Key& key, uint8_t out[]) const {
+        // Store the key bytes, return their length; a length above
+        // keyLength means the key did not fit and only its first keyLength
+        // bytes were stored. Point operations reject such keys, ordered ones
+        // sort them after those bytes.
+        return KeyEncoder<Key>::encode(key, out, keyLength);
+    }
+
+    static void load(uintptr_t tid, uint8_t key[]) {
+        // Store the key of the tuple into the key vector
+        KeyEncoder<Key>::encode(static_cast<Key>(tid), key, keyLength);
+    }
+};
+
+}  // namespace ART
@@ -0,0 +1,131 @@
+/*
+  Read-only file mappings: whole files for snapshots, and key files for the
+  drivers that are paged in while they are consumed
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>  // integer types
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ART {
+
+// A read-only mapping of a whole file
+class MappedFile {
+   public:
+    MappedFile() : data(NULL), bytes(0) {}
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const char* path, int advice = MADV_NORMAL) {
+        // Map the file, advice is passed to madvise
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        madvise(p, st.st_size, advice);
+        data = static_cast<const uint8_t*>(p);
+        bytes = st.st_size;
+        return true;
+    }
+
+    void willNeed(size_t offset, size_t length) const {
+        // Start reading a byte range ahead of its use
+        if (offset >= bytes) return;
+        size_t pageBytes = sysconf(_SC_PAGESIZE);
+        size_t begin = offset & ~(pageBytes - 1);
+        size_t end = offset + length < bytes ? offset + length : bytes;
+        madvise(const_cast<uint8_t*>(data) + begin, end - begin,
+                MADV_WILLNEED);
+    }
+
+    void close() {
+        if (data) munmap(const_cast<uint8_t*>(data), bytes);
+        data = NULL;
+        bytes = 0;
+    }
+
+    const uint8_t* data;
+    size_t bytes;
+};
+
+// Layouts of key files, see KeyFile
+enum KeyFileFormat {
+    KeyFileDetect,  // SOSD if the leading word matches the key count
+    KeyFileSOSD,    // uint64 key count, then the keys
+    KeyFileRaw      // only keys
+};
+
+// An array of fixed-size keys served from a mapping of its file, read
+// sequentially: the kernel reads ahead of the consumer instead of the whole
+// file being copied to the heap first, and the pages stay reclaimable page
+// cache. Consumers going through the keys in order call willNeed for the
+// next chunk to overlap its reads with their work.
+template <typename Key>
+class KeyFile {
+   public:
+    KeyFile() : keys(NULL), count(0) {}
+
+    bool open(const char* path, KeyFileFormat format = KeyFileDetect) {
+        // Map a key file, return false if it is unreadable or its size does
+        // not fit the format
+        keys = NULL;
+        count = 0;
+        if (!file.open(path, MADV_SEQUENTIAL)) return false;
+        if (file.bytes % sizeof(Key)) {
+            file.close();
+            return false;
+        }
+        size_t offset = 0;
+        if (format != KeyFileRaw && file.bytes >= sizeof(uint64_t)) {
+            uint64_t header;
+            memcpy(&header, file.data, sizeof(header));
+            if (header == (file.bytes - sizeof(uint64_t)) / sizeof(Key) &&
+                sizeof(uint64_t) % sizeof(Key) == 0)
+                offset = sizeof(uint64_t);
+        }
+        if (format == KeyFileSOSD && !offset) {
+            file.close();
+            return false;
+        }
+        keys = reinterpret_cast<const Key*>(file.data + offset);
+        count = (file.bytes - offset) / sizeof(Key);
+        return true;
+    }
+
+    void willNeed(size_t from, size_t n) const {
+        // Start reading keys [from, from+n)
+        if (from >= count) return;
+        file.willNeed(reinterpret_cast<const uint8_t*>(keys + from) -
+                          file.data,
+                      n * sizeof(Key));
+    }
+
+    bool hasHeader() const {
+        return reinterpret_cast<const uint8_t*>(keys) != file.data;
+    }
+
+    const Key& operator[](size_t i) const { return keys[i]; }
+    const Key* data() const { return keys; }
+    size_t size() const { return count; }
+
+   private:
+    MappedFile file;
+    const Key* keys;
+    size_t count;
+};
+
+}  // namespace ART
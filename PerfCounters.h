@@ -0,0 +1,173 @@
+/*
+  Hardware performance counters around benchmark phases, via
+  perf_event_open; compiled in only with ART_PERF_COUNTERS
+ */
+
+#pragma once
+
+#include <stdint.h>  // integer types
+#include <stdio.h>
+
+#if defined(ART_PERF_COUNTERS) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <string.h>
+#endif
+
+namespace ART {
+
+// The counted events, in the order they are printed
+enum PerfEvent {
+    PerfCycles,
+    PerfInstructions,
+    PerfL1DMisses,      // L1 data cache read misses
+    PerfLLCMisses,      // last level cache misses
+    PerfDTLBMisses,     // data TLB read misses
+    PerfBranchMisses,   // mispredicted branches
+    perfEventCount
+};
+
+static const char* const perfEventNames[perfEventCount] = {
+    "cycles",     "instructions", "L1d-misses",
+    "LLC-misses", "dTLB-misses",  "branch-misses"};
+
+#if defined(ART_PERF_COUNTERS) && defined(__linux__)
+
+// User-space counts of the events for one thread, between start and stop.
+// Every event is a counter of its own, so one the machine lacks (e.g. in a
+// virtual machine) is reported as unavailable and the others still count;
+// counts are scaled up when the kernel multiplexed a counter.
+class PerfCounters {
+   public:
+    static const bool enabled = true;
+
+    PerfCounters() {
+        for (unsigned e = 0; e < perfEventCount; e++) {
+            fds[e] = openEvent(PerfEvent(e));
+            counts[e] = 0;
+        }
+    }
+
+    ~PerfCounters() {
+        for (int fd : fds)
+            if (fd >= 0) close(fd);
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    void start() {
+        // Reset and enable all counters
+        for (int fd : fds)
+            if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        for (int fd : fds)
+            if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    void stop() {
+        // Disable all counters and read them
+        for (int fd : fds)
+            if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        for (unsigned e = 0; e < perfEventCount; e++) {
+            counts[e] = 0;
+            uint64_t value[3];  // count, time enabled, time running
+            if (fds[e] < 0 || read(fds[e], value, sizeof(value)) !=
+                                      ssize_t(sizeof(value)))
+                continue;
+            counts[e] = value[2] == 0 ? 0
+                        : value[2] < value[1]
+                            ? uint64_t(double(value[0]) * value[1] / value[2])
+                            : value[0];
+        }
+    }
+
+    bool available(PerfEvent e) const { return fds[e] >= 0; }
+
+    // The count of the last start/stop interval
+    uint64_t count(PerfEvent e) const { return counts[e]; }
+
+    void print(FILE* out, const char* phase, uint64_t ops) const {
+        // One line of events per operation, unavailable events as "n/a"
+        fprintf(out, "%s counters per op:", phase);
+        for (unsigned e = 0; e < perfEventCount; e++) {
+            if (available(PerfEvent(e)))
+                fprintf(out, " %s %.2f", perfEventNames[e],
+                        ops ? double(counts[e]) / ops : 0.0);
+            else
+                fprintf(out, " %s n/a", perfEventNames[e]);
+        }
+        if (available(PerfCycles) && available(PerfInstructions) &&
+            counts[PerfCycles])
+            fprintf(out, " IPC %.2f",
+                    double(counts[PerfInstructions]) / counts[PerfCycles]);
+        fprintf(out, "\n");
+    }
+
+   private:
+    static int openEvent(PerfEvent e) {
+        // A disabled, user-space only counter of the calling thread
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        static const uint64_t readMiss =
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        switch (e) {
+            case PerfCycles:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case PerfInstructions:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case PerfL1DMisses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_L1D | readMiss;
+                break;
+            case PerfLLCMisses:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CACHE_MISSES;
+                break;
+            case PerfDTLBMisses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_DTLB | readMiss;
+                break;
+            default:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+        }
+        return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    int fds[perfEventCount];
+    uint64_t counts[perfEventCount];
+};
+
+#else
+
+// Counters are compiled out: every call is empty, so instrumented phases
+// cost nothing in production builds
+class PerfCounters {
+   public:
+    static const bool enabled = false;
+
+    void start() {}
+    void stop() {}
+    bool available(PerfEvent) const { return false; }
+    uint64_t count(PerfEvent) const { return 0; }
+    void print(FILE*, const char*, uint64_t) const {}
+};
+
+#endif
+
+}  // namespace ART
@@ -0,0 +1,102 @@
+/*
+  Freeing whole trees on a background thread
+ */
+
+#pragma once
+
+#include <stddef.h>  // size_t
+
+#include <condition_variable>
+#include <deque>
+#include <memory>  // std::unique_ptr
+#include <mutex>
+#include <thread>
+#include <utility>  // std::move
+
+namespace ART {
+
+// One worker thread that destroys retired objects in the order they were
+// retired. retire() moves a tree into the queue, which for a Tree is O(1)
+// and leaves the caller with an empty tree, so a request thread dropping a
+// large tree does not wait for its memory to be returned (munmap of arena
+// regions, free of slab chunks). The destructor frees what is left.
+class BackgroundReclaimer {
+   public:
+    BackgroundReclaimer()
+        : pending(0), stopping(false), worker([this] { serve(); }) {}
+
+    ~BackgroundReclaimer() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    BackgroundReclaimer(const BackgroundReclaimer&) = delete;
+    BackgroundReclaimer& operator=(const BackgroundReclaimer&) = delete;
+
+    template <typename T>
+    void retire(T object) {
+        // Take over an object (e.g. a Tree or ShardedTree moved in) and
+        // destroy it on the worker
+        std::unique_ptr<Retired> r(new RetiredObject<T>(std::move(object)));
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            queue.push_back(std::move(r));
+            pending++;
+        }
+        wake.notify_all();
+    }
+
+    void drain() {
+        // Wait until every object retired so far is destroyed
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return pending == 0; });
+    }
+
+    // Objects retired but not destroyed yet
+    size_t backlog() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        return pending;
+    }
+
+   private:
+    struct Retired {
+        virtual ~Retired() {}
+    };
+
+    template <typename T>
+    struct RetiredObject : Retired {
+        explicit RetiredObject(T&& object) : object(std::move(object)) {}
+        T object;
+    };
+
+    void serve() {
+        // Destroy queued objects outside the lock until stopped and empty
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            std::unique_ptr<Retired> r = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            r.reset();
+            lock.lock();
+            pending--;
+            done.notify_all();
+        }
+    }
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::deque<std::unique_ptr<Retired>> queue;
+    size_t pending;
+    bool stopping;
+    // Declared last, it starts once the members above are initialized
+    std::thread worker;
+};
+
+}  // namespace ART
@@ -0,0 +1,277 @@
+/*
+  Adaptive radix tree partitioned by the leading key byte, for parallel
+  ingest
+ */
+
+#pragma once
+
+#include <functional>  // std::ref
+#include <memory>      // std::unique_ptr
+#include <vector>
+
+#include "ART.h"
+#include "ThreadPool.h"
+
+namespace ART {
+
+// Independent trees (shards) for ranges of the leading key byte: the top
+// shardBits bits of the first byte select the shard, so shard i holds keys
+// that sort before those of shard i + 1 and a scan visits the shards in
+// order. Every shard owns its allocator, so shards are built in parallel
+// without synchronization (insertBatch). Keys that share their top bits,
+// e.g. small integers, all land in one shard. Single-key operations are as
+// thread-safe as Tree is; insertBatch must not overlap other operations.
+template <typename Key, typename Value = uintptr_t,
+          typename KeyLoader = IntegerKeyLoader<Key>,
+          typename Leaves = PseudoLeaves, typename Prefixes = InlinePrefixes>
+class ShardedTree {
+   public:
+    typedef Tree<Key, Value, KeyLoader, Leaves, Prefixes> Shard;
+    static const unsigned maxKeyLength = Shard::maxKeyLength;
+    static const unsigned maxShardBits = 8;
+    // Keys ahead of the insert position whose bytes are prefetched
+    static const size_t prefetchDistance = 8;
+
+    explicit ShardedTree(unsigned shardBits = maxShardBits,
+                         KeyLoader loader = KeyLoader(),
+                         const MemoryOptions& memory = MemoryOptions())
+        : shardBits(shardBits), loader(loader) {
+        assert(shardBits <= maxShardBits);
+        for (unsigned i = 0; i < shardCount(); i++)
+            shards.emplace_back(new Shard(loader, memory));
+    }
+
+    ShardedTree(unsigned shardBits, const MemoryOptions& memory)
+        : ShardedTree(shardBits, KeyLoader(), memory) {}
+
+    ShardedTree(const ShardedTree&) = delete;
+    ShardedTree& operator=(const ShardedTree&) = delete;
+
+    // Moves take the shards along, the tree moved from can only be
+    // assigned to or destroyed
+    ShardedTree(ShardedTree&&) = default;
+    ShardedTree& operator=(ShardedTree&&) = default;
+
+    unsigned shardCount() const { return 1u << shardBits; }
+
+    unsigned shardOf(const uint8_t key[]) const {
+        // The shard holding a key, from the top bits of its first byte
+        return key[0] >> (maxShardBits - shardBits);
+    }
+
+    Shard& shard(unsigned i) { return *shards[i]; }
+    const Shard& shard(unsigned i) const { return *shards[i]; }
+
+    static Value value(ArtNode* leaf) { return Shard::value(leaf); }
+
+    ArtNode* lookup(const uint8_t key[],
+                    unsigned keyLength = maxKeyLength) const {
+        return shards[shardOf(key)]->lookup(key, keyLength);
+    }
+
+    ArtNode* lookup(const Key& key) const {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return lookup(k, keyLength);
+    }
+
+    bool insert(const uint8_t key[], unsigned keyLength, Value value) {
+        return shards[shardOf(key)]->insert(key, keyLength, value);
+    }
+
+    bool insert(const Key& key, Value value) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return insert(k, keyLength, value);
+    }
+
+    bool insertIfAbsent(const uint8_t key[], unsigned keyLength, Value value,
+                        Value& existing) {
+        return shards[shardOf(key)]->insertIfAbsent(key, keyLength, value,
+                                                    existing);
+    }
+
+    bool insertIfAbsent(const Key& key, Value value, Value& existing) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return insertIfAbsent(k, keyLength, value, existing);
+    }
+
+    bool upsert(const uint8_t key[], unsigned keyLength, Value value) {
+        return shards[shardOf(key)]->upsert(key, keyLength, value);
+    }
+
+    bool upsert(const uint8_t key[], unsigned keyLength, Value value,
+                Value& previous) {
+        return shards[shardOf(key)]->upsert(key, keyLength, value, previous);
+    }
+
+    bool upsert(const Key& key, Value value) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return upsert(k, keyLength, value);
+    }
+
+    bool compareExchange(const uint8_t key[], unsigned keyLength,
+                         Value& expected, Value desired) {
+        return shards[shardOf(key)]->compareExchange(key, keyLength, expected,
+                                                     desired);
+    }
+
+    bool compareExchange(const Key& key, Value& expected, Value desired) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return compareExchange(k, keyLength, expected, desired);
+    }
+
+    bool erase(const uint8_t key[], unsigned keyLength = maxKeyLength) {
+        return shards[shardOf(key)]->erase(key, keyLength);
+    }
+
+    bool erase(const Key& key) {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return erase(k, keyLength);
+    }
+
+    size_t insertBatch(const uint8_t* const keys[], const unsigned keyLengths[],
+                       const Value values[], size_t n, ThreadPool& pool) {
+        // Insert n keys, return the number that were not present yet; the
+        // result is the same as inserting them one by one in order.
+        // keyLengths may be NULL for full-length keys. The keys are
+        // radix-partitioned by shard (a histogram and a stable scatter per
+        // block of the input), then every shard inserts its keys on the
+        // pool, one task per shard.
+        unsigned blocks = pool.size();
+        size_t blockSize = (n + blocks - 1) / blocks;
+        std::vector<size_t> offsets(size_t(blocks) * shardCount(), 0);
+        pool.run(blocks, [&](size_t b, unsigned) {
+            size_t* count = &offsets[b * shardCount()];
+            for (size_t i = b * blockSize; i < std::min(n, (b + 1) * blockSize);
+                 i++)
+                count[shardOf(keys[i])]++;
+        });
+
+        // Shard-major prefix sums: offsets[b * shards + s] becomes where
+        // block b writes its keys of shard s
+        std::vector<size_t> shardEnd(shardCount());
+        size_t sum = 0;
+        for (unsigned s = 0; s < shardCount(); s++) {
+            for (unsigned b = 0; b < blocks; b++) {
+                size_t count = offsets[b * shardCount() + s];
+                offsets[b * shardCount() + s] = sum;
+                sum += count;
+            }
+            shardEnd[s] = sum;
+        }
+        std::vector<size_t> order(n);
+        pool.run(blocks, [&](size_t b, unsigned) {
+            size_t* next = &offsets[b * shardCount()];
+            for (size_t i = b * blockSize; i < std::min(n, (b + 1) * blockSize);
+                 i++)
+                order[next[shardOf(keys[i])]++] = i;
+        });
+
+        std::vector<size_t> inserted(shardCount(), 0);
+        pool.run(shardCount(), [&](size_t s, unsigned) {
+            Shard& tree = *shards[s];
+            for (size_t j = s ? shardEnd[s - 1] : 0; j < shardEnd[s]; j++) {
+                // The keys of a shard are scattered over the input
+                if (j + prefetchDistance < shardEnd[s])
+                    __builtin_prefetch(keys[order[j + prefetchDistance]]);
+                size_t i = order[j];
+                inserted[s] += tree.insert(
+                    keys[i], keyLengths ? keyLengths[i] : maxKeyLength,
+                    values[i]);
+            }
+        });
+        size_t total = 0;
+        for (size_t count : inserted) total += count;
+        return total;
+    }
+
+    size_t insertBatch(const Key keys[], const Value values[], size_t n,
+                       ThreadPool& pool) {
+        // Encode the keys on the pool, then insert the bytes
+        std::vector<uint8_t> buffer(n * maxKeyLength);
+        std::vector<const uint8_t*> k(n);
+        std::vector<unsigned> keyLengths(n);
+        size_t blockSize = (n + pool.size() - 1) / pool.size();
+        pool.run(pool.size(), [&](size_t b, unsigned) {
+            for (size_t i = b * blockSize; i < std::min(n, (b + 1) * blockSize);
+                 i++) {
+                k[i] = &buffer[i * maxKeyLength];
+                keyLengths[i] =
+                    loader.encode(keys[i], &buffer[i * maxKeyLength]);
+            }
+        });
+        return insertBatch(k.data(), keyLengths.data(), values, n, pool);
+    }
+
+    template <typename Callback>
+    size_t scan(const uint8_t lo[], unsigned loLength, const uint8_t hi[],
+                unsigned hiLength, Callback callback,
+                size_t limit = SIZE_MAX) const {
+        // Call callback(leaf) for the leaves with keys in [lo, hi] in key
+        // order, at most limit of them; the shards between those of lo and
+        // hi are visited in turn
+        size_t n = 0;
+        for (unsigned s = shardOf(lo); s <= shardOf(hi) && n < limit; s++)
+            n += shards[s]->scan(lo, loLength, hi, hiLength,
+                                 std::ref(callback), limit - n);
+        return n;
+    }
+
+    template <typename Callback>
+    size_t scan(const Key& lo, const Key& hi, Callback callback,
+                size_t limit = SIZE_MAX) const {
+        uint8_t l[maxKeyLength], h[maxKeyLength];
+        unsigned loLength = loader.encode(lo, l);
+        unsigned hiLength = loader.encode(hi, h);
+        return scan(l, loLength, h, hiLength, callback, limit);
+    }
+
+    bool empty() const {
+        for (const std::unique_ptr<Shard>& s : shards)
+            if (!s->empty()) return false;
+        return true;
+    }
+
+    void clear() {
+        // Free the nodes of every shard
+        for (std::unique_ptr<Shard>& s : shards) s->clear();
+    }
+
+    void setShrinkPolicy(const ShrinkPolicy& policy) {
+        for (std::unique_ptr<Shard>& s : shards) s->setShrinkPolicy(policy);
+    }
+
+    size_t compact(ThreadPool& pool) {
+        // Compact the shards on the pool, one task per shard, and return
+        // the number of nodes replaced; the tree must not be used meanwhile
+        std::vector<size_t> replaced(shardCount(), 0);
+        pool.run(shardCount(), [&](size_t s, unsigned) {
+            replaced[s] = shards[s]->compact();
+        });
+        size_t total = 0;
+        for (size_t count : replaced) total += count;
+        return total;
+    }
+
+    size_t bytesReserved() const {
+        // Memory held by all shards
+        size_t bytes = 0;
+        for (const std::unique_ptr<Shard>& s : shards)
+            bytes += s->allocator().bytesReserved();
+        return bytes;
+    }
+
+    const KeyLoader& keyLoader() const { return loader; }
+
+   private:
+    unsigned shardBits;
+    KeyLoader loader;
+    std::vector<std::unique_ptr<Shard>> shards;
+};
+
+}  // namespace ART
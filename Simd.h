@@ -0,0 +1,318 @@
+/*
+  Search kernels for the node layouts, selected at compile time
+ */
+
+#pragma once
+
+#include <stdint.h>  // integer types
+#include <string.h>  // memcpy
+
+// Pick the widest instruction set the compiler targets, ART_SIMD_SCALAR
+// forces the portable fallback
+#if defined(ART_SIMD_SCALAR)
+#elif defined(__AVX512BW__)
+#define ART_SIMD_AVX512 1
+#elif defined(__AVX2__)
+#define ART_SIMD_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64)
+#define ART_SIMD_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define ART_SIMD_NEON 1
+#else
+#define ART_SIMD_SCALAR 1
+#endif
+
+#if defined(ART_SIMD_AVX512) || defined(ART_SIMD_AVX2)
+#include <immintrin.h>  // x86 AVX intrinsics
+#elif defined(ART_SIMD_SSE2)
+#include <emmintrin.h>  // x86 SSE intrinsics
+#elif defined(ART_SIMD_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace ART {
+
+struct ArtNode;
+
+inline const char* simdKernels() {
+    // Name of the selected kernels, for reports
+#if defined(ART_SIMD_AVX512)
+    return "avx512";
+#elif defined(ART_SIMD_AVX2)
+    return "avx2";
+#elif defined(ART_SIMD_SSE2)
+    return "sse2";
+#elif defined(ART_SIMD_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+static inline unsigned ctz64(uint64_t x) {
+    // Count trailing zeros, only defined for x>0
+    return __builtin_ctzll(x);
+}
+
+static inline unsigned highestBit64(uint64_t x) {
+    // Index of the highest set bit, only defined for x>0
+    return 63 - __builtin_clzll(x);
+}
+
+static inline unsigned popcount64(uint64_t x) {
+    // Number of set bits; without a popcount instruction the builtin is a
+    // library call, the bit-parallel sum is faster
+#if defined(__POPCNT__) || defined(__aarch64__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (x * 0x0101010101010101ull) >> 56;
+#endif
+}
+
+#if defined(ART_SIMD_NEON)
+static inline uint32_t neonMovemask(uint8x16_t cmp) {
+    // Bit i is set if lane i of a comparison result is set
+    static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                     1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t m = vandq_u8(cmp, vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(m)) | (vaddv_u8(vget_high_u8(m)) << 8);
+}
+#endif
+
+// Key comparison kernels: the number of equal leading bytes of two byte
+// strings, a vector and then a word at a time. Loads stay within the
+// length: a partial last word is loaded overlapping the previous one.
+
+static inline unsigned firstDifferentByte(uint64_t x) {
+    // Position of the first differing byte of two words loaded from memory
+    // whose xor is x, only defined for x>0
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_clzll(x) / 8;
+#else
+    return ctz64(x) / 8;
+#endif
+}
+
+static inline unsigned firstDifferentByte32(uint32_t x) {
+    // The same for half words, only defined for x>0
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_clz(x) / 8;
+#else
+    return __builtin_ctz(x) / 8;
+#endif
+}
+
+static inline uint64_t loadWord(const uint8_t* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline uint32_t loadHalfWord(const uint8_t* p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+inline unsigned mismatch(const uint8_t* a, const uint8_t* b, unsigned length) {
+    // Number of equal leading bytes of a and b, length if all are equal
+    unsigned pos = 0;
+#if defined(ART_SIMD_AVX512) || defined(ART_SIMD_AVX2) || defined(ART_SIMD_SSE2)
+    for (; pos + 16 <= length; pos += 16) {
+        __m128i cmp = _mm_cmpeq_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + pos)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + pos)));
+        uint32_t differ = ~uint32_t(_mm_movemask_epi8(cmp)) & 0xFFFF;
+        if (differ) return pos + __builtin_ctz(differ);
+    }
+#elif defined(ART_SIMD_NEON)
+    for (; pos + 16 <= length; pos += 16) {
+        uint32_t differ =
+            ~neonMovemask(vceqq_u8(vld1q_u8(a + pos), vld1q_u8(b + pos))) &
+            0xFFFF;
+        if (differ) return pos + __builtin_ctz(differ);
+    }
+#endif
+    for (; pos + 8 <= length; pos += 8) {
+        uint64_t x = loadWord(a + pos) ^ loadWord(b + pos);
+        if (x) return pos + firstDifferentByte(x);
+    }
+    if (pos == length) return length;
+    if (length >= 8) {
+        // The bytes before pos are equal, so the first difference in the
+        // overlapping word is at or after pos
+        uint64_t x = loadWord(a + length - 8) ^ loadWord(b + length - 8);
+        return x ? length - 8 + firstDifferentByte(x) : length;
+    }
+    if (length >= 4) {
+        // Two half words, the second one overlapping the first
+        uint32_t x = loadHalfWord(a) ^ loadHalfWord(b);
+        if (x) return firstDifferentByte32(x);
+        x = loadHalfWord(a + length - 4) ^ loadHalfWord(b + length - 4);
+        return x ? length - 4 + firstDifferentByte32(x) : length;
+    }
+    for (; pos < length; pos++)
+        if (a[pos] != b[pos]) return pos;
+    return length;
+}
+
+// Node16 kernels: bit i of the result describes keys[i], the caller masks
+// off the bits at and above the key count. Node16 stores its key bytes
+// sign-flipped, so ordering compares are signed.
+
+inline uint32_t equalMask16(const uint8_t keys[16], uint8_t keyByte) {
+    // Lanes equal to keyByte
+#if defined(ART_SIMD_AVX512) || defined(ART_SIMD_AVX2) || defined(ART_SIMD_SSE2)
+    __m128i cmp = _mm_cmpeq_epi8(
+        _mm_set1_epi8(keyByte),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys)));
+    return _mm_movemask_epi8(cmp);
+#elif defined(ART_SIMD_NEON)
+    return neonMovemask(vceqq_u8(vdupq_n_u8(keyByte), vld1q_u8(keys)));
+#else
+    uint32_t mask = 0;
+    for (unsigned i = 0; i < 16; i++) mask |= uint32_t(keys[i] == keyByte) << i;
+    return mask;
+#endif
+}
+
+inline uint32_t greaterMask16(const uint8_t keys[16], uint8_t keyByte) {
+    // Lanes greater than keyByte, compared as signed bytes
+#if defined(ART_SIMD_AVX512) || defined(ART_SIMD_AVX2) || defined(ART_SIMD_SSE2)
+    __m128i cmp = _mm_cmplt_epi8(
+        _mm_set1_epi8(keyByte),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys)));
+    return _mm_movemask_epi8(cmp);
+#elif defined(ART_SIMD_NEON)
+    int8x16_t k = vld1q_s8(reinterpret_cast<const int8_t*>(keys));
+    return neonMovemask(vcgtq_s8(k, vdupq_n_s8(int8_t(keyByte))));
+#else
+    uint32_t mask = 0;
+    for (unsigned i = 0; i < 16; i++)
+        mask |= uint32_t(int8_t(keys[i]) > int8_t(keyByte)) << i;
+    return mask;
+#endif
+}
+
+// Scans over the 256 slots of Node48::childIndex and Node256::child, one
+// vector of slots per step
+
+#if defined(ART_SIMD_AVX512)
+static const unsigned byteScanWidth = 64;
+#elif defined(ART_SIMD_AVX2)
+static const unsigned byteScanWidth = 32;
+#elif defined(ART_SIMD_SSE2) || defined(ART_SIMD_NEON)
+static const unsigned byteScanWidth = 16;
+#else
+static const unsigned byteScanWidth = 8;
+#endif
+
+static inline uint64_t usedByteMask(const uint8_t* bytes, uint8_t empty) {
+    // Bit i is set if bytes[i] is not the empty marker, for byteScanWidth
+    // bytes
+#if defined(ART_SIMD_AVX512)
+    return _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(bytes),
+                                   _mm512_set1_epi8(empty));
+#elif defined(ART_SIMD_AVX2)
+    __m256i cmp = _mm256_cmpeq_epi8(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes)),
+        _mm256_set1_epi8(empty));
+    return ~uint64_t(uint32_t(_mm256_movemask_epi8(cmp))) & 0xFFFFFFFFull;
+#elif defined(ART_SIMD_SSE2)
+    __m128i cmp =
+        _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes)),
+                       _mm_set1_epi8(empty));
+    return ~uint64_t(_mm_movemask_epi8(cmp)) & 0xFFFF;
+#elif defined(ART_SIMD_NEON)
+    uint8x16_t cmp = vceqq_u8(vld1q_u8(bytes), vdupq_n_u8(empty));
+    return ~uint64_t(neonMovemask(cmp)) & 0xFFFF;
+#else
+    uint64_t mask = 0;
+    for (unsigned i = 0; i < 8; i++) mask |= uint64_t(bytes[i] != empty) << i;
+    return mask;
+#endif
+}
+
+inline int findUsedByte(const uint8_t bytes[256], int from, uint8_t empty) {
+    // First index >= from whose byte is not the empty marker, -1 if none
+    if (from >= 256) return -1;
+    unsigned block = from & ~(byteScanWidth - 1);
+    uint64_t mask =
+        usedByteMask(bytes + block, empty) & (~0ull << (from - block));
+    while (!mask) {
+        block += byteScanWidth;
+        if (block >= 256) return -1;
+        mask = usedByteMask(bytes + block, empty);
+    }
+    return block + ctz64(mask);
+}
+
+inline int findUsedByteBackward(const uint8_t bytes[256], int from,
+                                uint8_t empty) {
+    // Last index <= from whose byte is not the empty marker, -1 if none
+    if (from < 0) return -1;
+    unsigned block = from & ~(byteScanWidth - 1);
+    uint64_t mask =
+        usedByteMask(bytes + block, empty) & (~0ull >> (63 - (from - block)));
+    while (!mask) {
+        if (block == 0) return -1;
+        block -= byteScanWidth;
+        mask = usedByteMask(bytes + block, empty);
+    }
+    return block + highestBit64(mask);
+}
+
+#if defined(ART_SIMD_AVX512)
+static const unsigned pointerScanWidth = 8;
+#elif defined(ART_SIMD_AVX2)
+static const unsigned pointerScanWidth = 4;
+#else
+static const unsigned pointerScanWidth = 1;
+#endif
+
+static inline uint64_t usedPointerMask(ArtNode* const* slots) {
+    // Bit i is set if slots[i] is not NULL, for pointerScanWidth slots
+#if defined(ART_SIMD_AVX512)
+    return _mm512_test_epi64_mask(_mm512_loadu_si512(slots),
+                                  _mm512_loadu_si512(slots));
+#elif defined(ART_SIMD_AVX2)
+    __m256i cmp = _mm256_cmpeq_epi64(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(slots)),
+        _mm256_setzero_si256());
+    return ~uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(cmp))) & 0xF;
+#else
+    return slots[0] != 0;
+#endif
+}
+
+inline int findUsedPointer(ArtNode* const slots[256], int from) {
+    // First index >= from with a non-NULL slot, -1 if none
+    if (from >= 256) return -1;
+    unsigned block = from & ~(pointerScanWidth - 1);
+    uint64_t mask = usedPointerMask(slots + block) & (~0ull << (from - block));
+    while (!mask) {
+        block += pointerScanWidth;
+        if (block >= 256) return -1;
+        mask = usedPointerMask(slots + block);
+    }
+    return block + ctz64(mask);
+}
+
+inline int findUsedPointerBackward(ArtNode* const slots[256], int from) {
+    // Last index <= from with a non-NULL slot, -1 if none
+    if (from < 0) return -1;
+    unsigned block = from & ~(pointerScanWidth - 1);
+    uint64_t mask =
+        usedPointerMask(slots + block) & (~0ull >> (63 - (from - block)));
+    while (!mask) {
+        if (block == 0) return -1;
+        block -= pointerScanWidth;
+        mask = usedPointerMask(slots + block);
+    }
+    return block + highestBit64(mask);
+}
+
+}  // namespace ART
@@ -0,0 +1,599 @@
+/*
+  Tree images on disk: child pointers are stored as file offsets, so an image
+  can be rebuilt into a tree in one pass or queried straight from a
+  read-only mapping
+ */
+
+#pragma once
+
+#include "ART.h"
+#include "MappedFile.h"
+
+namespace ART {
+
+// File layout: the header, then the nodes and stored leaf records in
+// post-order (children before their parent), leaf records 8-byte aligned
+// and nodes aligned to nodeAlignment. A child
+// reference holds the file offset of the child, offset 0 being the header
+// stands for no child. Stored leaves keep the leaf tag (offset | 1),
+// pseudo-leaves are written unchanged. Nodes keep their in-memory layout, so
+// an image is only readable by builds with the same node sizes and byte
+// order, which the header records.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t keyLength;     // KeyLoader::keyLength
+    uint32_t storedLeaves;  // 1 for StoredLeaves
+    uint32_t leafBytes;     // sizeof of the leaf record header
+    uint32_t nodeBytes[4];  // sizeof of every node type
+    uint64_t byteOrder;     // snapshotByteOrder as written
+    uint64_t root;          // reference to the root, 0 for an empty tree
+    uint64_t fileBytes;
+    uint64_t leaves;
+};
+
+static const char snapshotMagic[8] = {'A', 'R', 'T', 'S', 'N', 'A', 'P', 0};
+static const uint32_t snapshotFormatVersion = 1;
+static const uint64_t snapshotByteOrder = 0x0102030405060708ull;
+
+// Access to the nodes of a Tree for the snapshot loader
+struct SnapshotAccess {
+    template <typename T>
+    static ArtNode*& root(T& tree) {
+        return tree.root;
+    }
+    template <typename T>
+    static Allocator& allocator(T& tree) {
+        return tree.alloc;
+    }
+};
+
+static inline size_t nodeBytes(const ArtNode* node) {
+    // Size of a node of the node's type
+    switch (node->type) {
+        case NodeType4:
+            return sizeof(Node4);
+        case NodeType16:
+            return sizeof(Node16);
+        case NodeType48:
+            return sizeof(Node48);
+        case NodeType256:
+            return sizeof(Node256);
+    }
+    throw;  // Unreachable
+}
+
+template <typename T>
+SnapshotHeader snapshotHeader() {
+    // Header describing images of trees of type T, before root and counts
+    // are known
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.formatVersion = snapshotFormatVersion;
+    header.keyLength = T::maxKeyLength;
+    header.storedLeaves = T::storedLeaves;
+    header.leafBytes = sizeof(typename T::Leaf);
+    header.nodeBytes[NodeType4] = sizeof(Node4);
+    header.nodeBytes[NodeType16] = sizeof(Node16);
+    header.nodeBytes[NodeType48] = sizeof(Node48);
+    header.nodeBytes[NodeType256] = sizeof(Node256);
+    header.byteOrder = snapshotByteOrder;
+    return header;
+}
+
+template <typename T>
+bool checkSnapshotHeader(const void* image, size_t bytes) {
+    // Check if an image was written for trees of type T by a compatible
+    // build
+    if (bytes < sizeof(SnapshotHeader)) return false;
+    SnapshotHeader header, expected = snapshotHeader<T>();
+    memcpy(&header, image, sizeof(header));
+    return memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0 &&
+           header.formatVersion == expected.formatVersion &&
+           header.keyLength == expected.keyLength &&
+           header.storedLeaves == expected.storedLeaves &&
+           header.leafBytes == expected.leafBytes &&
+           memcmp(header.nodeBytes, expected.nodeBytes,
+                  sizeof(header.nodeBytes)) == 0 &&
+           header.byteOrder == expected.byteOrder &&
+           header.fileBytes == bytes &&
+           (header.root < bytes || (!T::storedLeaves && (header.root & 1)));
+}
+
+// Writes the image of a tree to a file, see saveSnapshot
+template <typename T>
+class SnapshotWriter {
+    static_assert(!T::storedPrefixes,
+                  "images hold inline prefixes only, see InlinePrefixes");
+
+   public:
+    SnapshotWriter(const T& tree, FILE* out)
+        : tree(tree), out(out), offset(0), leaves(0), ok(true) {}
+
+    bool write() {
+        // Write the whole image, return false on I/O errors
+        SnapshotHeader header = snapshotHeader<T>();
+        emit(&header, sizeof(header));
+        ArtNode* root = tree.getRoot();
+        if (root)
+            header.root = isLeaf(root) ? writeLeaf(root) : writeNodes(root);
+        header.fileBytes = offset;
+        header.leaves = leaves;
+        // Rewrite the header with the root and counts
+        ok = ok && fseek(out, 0, SEEK_SET) == 0 &&
+             fwrite(&header, sizeof(header), 1, out) == 1;
+        return ok;
+    }
+
+   private:
+    struct Frame {
+        ArtNode* node;
+        int pos;
+        // Copy of the node whose child slots receive the child references
+        alignas(nodeAlignment) uint8_t copy[sizeof(Node256)];
+    };
+
+    uint64_t emit(const void* data, size_t bytes, size_t alignment = 8) {
+        // Append bytes at the next multiple of alignment and pad them to 8,
+        // return their offset
+        static const uint8_t padding[nodeAlignment > 8 ? nodeAlignment : 8] =
+            {0};
+        size_t skip = (alignment - offset % alignment) % alignment;
+        size_t padded = (bytes + 7) & ~size_t(7);
+        ok = ok && (skip == 0 || fwrite(padding, skip, 1, out) == 1) &&
+             fwrite(data, bytes, 1, out) == 1 &&
+             (padded == bytes ||
+              fwrite(padding, padded - bytes, 1, out) == 1);
+        offset += skip;
+        uint64_t at = offset;
+        offset += padded;
+        return at;
+    }
+
+    uint64_t writeLeaf(ArtNode* leaf) {
+        // Reference to a leaf, writing stored leaf records
+        leaves++;
+        if constexpr (T::storedLeaves) {
+            const typename T::Leaf* record = T::leafRecord(leaf);
+            return emit(record, T::Leaf::size(record->keyLength)) | 1;
+        } else {
+            return reinterpret_cast<uintptr_t>(leaf);
+        }
+    }
+
+    void push(ArtNode* node) {
+        // Start writing an inner node with all child slots cleared, the
+        // version word does not survive a restart
+        stack.emplace_back();
+        Frame& f = stack.back();
+        f.node = node;
+        f.pos = -1;
+        memset(f.copy, 0, sizeof(f.copy));
+        memcpy(f.copy, node, nodeBytes(node));
+        ArtNode* copy = reinterpret_cast<ArtNode*>(f.copy);
+        copy->version = 0;
+        switch (node->type) {
+            case NodeType4: {
+                Node4* n = static_cast<Node4*>(copy);
+                memset(n->key + n->count, 0, 4 - n->count);
+                memset(n->child, 0, sizeof(n->child));
+                break;
+            }
+            case NodeType16: {
+                Node16* n = static_cast<Node16*>(copy);
+                memset(n->key + n->count, 0, 16 - n->count);
+                memset(n->child, 0, sizeof(n->child));
+                break;
+            }
+            case NodeType48:
+                memset(static_cast<Node48*>(copy)->child, 0,
+                       sizeof(Node48::child));
+                break;
+            case NodeType256:
+                memset(static_cast<Node256*>(copy)->child, 0,
+                       sizeof(Node256::child));
+                break;
+        }
+    }
+
+    static void setChild(Frame& f, uint64_t ref) {
+        // Store a child reference in the copy, at the slot of f.pos
+        size_t at = reinterpret_cast<uint8_t*>(childSlot(f.node, f.pos)) -
+                    reinterpret_cast<uint8_t*>(f.node);
+        memcpy(f.copy + at, &ref, sizeof(ref));
+    }
+
+    uint64_t writeNodes(ArtNode* root) {
+        // Post-order walk with an explicit stack, a node is written once
+        // all its children have their offsets; every inner node consumes a
+        // key byte, so the depth is at most maxKeyLength
+        stack.reserve(T::maxKeyLength + 1);
+        push(root);
+        while (true) {
+            Frame& f = stack.back();
+            int pos = nextChild(f.node, f.pos);
+            if (pos >= 0) {
+                f.pos = pos;
+                ArtNode* child = childAt(f.node, pos);
+                if (isLeaf(child))
+                    setChild(f, writeLeaf(child));
+                else
+                    push(child);
+                continue;
+            }
+            uint64_t ref = emit(f.copy, nodeBytes(f.node), nodeAlignment);
+            stack.pop_back();
+            if (stack.empty()) return ref;
+            setChild(stack.back(), ref);
+        }
+    }
+
+    const T& tree;
+    FILE* out;
+    uint64_t offset;
+    uint64_t leaves;
+    bool ok;
+    std::vector<Frame> stack;
+};
+
+template <typename T>
+bool saveSnapshot(const T& tree, const char* path) {
+    // Write an image of the tree to path, return false on I/O errors
+    FILE* out = fopen(path, "wb");
+    if (!out) return false;
+    bool ok = SnapshotWriter<T>(tree, out).write();
+    return fclose(out) == 0 && ok;
+}
+
+template <typename T>
+bool loadSnapshot(const char* path, T& tree) {
+    // Rebuild an image into an empty tree, in one pass over the file;
+    // return false if the file is unreadable, not an image for T or refers
+    // outside itself
+    static_assert(!T::storedPrefixes,
+                  "images hold inline prefixes only, see InlinePrefixes");
+    assert(tree.empty());
+    MappedFile file;
+    if (!file.open(path, MADV_SEQUENTIAL) ||
+        !checkSnapshotHeader<T>(file.data, file.bytes))
+        return false;
+    Allocator& alloc = SnapshotAccess::allocator(tree);
+
+    auto resolve = [&](ArtNode* ref, size_t bytes,
+                       uint64_t end) -> const uint8_t* {
+        // The file bytes of a reference, NULL unless they lie before end;
+        // children precede their parent, so this also rules out cycles
+        uint64_t at = reinterpret_cast<uintptr_t>(ref) & ~uint64_t(1);
+        if (at < sizeof(SnapshotHeader) || at % 8 || at > end ||
+            end - at < bytes)
+            return NULL;
+        return file.data + at;
+    };
+    auto copyLeaf = [&](ArtNode* ref, ArtNode** slot, uint64_t end) {
+        // Copy a stored leaf record into the allocator
+        if constexpr (T::storedLeaves) {
+            typedef typename T::Leaf Leaf;
+            const uint8_t* src = resolve(ref, sizeof(Leaf), end);
+            if (!src) return false;
+            uint32_t keyLength = reinterpret_cast<const Leaf*>(src)->keyLength;
+            if (keyLength > T::maxKeyLength ||
+                !resolve(ref, Leaf::size(keyLength), end))
+                return false;
+            void* leaf = alloc.allocateLeaf(Leaf::size(keyLength));
+            memcpy(leaf, src, Leaf::size(keyLength));
+            *slot = reinterpret_cast<ArtNode*>(
+                reinterpret_cast<uintptr_t>(leaf) | 1);
+        } else {
+            (void)end;
+            *slot = ref;
+        }
+        return true;
+    };
+    auto copyNode = [&](ArtNode* ref, ArtNode** slot,
+                        uint64_t end) -> ArtNode* {
+        // Copy an inner node, its child slots still hold references
+        const uint8_t* src = resolve(ref, sizeof(ArtNode), end);
+        if (!src || reinterpret_cast<uintptr_t>(ref) % nodeAlignment)
+            return NULL;
+        ArtNode* node;
+        switch (reinterpret_cast<const ArtNode*>(src)->type) {
+            case NodeType4:
+                node = alloc.allocate<Node4>();
+                break;
+            case NodeType16:
+                node = alloc.allocate<Node16>();
+                break;
+            case NodeType48:
+                node = alloc.allocate<Node48>();
+                break;
+            case NodeType256:
+                node = alloc.allocate<Node256>();
+                break;
+            default:
+                return NULL;
+        }
+        *slot = node;
+        if (!resolve(ref, nodeBytes(node), end)) return NULL;
+        memcpy(static_cast<void*>(node), src, nodeBytes(node));
+        // Counts and indexes must stay inside the node
+        switch (node->type) {
+            case NodeType4:
+                if (node->count > 4 || node->count == 0) return NULL;
+                break;
+            case NodeType16:
+                if (node->count > 16 || node->count == 0) return NULL;
+                break;
+            case NodeType48:
+                for (uint8_t index : static_cast<Node48*>(node)->childIndex)
+                    if (index > emptyMarker) return NULL;
+                break;
+        }
+        return node;
+    };
+
+    SnapshotHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    ArtNode*& root = SnapshotAccess::root(tree);
+    ArtNode* rootRef = reinterpret_cast<ArtNode*>(header.root);
+    bool ok = true;
+    if (!rootRef) {
+    } else if (isLeaf(rootRef)) {
+        ok = copyLeaf(rootRef, &root, file.bytes);
+    } else if (!copyNode(rootRef, &root, file.bytes)) {
+        ok = false;
+    } else {
+        // Pre-order walk, children replace their references as they are
+        // copied
+        std::vector<std::pair<ArtNode*, uint64_t>> stack;
+        stack.emplace_back(root, header.root);
+        while (ok && !stack.empty()) {
+            ArtNode* node = stack.back().first;
+            uint64_t end = stack.back().second;  // offset of the node
+            stack.pop_back();
+            for (int pos = nextChild(node, -1); ok && pos >= 0;
+                 pos = nextChild(node, pos)) {
+                ArtNode** slot = childSlot(node, pos);
+                ArtNode* ref = *slot;
+                if (isLeaf(ref)) {
+                    ok = copyLeaf(ref, slot, end);
+                } else {
+                    *slot = NULL;
+                    ArtNode* child = copyNode(ref, slot, end);
+                    if (child)
+                        stack.emplace_back(child,
+                                           reinterpret_cast<uintptr_t>(ref));
+                    ok = child != NULL;
+                }
+            }
+        }
+    }
+    if (!ok) {
+        // Drop the partial copy, then release the memory it reserved
+        root = NULL;
+        alloc.release();
+    }
+    return ok;
+}
+
+// Read-only tree served from the mapping of an image, without copying it.
+// The image is trusted once its header checks out; use loadSnapshot for
+// files of unknown origin.
+template <typename Key, typename Value = uintptr_t,
+          typename KeyLoader = IntegerKeyLoader<Key>,
+          typename Leaves = PseudoLeaves>
+class MappedTree : public TreeBase<Key, Value, KeyLoader, Leaves> {
+    typedef TreeBase<Key, Value, KeyLoader, Leaves> Base;
+
+   public:
+    using Base::compareKeys;
+    using Base::leafKey;
+    using Base::leafKeyLength;
+    using Base::maxKeyLength;
+    using Base::storedLeaves;
+    using Base::value;
+    typedef typename Base::Leaf Leaf;
+
+    explicit MappedTree(KeyLoader loader = KeyLoader())
+        : Base(loader), root(NULL), leaves(0) {}
+
+    bool open(const char* path, int advice = MADV_RANDOM) {
+        // Map an image written by saveSnapshot for this tree type, advice
+        // is passed to madvise (MADV_WILLNEED pages it in ahead of queries)
+        root = NULL;
+        leaves = 0;
+        if (!file.open(path, advice)) return false;
+        if (!checkSnapshotHeader<MappedTree>(file.data, file.bytes)) {
+            file.close();
+            return false;
+        }
+        SnapshotHeader header;
+        memcpy(&header, file.data, sizeof(header));
+        root = resolve(reinterpret_cast<ArtNode*>(header.root));
+        leaves = header.leaves;
+        return true;
+    }
+
+    ArtNode* lookup(const uint8_t key[],
+                    unsigned keyLength = maxKeyLength) const {
+        // Find the leaf with a matching key, see Tree::lookup; the result
+        // points into the mapping
+        if (keyLength > maxKeyLength) return NULL;
+        ArtNode* node = root;
+        unsigned depth = 0;
+        bool skippedPrefix = false;
+        while (node != NULL) {
+            if (isLeaf(node)) {
+                if (!storedLeaves && !skippedPrefix && depth == keyLength)
+                    return node;
+                if (leafMatches(node, key, keyLength,
+                                skippedPrefix ? 0 : depth))
+                    return node;
+                return NULL;
+            }
+            if (node->prefixLength) {
+                if (depth + node->prefixLength >= keyLength) return NULL;
+                if (node->prefixLength < maxPrefixLength) {
+                    if (mismatch(key + depth, node->prefix,
+                                 node->prefixLength) != node->prefixLength)
+                        return NULL;
+                } else
+                    skippedPrefix = true;
+                depth += node->prefixLength;
+            }
+            ArtNode** child = findChild(node, key[depth]);
+            node = child ? resolve(*child) : NULL;
+            depth++;
+        }
+        return NULL;
+    }
+
+    ArtNode* lookup(const Key& key) const {
+        uint8_t k[maxKeyLength];
+        unsigned keyLength = loader.encode(key, k);
+        return lookup(k, keyLength);
+    }
+
+    template <typename Callback>
+    size_t scan(const uint8_t lo[], unsigned loLength, const uint8_t hi[],
+                unsigned hiLength, Callback callback,
+                size_t limit = SIZE_MAX) const {
+        // Call callback(leaf) for the leaves with keys in [lo, hi] in key
+        // order, at most limit of them; return the number visited
+        size_t n = 0;
+        uint8_t buffer[maxKeyLength];
+        Cursor c;
+        for (seek(c, lo, loLength); c.current && n < limit; next(c)) {
+            if (compareKeys(leafKey(c.current, buffer),
+                            leafKeyLength(c.current), hi, hiLength) > 0)
+                break;
+            callback(c.current);
+            n++;
+        }
+        return n;
+    }
+
+    template <typename Callback>
+    size_t scan(const Key& lo, const Key& hi, Callback callback,
+                size_t limit = SIZE_MAX) const {
+        uint8_t l[maxKeyLength], h[maxKeyLength];
+        unsigned loLength = loader.encode(lo, l);
+        unsigned hiLength = loader.encode(hi, h);
+        return scan(l, loLength, h, hiLength, callback, limit);
+    }
+
+    bool empty() const { return root == NULL; }
+    size_t size() const { return leaves; }
+    size_t imageBytes() const { return file.bytes; }
+
+   private:
+    using Base::leafMatches;
+    using Base::loader;
+
+    // Forward cursor over the leaves, see Tree::Iterator
+    struct Cursor {
+        struct Frame {
+            ArtNode* node;
+            int pos;
+        };
+        ArtNode* current;
+        unsigned height;
+        Frame stack[maxKeyLength];
+    };
+
+    ArtNode* resolve(ArtNode* ref) const {
+        // Node for a reference read from the image; pseudo-leaves are
+        // values, not offsets
+        if (!ref || (!storedLeaves && isLeaf(ref))) return ref;
+        return reinterpret_cast<ArtNode*>(
+            const_cast<uint8_t*>(file.data) + reinterpret_cast<uintptr_t>(ref));
+    }
+
+    ArtNode* child(ArtNode* node, int pos) const {
+        return resolve(childAt(node, pos));
+    }
+
+    ArtNode* minimum(ArtNode* node) const {
+        // The leaf with the smallest key below node
+        while (!isLeaf(node)) node = child(node, nextChild(node, -1));
+        return node;
+    }
+
+    void push(Cursor& c, ArtNode* node, int pos) const {
+        assert(c.height < maxKeyLength);
+        c.stack[c.height].node = node;
+        c.stack[c.height].pos = pos;
+        c.height++;
+    }
+
+    void descendFirst(Cursor& c, ArtNode* node) const {
+        // Follow the smallest children down to a leaf
+        while (!isLeaf(node)) {
+            int pos = nextChild(node, -1);
+            push(c, node, pos);
+            node = child(node, pos);
+        }
+        c.current = node;
+    }
+
+    void next(Cursor& c) const {
+        // Advance to the next leaf, NULL past the last one
+        while (c.height) {
+            typename Cursor::Frame& f = c.stack[c.height - 1];
+            int pos = nextChild(f.node, f.pos);
+            if (pos >= 0) {
+                f.pos = pos;
+                descendFirst(c, child(f.node, pos));
+                return;
+            }
+            c.height--;
+        }
+        c.current = NULL;
+    }
+
+    void seek(Cursor& c, const uint8_t key[], unsigned keyLength) const {
+        // Position on the first leaf whose key is >= key, see
+        // Tree::Iterator::seek
+        ArtNode* node = root;
+        unsigned depth = 0;
+        c.height = 0;
+        c.current = NULL;
+        if (!node) return;
+        while (!isLeaf(node)) {
+            if (node->prefixLength) {
+                uint8_t buffer[maxKeyLength];
+                const uint8_t* prefix = node->prefix;
+                if (node->prefixLength > maxPrefixLength)
+                    prefix = leafKey(minimum(node), buffer) + depth;
+                unsigned length =
+                    min(depth < keyLength ? keyLength - depth : 0,
+                        node->prefixLength);
+                int cmp = memcmp(key + depth, prefix, length);
+                // A key that ends inside the prefix sorts before it
+                if (cmp < 0 || (cmp == 0 && length < node->prefixLength))
+                    return descendFirst(c, node);
+                if (cmp > 0) return next(c);
+                depth += node->prefixLength;
+            }
+            if (depth >= keyLength) return descendFirst(c, node);
+            int pos = lowerChild(node, key[depth]);
+            if (pos < 0) return next(c);
+            push(c, node, pos);
+            if (keyByteAt(node, pos) != key[depth])
+                return descendFirst(c, child(node, pos));
+            node = child(node, pos);
+            depth++;
+        }
+        c.current = node;
+        uint8_t buffer[maxKeyLength];
+        if (compareKeys(leafKey(node, buffer), leafKeyLength(node), key,
+                        keyLength) < 0)
+            next(c);
+    }
+
+    MappedFile file;
+    ArtNode* root;
+    size_t leaves;
+};
+
+}  // namespace ART
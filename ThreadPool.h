@@ -0,0 +1,138 @@
+/*
+  Work-stealing thread pool for parallel batch operations
+ */
+
+#pragma once
+
+#include <stddef.h>  // size_t
+#include <stdint.h>  // integer types
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>  // std::unique_ptr
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ART {
+
+// Fixed set of worker threads that run one batch of numbered tasks at a
+// time. Every worker starts on its own contiguous share of the tasks and,
+// once that is done, steals from the front of the other queues, so skewed
+// tasks (e.g. one large partition) do not leave threads idle. The calling
+// thread takes part as worker 0.
+class ThreadPool {
+   public:
+    explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency())
+        : generation(0), busy(0), stopping(false) {
+        if (threads == 0) threads = 1;
+        for (unsigned i = 0; i < threads; i++)
+            queues.emplace_back(new Queue());
+        for (unsigned i = 1; i < threads; i++)
+            workers.emplace_back([this, i] { serve(i); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Threads that run tasks, including the caller of run()
+    unsigned size() const { return queues.size(); }
+
+    template <typename F>
+    void run(size_t tasks, F f) {
+        // Call f(task, worker) for every task in [0, tasks) and return once
+        // all calls are done; worker < size() names the calling thread
+        if (tasks == 0) return;
+        if (workers.empty()) {
+            for (size_t task = 0; task < tasks; task++) f(task, 0u);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            job = f;
+            size_t share = (tasks + size() - 1) / size();
+            for (size_t task = 0; task < tasks; task++)
+                queues[task / share]->tasks.push_back(task);
+            busy = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        work(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busy == 0; });
+        job = nullptr;
+    }
+
+   private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    bool next(unsigned worker, size_t& task) {
+        // Take the last task of the own queue, else steal the first task of
+        // another queue
+        {
+            Queue& own = *queues[worker];
+            std::lock_guard<std::mutex> guard(own.mutex);
+            if (!own.tasks.empty()) {
+                task = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (unsigned i = 1; i < size(); i++) {
+            Queue& victim = *queues[(worker + i) % size()];
+            std::lock_guard<std::mutex> guard(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(unsigned worker) {
+        // Run tasks until every queue is empty; no tasks are added during a
+        // batch, so an empty sweep ends it for this worker
+        size_t task;
+        while (next(worker, task)) job(task, worker);
+    }
+
+    void serve(unsigned worker) {
+        // Worker thread: wait for a batch, take part in it, report back
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            lock.unlock();
+            work(worker);
+            lock.lock();
+            if (--busy == 0) done.notify_one();
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::function<void(size_t, unsigned)> job;
+    std::mutex mutex;  // guards job, generation, busy and stopping
+    std::condition_variable wake, done;
+    uint64_t generation;
+    size_t busy;  // workers that have not finished the current batch
+    bool stopping;
+};
+
+}  // namespace ART
@@ -0,0 +1,104 @@
+/*
+  Key sets and access distributions for the benchmark drivers
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>  // integer types
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace ART {
+
+// Zipfian ranks in [0, n) with skew theta, rank 0 being the most popular
+// (Gray et al., "Quickly Generating Billion-Record Synthetic Databases")
+class ZipfianGenerator {
+   public:
+    ZipfianGenerator(uint64_t n, double theta = 0.99) : n(n), theta(theta) {
+        zetaN = zeta(n, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - pow(2.0 / n, 1.0 - theta)) /
+              (1.0 - zeta(2, theta) / zetaN);
+    }
+
+    template <typename Rng>
+    uint64_t next(Rng& rng) {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetaN;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + pow(0.5, theta)) return 1 < n ? 1 : 0;
+        uint64_t rank = uint64_t(n * pow(eta * u - eta + 1.0, alpha));
+        return rank < n ? rank : n - 1;
+    }
+
+   private:
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++) sum += 1.0 / pow(double(i), theta);
+        return sum;
+    }
+
+    uint64_t n;
+    double theta, zetaN, alpha, eta;
+};
+
+inline std::vector<uint64_t> denseKeys(size_t n, uint64_t seed) {
+    // The keys 1..n in random order
+    std::vector<uint64_t> keys(n);
+    for (size_t i = 0; i < n; i++) keys[i] = i + 1;
+    std::mt19937_64 rng(seed);
+    std::shuffle(keys.begin(), keys.end(), rng);
+    return keys;
+}
+
+inline std::vector<uint64_t> sparseKeys(size_t n, uint64_t seed,
+                                        const std::vector<uint64_t>& exclude =
+                                            std::vector<uint64_t>()) {
+    // n distinct random 63-bit keys (pseudo-leaves hold 63 bits), none of
+    // them in exclude
+    std::unordered_set<uint64_t> seen(exclude.begin(), exclude.end());
+    std::vector<uint64_t> keys;
+    keys.reserve(n);
+    std::mt19937_64 rng(seed);
+    while (keys.size() < n) {
+        uint64_t key = rng() >> 1;
+        if (seen.insert(key).second) keys.push_back(key);
+    }
+    return keys;
+}
+
+inline std::vector<std::string> urlKeys(
+    size_t n, uint64_t seed,
+    const std::vector<std::string>& exclude = std::vector<std::string>()) {
+    // n distinct URL-like strings: a few hosts with long shared prefixes and
+    // paths of varying depth
+    static const char* const hosts[] = {
+        "https://www.example.com/", "https://shop.example.com/catalog/",
+        "https://en.wikipedia.org/wiki/", "http://cdn.example.net/static/",
+        "https://api.example.io/v2/users/"};
+    static const char* const words[] = {
+        "index", "item",   "product", "user",  "search", "page",
+        "image", "assets", "2024",    "about", "help",   "view"};
+    std::unordered_set<std::string> seen(exclude.begin(), exclude.end());
+    std::vector<std::string> keys;
+    keys.reserve(n);
+    std::mt19937_64 rng(seed);
+    while (keys.size() < n) {
+        std::string url = hosts[rng() % 5];
+        unsigned segments = 1 + rng() % 3;
+        for (unsigned s = 0; s < segments; s++) {
+            url += words[rng() % 12];
+            url += '/';
+        }
+        url += std::to_string(rng() % 1000000);
+        if (seen.insert(url).second) keys.push_back(url);
+    }
+    return keys;
+}
+
+}  // namespace ART
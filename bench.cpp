@@ -0,0 +1,354 @@
+#include <chrono>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ART.h"
+#include "Frozen.h"
+#include "KeyEncoding.h"
+#include "ShardedTree.h"
+#include "Workload.h"
+
+using namespace std;
+using namespace ART;
+
+// Whole-batch benchmarks: every operation is timed as one loop over all
+// keys, so the clock is read twice per batch instead of twice per operation
+
+// Terminated string keys, the terminator keeps them prefix-free
+typedef EncodedKeyLoader<string, 128> StringKeyLoader;
+
+typedef Tree<uint64_t> IntTree;
+typedef Tree<string, uint64_t, StringKeyLoader, StoredLeaves> StringTree;
+typedef Tree<string, uint64_t, StringKeyLoader, StoredLeaves, StoredPrefixes>
+    StoredPrefixStringTree;
+typedef ShardedTree<uint64_t> ShardedIntTree;
+typedef ShardedTree<string, uint64_t, StringKeyLoader, StoredLeaves>
+    ShardedStringTree;
+
+// The read-only form of a tree type
+template <typename T>
+struct FrozenOf;
+template <typename K, typename V, typename L, typename Lv, typename P>
+struct FrozenOf<Tree<K, V, L, Lv, P>> {
+    typedef FrozenTree<K, V, L, Lv> type;
+};
+
+static volatile uintptr_t sink;  // keeps results of timed loops alive
+static MemoryOptions memory;     // node memory of every tree, -H
+static unsigned threads = thread::hardware_concurrency();  // -t
+
+template <typename F>
+double seconds(F f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    auto stop = chrono::steady_clock::now();
+    return chrono::duration<double>(stop - start).count();
+}
+
+static void report(const char* dist, const char* op, size_t ops,
+                   double secs, double bytesPerKey) {
+    printf("%-8s %-16s %10zu %10.1f %10.2f %10.1f\n", dist, op, ops,
+           secs * 1e9 / ops, ops / secs / 1e6, bytesPerKey);
+}
+
+static uint64_t valueOf(const uint64_t& key, size_t) { return key; }
+static uint64_t valueOf(const string&, size_t i) { return i; }
+
+template <typename T, typename K>
+void run(const char* dist, const vector<K>& keys, const vector<K>& missing,
+         const vector<size_t>& order) {
+    // Run every operation on one key set; lookups of present keys follow
+    // order, missing holds keys that are not in the set
+    size_t n = keys.size();
+    double bytesPerKey;
+    {
+        // Bulk load from sorted keys
+        vector<size_t> sortedIndex(n);
+        iota(sortedIndex.begin(), sortedIndex.end(), 0);
+        sort(sortedIndex.begin(), sortedIndex.end(),
+             [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+        vector<K> sorted(n);
+        vector<uint64_t> values(n);
+        for (size_t i = 0; i < n; i++) {
+            sorted[i] = keys[sortedIndex[i]];
+            values[i] = valueOf(sorted[i], sortedIndex[i]);
+        }
+        T tree(memory);
+        double s =
+            seconds([&] { tree.bulkLoad(sorted.data(), values.data(), n); });
+        report(dist, "bulkLoad", n, s,
+               double(tree.allocator().bytesReserved()) / n);
+
+        // The same sorted keys key by key and as one batch
+        T one(memory);
+        s = seconds([&] {
+            for (size_t i = 0; i < n; i++) one.insert(sorted[i], values[i]);
+        });
+        report(dist, "insert/sorted", n, s,
+               double(one.allocator().bytesReserved()) / n);
+        T batch(memory);
+        s = seconds(
+            [&] { batch.insertBatch(sorted.data(), values.data(), n); });
+        report(dist, "insertBatch/sort", n, s,
+               double(batch.allocator().bytesReserved()) / n);
+    }
+
+    T tree(memory);
+    double s = seconds([&] {
+        for (size_t i = 0; i < n; i++)
+            tree.insert(keys[i], valueOf(keys[i], i));
+    });
+    bytesPerKey = double(tree.allocator().bytesReserved()) / n;
+    report(dist, "insert", n, s, bytesPerKey);
+
+    s = seconds([&] {
+        uintptr_t found = 0;
+        for (size_t i : order) found += tree.lookup(keys[i]) != NULL;
+        sink = found;
+    });
+    report(dist, "lookup hit", order.size(), s, bytesPerKey);
+
+    {
+        vector<K> batch(order.size());
+        vector<ArtNode*> results(order.size());
+        for (size_t i = 0; i < order.size(); i++) batch[i] = keys[order[i]];
+        s = seconds([&] {
+            tree.lookupBatch(batch.data(), batch.size(), results.data());
+        });
+        sink = results.back() != NULL;
+        report(dist, "lookupBatch hit", order.size(), s, bytesPerKey);
+    }
+
+    s = seconds([&] {
+        // Overwrite present keys with their own value, one traversal each
+        uintptr_t inserted = 0;
+        for (size_t i : order)
+            inserted += tree.upsert(keys[i], valueOf(keys[i], i));
+        sink = inserted;
+    });
+    report(dist, "upsert present", order.size(), s, bytesPerKey);
+
+    s = seconds([&] {
+        uintptr_t found = 0;
+        for (const K& key : missing) found += tree.lookup(key) != NULL;
+        sink = found;
+    });
+    report(dist, "lookup miss", missing.size(), s, bytesPerKey);
+
+    {
+        // Misses and hits with a membership filter in front of the tree
+        tree.enableFilter();
+        double filterBytesPerKey =
+            bytesPerKey + double(tree.membershipFilter().bytes()) / n;
+        s = seconds([&] {
+            uintptr_t found = 0;
+            for (const K& key : missing) found += tree.lookup(key) != NULL;
+            sink = found;
+        });
+        report(dist, "lookup miss/filt", missing.size(), s, filterBytesPerKey);
+        s = seconds([&] {
+            uintptr_t found = 0;
+            for (size_t i : order) found += tree.lookup(keys[i]) != NULL;
+            sink = found;
+        });
+        report(dist, "lookup hit/filt", order.size(), s, filterBytesPerKey);
+        tree.disableFilter();
+    }
+
+    {
+        // Lookups starting at a jump table over two key bytes
+        tree.enableJumpTable(2);
+        s = seconds([&] {
+            uintptr_t found = 0;
+            for (size_t i : order) found += tree.lookup(keys[i]) != NULL;
+            sink = found;
+        });
+        report(dist, "lookup hit/jump", order.size(), s, bytesPerKey);
+        tree.enableJumpTable(0);
+    }
+
+    {
+        // The same lookups on the packed read-only form of the tree
+        typename FrozenOf<T>::type frozen;
+        s = seconds([&] { frozen.freeze(tree); });
+        double frozenBytesPerKey = double(frozen.imageBytes()) / n;
+        report(dist, "freeze", n, s, frozenBytesPerKey);
+        s = seconds([&] {
+            uintptr_t found = 0;
+            for (size_t i : order) found += frozen.lookup(keys[i]) != NULL;
+            sink = found;
+        });
+        report(dist, "frozen hit", order.size(), s, frozenBytesPerKey);
+    }
+
+    {
+        // Scans of 100 keys starting at random keys
+        static const size_t scanLength = 100;
+        size_t scans = max<size_t>(n / scanLength, 1);
+        s = seconds([&] {
+            uintptr_t visited = 0;
+            for (size_t i = 0; i < scans; i++) {
+                auto it = tree.lowerBound(keys[order[i]]);
+                for (size_t j = 0; j < scanLength && it.valid(); j++, ++it)
+                    visited += reinterpret_cast<uintptr_t>(it.leaf());
+            }
+            sink = visited;
+        });
+        report(dist, "scan 100", scans, s, bytesPerKey);
+    }
+
+    size_t next = 0;  // missing keys inserted so far
+    {
+        // Lookups of present keys mixed with inserts of missing keys, the
+        // given percentage being reads
+        size_t ops = missing.size();
+        for (unsigned readPercent : {95, 50}) {
+            std::mt19937_64 rng(readPercent);
+            vector<bool> isRead(ops);
+            for (size_t i = 0; i < ops; i++)
+                isRead[i] = rng() % 100 < readPercent;
+            s = seconds([&] {
+                uintptr_t found = 0;
+                for (size_t i = 0; i < ops; i++) {
+                    if (isRead[i]) {
+                        found += tree.lookup(keys[order[i]]) != NULL;
+                    } else if (next < missing.size()) {
+                        tree.insert(missing[next], valueOf(missing[next], n));
+                        next++;
+                    }
+                }
+                sink = found;
+            });
+            report(dist, readPercent == 95 ? "mixed 95/5" : "mixed 50/50",
+                   ops, s, double(tree.allocator().bytesReserved()) /
+                               (n + next));
+        }
+    }
+
+    {
+        // Erase a random half of the keys and insert them again, twice, with
+        // eager and lazy shrinking: nodes around a type boundary shrink and
+        // grow back on every round unless shrinking is deferred
+        size_t half = order.size() / 2;
+        for (bool lazy : {false, true}) {
+            tree.setShrinkPolicy(lazy ? ShrinkPolicy::lazy() : ShrinkPolicy());
+            s = seconds([&] {
+                for (unsigned round = 0; round < 2; round++) {
+                    for (size_t j = 0; j < half; j++)
+                        tree.erase(keys[order[j]]);
+                    for (size_t j = 0; j < half; j++) {
+                        size_t i = order[j];
+                        tree.insert(keys[i], valueOf(keys[i], i));
+                    }
+                }
+            });
+            report(dist, lazy ? "churn lazy" : "churn eager", 4 * half, s,
+                   double(tree.allocator().bytesReserved()) / (n + next));
+        }
+        tree.setShrinkPolicy(ShrinkPolicy());
+        s = seconds([&] { sink = tree.compact(); });
+        report(dist, "compact", n + next, s,
+               double(tree.allocator().bytesReserved()) / (n + next));
+    }
+
+    s = seconds([&] {
+        for (size_t i = 0; i < n; i++) tree.erase(keys[i]);
+    });
+    report(dist, "erase", n, s, bytesPerKey);
+}
+
+template <typename S, typename K>
+void runSharded(const char* dist, const vector<K>& keys) {
+    // Parallel ingest into one tree per leading byte
+    size_t n = keys.size();
+    vector<uint64_t> values(n);
+    for (size_t i = 0; i < n; i++) values[i] = valueOf(keys[i], i);
+    ThreadPool pool(threads);
+    S tree(S::maxShardBits, memory);
+    double s = seconds(
+        [&] { tree.insertBatch(keys.data(), values.data(), n, pool); });
+    report(dist, "insertBatch/shard", n, s, double(tree.bytesReserved()) / n);
+}
+
+static vector<size_t> uniformOrder(size_t n, uint64_t seed) {
+    vector<size_t> order(n);
+    iota(order.begin(), order.end(), 0);
+    std::mt19937_64 rng(seed);
+    shuffle(order.begin(), order.end(), rng);
+    return order;
+}
+
+static vector<size_t> zipfOrder(size_t n, uint64_t seed) {
+    ZipfianGenerator zipf(n);
+    std::mt19937_64 rng(seed);
+    vector<size_t> order(n);
+    for (size_t& i : order) i = zipf.next(rng);
+    return order;
+}
+
+int main(int argc, char** argv) {
+    size_t N = 1000000;   // optional argument
+    string dist = "all";  // optional argument
+    for (int i = 1; i < argc;) {
+        if (string(argv[i]) == "-N" && i + 1 < argc) {
+            N = strtoull(argv[i + 1], NULL, 10);
+            i += 2;
+        } else if (string(argv[i]) == "-H" && i + 1 < argc) {
+            string pages = argv[i + 1];
+            memory.hugePages = pages == "thp"  ? HugePagesTransparent
+                               : pages == "2m" ? HugePages2MB
+                               : pages == "1g" ? HugePages1GB
+                                               : HugePagesNone;
+            i += 2;
+        } else if (string(argv[i]) == "-t" && i + 1 < argc) {
+            threads = atoi(argv[i + 1]);
+            i += 2;
+        } else if (string(argv[i]) == "-d" && i + 1 < argc) {
+            dist = argv[i + 1];
+            i += 2;
+        } else {
+            cerr << "usage: " << argv[0]
+                 << " [-N keys] [-d all|dense|sparse|zipf|url]"
+                 << " [-H none|thp|2m|1g] [-t threads]" << endl;
+            return 1;
+        }
+    }
+
+    printf("# kernels: %s\n", simdKernels());
+    printf("# layout: align %zu, node4 %zu, node16 %zu, node48 %zu, "
+           "node256 %zu bytes\n",
+           nodeAlignment, sizeof(Node4), sizeof(Node16), sizeof(Node48),
+           sizeof(Node256));
+    printf("# threads: %u\n", threads);
+    printf("%-8s %-16s %10s %10s %10s %10s\n", "dist", "op", "ops", "ns/op",
+           "Mops/s", "bytes/key");
+    if (dist == "all" || dist == "dense") {
+        vector<uint64_t> keys = denseKeys(N, 1);
+        vector<uint64_t> missing(N);
+        for (size_t i = 0; i < N; i++) missing[i] = N + 1 + keys[i];
+        run<IntTree>("dense", keys, missing, uniformOrder(N, 2));
+        runSharded<ShardedIntTree>("dense", keys);
+    }
+    if (dist == "all" || dist == "sparse" || dist == "zipf") {
+        vector<uint64_t> keys = sparseKeys(N, 3);
+        vector<uint64_t> missing = sparseKeys(N, 4, keys);
+        if (dist != "zipf") {
+            run<IntTree>("sparse", keys, missing, uniformOrder(N, 5));
+            runSharded<ShardedIntTree>("sparse", keys);
+        }
+        if (dist != "sparse")
+            run<IntTree>("zipf", keys, missing, zipfOrder(N, 6));
+    }
+    if (dist == "all" || dist == "url") {
+        vector<string> keys = urlKeys(N, 7);
+        vector<string> missing = urlKeys(N, 8, keys);
+        run<StringTree>("url", keys, missing, uniformOrder(N, 9));
+        run<StoredPrefixStringTree>("url/sp", keys, missing,
+                                    uniformOrder(N, 9));
+        runSharded<ShardedStringTree>("url", keys);
+    }
+    return 0;
+}
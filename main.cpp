@@ -1,27 +1,34 @@
 
 #include "ART.h"
+#include "Histogram.h"
+#include "MappedFile.h"
+#include "PerfCounters.h"
+#include "Snapshot.h"
 
+#include <algorithm>
 #include <chrono>
-#include <fstream>
 #include <iostream>
 #include <vector>
 
 using namespace std;
+using namespace ART;
 
-template <typename key_type>
-std::vector<key_type> read_bin(const char* filename) {
-    std::ifstream inputFile(filename, std::ios::binary);
-    inputFile.seekg(0, std::ios::end);
-    const std::streampos fileSize = inputFile.tellg();
-    inputFile.seekg(0, std::ios::beg);
-    std::vector<key_type> data(fileSize / sizeof(key_type));
-    inputFile.read(reinterpret_cast<char*>(data.data()), fileSize);
-    return data;
-}
+// Keys are read ahead in chunks of this many while they are inserted
+static const uint64_t readAheadKeys = 1 << 20;
 
 int main(int argc, char** argv) {
     bool verbose = false;  // optional argument
     int N = 5000000;       // optional argument
+    bool bulk = false;     // optional argument, build with bulkLoad
+    int threads = 1;       // optional argument, bulkLoad threads
+    string snapshot_file;  // optional argument, save and reopen an image
+    KeyFileFormat format = KeyFileDetect;  // optional argument, -F sosd|raw
+    MemoryOptions memory;  // optional arguments, -H none|thp|2m|1g and
+                           // -n interleave|<node>
+    int latency_every = 0;  // optional argument, -l: time every n-th op into
+                            // histograms instead of summing all of them
+    int warmup = -1;        // optional argument, -w: leading ops of each
+                            // phase left out of the histograms
     string input_file;     // required argument
     // Parse arguments; make sure to increment i by 2 if you consume an argument
     for (int i = 1; i < argc;) {
@@ -31,50 +38,212 @@ int main(int argc, char** argv) {
         } else if (string(argv[i]) == "-N") {
             N = atoi(argv[i + 1]);
             i += 2;
+        } else if (string(argv[i]) == "-b") {
+            bulk = true;
+            i++;
+        } else if (string(argv[i]) == "-t") {
+            threads = atoi(argv[i + 1]);
+            i += 2;
+        } else if (string(argv[i]) == "-s") {
+            snapshot_file = argv[i + 1];
+            i += 2;
+        } else if (string(argv[i]) == "-H") {
+            string pages = argv[i + 1];
+            memory.hugePages = pages == "thp"  ? HugePagesTransparent
+                               : pages == "2m" ? HugePages2MB
+                               : pages == "1g" ? HugePages1GB
+                                               : HugePagesNone;
+            i += 2;
+        } else if (string(argv[i]) == "-n") {
+            string numa = argv[i + 1];
+            memory.numa = numa == "interleave" ? NumaInterleave : NumaBind;
+            memory.numaNode = atoi(argv[i + 1]);
+            i += 2;
+        } else if (string(argv[i]) == "-F") {
+            format = string(argv[i + 1]) == "sosd" ? KeyFileSOSD : KeyFileRaw;
+            i += 2;
+        } else if (string(argv[i]) == "-l") {
+            latency_every = atoi(argv[i + 1]);
+            i += 2;
+        } else if (string(argv[i]) == "-w") {
+            warmup = atoi(argv[i + 1]);
+            i += 2;
         } else if (string(argv[i]) == "-f") {
             input_file = argv[i + 1];
             i += 2;
         }
     }
 
-    // read data
-    auto keys = read_bin<uint64_t>(input_file.c_str());
+    // map data, it is paged in as the keys are consumed
+    KeyFile<uint64_t> keys;
+    if (!keys.open(input_file.c_str(), format)) {
+        cerr << "cannot read keys from " << input_file << endl;
+        return 1;
+    }
+    if (uint64_t(N) > keys.size()) N = keys.size();
+    // By default the first percent of each phase warms caches and the
+    // allocator before latencies are recorded
+    if (warmup < 0) warmup = N / 100;
+
+    // Latency mode: only every latency_every-th op reads the clock, so the
+    // others run as in a throughput run and the phase totals are not
+    // reported; the histograms count nanoseconds including one clock read
+    Histogram insert_latency, lookup_latency;
 
     // Build tree
 
-    Node* tree = NULL;
+    Tree<uint64_t> tree(memory);
     long long insertion_time = 0;
-    for (uint64_t i = 0; i < N; i++) {
-        uint8_t key[8];
-        loadKey(keys[i], key);
+    // Counters of every phase, built with ART_PERF_COUNTERS; they include
+    // the clock reads of the timed loops
+    PerfCounters counters;
+    counters.start();
+    if (bulk) {
+        // bulkLoad takes sorted, distinct keys
+        vector<uint64_t> sorted(keys.data(), keys.data() + N);
+        sort(sorted.begin(), sorted.end());
+        sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
         auto start = chrono::high_resolution_clock::now();
-        insert(tree, &tree, key, 0, keys[i], 8);
+        tree.bulkLoad(sorted.data(), sorted.data(), sorted.size(), threads);
         auto stop = chrono::high_resolution_clock::now();
-        auto duration =
-            chrono::duration_cast<chrono::nanoseconds>(stop - start);
-        insertion_time += duration.count();
+        insertion_time =
+            chrono::duration_cast<chrono::nanoseconds>(stop - start).count();
+    } else {
+        for (uint64_t i = 0; i < uint64_t(N); i++) {
+            if (i % readAheadKeys == 0)
+                keys.willNeed(i + readAheadKeys, readAheadKeys);
+            uint8_t key[8];
+            IntegerKeyLoader<uint64_t>::encode(keys[i], key);
+            if (latency_every && i % latency_every != 0) {
+                tree.insert(key, keys[i]);
+                continue;
+            }
+            auto start = chrono::high_resolution_clock::now();
+            tree.insert(key, keys[i]);
+            auto stop = chrono::high_resolution_clock::now();
+            auto duration =
+                chrono::duration_cast<chrono::nanoseconds>(stop - start);
+            if (!latency_every)
+                insertion_time += duration.count();
+            else if (i >= uint64_t(warmup))
+                insert_latency.record(duration.count());
+        }
     }
+    counters.stop();
 
     if (verbose) {
-        cout << "Insertion time: " << insertion_time << " ns" << endl;
+        if (!latency_every)
+            cout << "Insertion time: " << insertion_time << " ns" << endl;
+        counters.print(stdout, "Insertion", N);
+        tree.stats().print(stdout);
+        if (const PageArena* arena = tree.allocator().pageArena())
+            cout << "Arena bytes: " << arena->bytesMapped() << " ("
+                 << arena->fallbackCount() << " fallbacks)" << endl;
     }
 
     // Query tree
     long long query_time = 0;
-    for (uint64_t i = 0; i < N; i++) {
+    counters.start();
+    for (uint64_t i = 0; i < uint64_t(N); i++) {
         uint8_t key[8];
-        loadKey(keys[i], key);
+        IntegerKeyLoader<uint64_t>::encode(keys[i], key);
+        if (latency_every && i % latency_every != 0) {
+            ArtNode* leaf = tree.lookup(key);
+            assert(leaf && tree.value(leaf) == keys[i]);
+            (void)leaf;
+            continue;
+        }
         auto start = chrono::high_resolution_clock::now();
-        Node* leaf = lookup(tree, key, 8, 0, 8);
+        ArtNode* leaf = tree.lookup(key);
         auto stop = chrono::high_resolution_clock::now();
         auto duration =
             chrono::duration_cast<chrono::nanoseconds>(stop - start);
-        query_time += duration.count();
-        assert(isLeaf(leaf) && getLeafValue(leaf) == keys[i]);
+        if (!latency_every)
+            query_time += duration.count();
+        else if (i >= uint64_t(warmup))
+            lookup_latency.record(duration.count());
+        assert(leaf && tree.value(leaf) == keys[i]);
     }
+    counters.stop();
 
     if (verbose) {
-        cout << "Query time: " << query_time << " ns" << endl;
+        if (!latency_every)
+            cout << "Query time: " << query_time << " ns" << endl;
+        counters.print(stdout, "Query", N);
+    }
+
+    // Query tree again, interleaving the lookups with lookupBatch
+    vector<uint8_t> encoded(uint64_t(N) * 8);
+    vector<const uint8_t*> batchKeys(N);
+    vector<ArtNode*> results(N);
+    for (uint64_t i = 0; i < uint64_t(N); i++) {
+        IntegerKeyLoader<uint64_t>::encode(keys[i], &encoded[i * 8]);
+        batchKeys[i] = &encoded[i * 8];
+    }
+    counters.start();
+    auto start = chrono::high_resolution_clock::now();
+    tree.lookupBatch(batchKeys.data(), N, results.data());
+    auto stop = chrono::high_resolution_clock::now();
+    counters.stop();
+    long long batch_query_time =
+        chrono::duration_cast<chrono::nanoseconds>(stop - start).count();
+    for (uint64_t i = 0; i < uint64_t(N); i++)
+        assert(results[i] && tree.value(results[i]) == keys[i]);
+
+    if (verbose) {
+        cout << "Batched query time: " << batch_query_time << " ns" << endl;
+        counters.print(stdout, "Batched query", N);
+    }
+
+    if (!snapshot_file.empty()) {
+        // Write an image, then query it through a mapping of the file
+        if (!saveSnapshot(tree, snapshot_file.c_str())) {
+            cerr << "cannot write " << snapshot_file << endl;
+            return 1;
+        }
+        auto start = chrono::high_resolution_clock::now();
+        MappedTree<uint64_t> mapped;
+        bool opened = mapped.open(snapshot_file.c_str());
+        auto stop = chrono::high_resolution_clock::now();
+        if (!opened) {
+            cerr << "cannot map " << snapshot_file << endl;
+            return 1;
+        }
+        long long open_time =
+            chrono::duration_cast<chrono::nanoseconds>(stop - start).count();
+        start = chrono::high_resolution_clock::now();
+        for (uint64_t i = 0; i < uint64_t(N); i++) {
+            ArtNode* leaf = mapped.lookup(&encoded[i * 8]);
+            assert(leaf && mapped.value(leaf) == keys[i]);
+            (void)leaf;
+        }
+        stop = chrono::high_resolution_clock::now();
+        long long mapped_query_time =
+            chrono::duration_cast<chrono::nanoseconds>(stop - start).count();
+        if (verbose) {
+            cout << "Snapshot bytes: " << mapped.imageBytes() << endl;
+            cout << "Snapshot open time: " << open_time << " ns" << endl;
+            cout << "Mapped query time: " << mapped_query_time << " ns"
+                 << endl;
+        }
+    }
+
+    // Free the tree: the allocator returns its chunks without a walk
+    start = chrono::high_resolution_clock::now();
+    tree.clear();
+    stop = chrono::high_resolution_clock::now();
+    if (verbose)
+        cout << "Teardown time: "
+             << chrono::duration_cast<chrono::nanoseconds>(stop - start)
+                    .count()
+             << " ns" << endl;
+
+    if (latency_every) {
+        // One csv row of percentiles per operation instead of the totals
+        Histogram::printHeader(stdout);
+        if (!bulk) insert_latency.print(stdout, "insert");
+        lookup_latency.print(stdout, "lookup");
+        return 0;
     }
 
     // simply output the times in csv format
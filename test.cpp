@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <string.h>  // memset
+
+#include <string>
+#include <vector>
+
+#include "ART.h"
+#include "ARTOLC.h"
+#include "ARTROWEX.h"
+#include "KeyEncoding.h"
+
+using namespace std;
+using namespace ART;
+
+// Checks of edge cases the drivers do not reach. Every failed check is
+// printed, the exit status is the number of failures.
+
+typedef EncodedKeyLoader<string, 32> ShortStringKeyLoader;
+typedef Tree<string, uint64_t, ShortStringKeyLoader, StoredLeaves>
+    ShortStringTree;
+
+static unsigned failures = 0;
+
+#define CHECK(condition)                                          \
+    do {                                                          \
+        if (!(condition)) {                                       \
+            printf("%s:%d: %s failed\n", __FILE__, __LINE__,      \
+                   #condition);                                   \
+            failures++;                                           \
+        }                                                         \
+    } while (0)
+
+static void testOverlongString() {
+    // A string whose encoding does not fit the loader bound is never
+    // present, whatever entry point it is passed to
+    ShortStringTree tree;
+    string fits(20, 'a');
+    string overlong(100, 'a');
+    CHECK(tree.insert(fits, 1));
+    CHECK(!tree.insert(overlong, 2));
+    CHECK(tree.lookup(overlong) == NULL);
+    CHECK(tree.lookup(fits) && ShortStringTree::value(tree.lookup(fits)) == 1);
+    CHECK(!tree.upsert(overlong, 3));
+    uint64_t existing = 0;
+    CHECK(!tree.insertIfAbsent(overlong, 4, existing));
+    uint64_t expected = 1;
+    CHECK(!tree.compareExchange(overlong, expected, 5));
+    CHECK(!tree.erase(overlong));
+    CHECK(tree.stats().leaves == 1);
+    CHECK(ShortStringTree::value(tree.lookup(fits)) == 1);
+
+    string keys[] = {overlong, "b", string(40, 'c')};
+    uint64_t values[] = {6, 7, 8};
+    CHECK(tree.insertBatch(keys, values, 3) == 1);
+    ArtNode* results[3];
+    tree.lookupBatch(keys, 3, results);
+    CHECK(results[0] == NULL && results[2] == NULL);
+    CHECK(results[1] && ShortStringTree::value(results[1]) == 7);
+
+    ShortStringTree loaded;
+    string sorted[] = {"a", overlong, "b", string(40, 'c'), "d"};
+    uint64_t sortedValues[] = {1, 2, 3, 4, 5};
+    loaded.bulkLoad(sorted, sortedValues, 5);
+    CHECK(loaded.stats().leaves == 3);
+    CHECK(loaded.lookup(overlong) == NULL);
+    ArtNode* b = loaded.lookup("b");
+    ArtNode* d = loaded.lookup("d");
+    CHECK(b && ShortStringTree::value(b) == 3);
+    CHECK(d && ShortStringTree::value(d) == 5);
+}
+
+static void testOverlongBytes() {
+    // Byte keys longer than maxKeyLength are rejected by the point
+    // operations; ordered ones place a longer key right after its first
+    // maxKeyLength bytes
+    Tree<uint64_t> tree;
+    uint8_t key[16];
+    for (uint64_t k = 1; k <= 3; k++) {
+        IntegerKeyLoader<uint64_t>::encode(k, key);
+        CHECK(tree.insert(key, k));
+    }
+    IntegerKeyLoader<uint64_t>::encode(2, key);
+    memset(key + 8, 0, 8);
+    CHECK(!tree.insert(key, 16, 2));
+    CHECK(tree.lookup(key, 16) == NULL);
+    CHECK(tree.lookupPessimistic(key, 16) == NULL);
+    CHECK(!tree.erase(key, 16));
+    Tree<uint64_t>::Iterator it = tree.lowerBound(key, 16);
+    CHECK(it.valid() && Tree<uint64_t>::value(it.leaf()) == 3);
+
+    ShortStringTree strings;
+    string overlong(100, 'b');
+    CHECK(strings.insert("b", 1) && strings.insert("c", 2));
+    ShortStringTree::Iterator s = strings.lowerBound(overlong);
+    CHECK(s.valid() && ShortStringTree::value(s.leaf()) == 2);
+    size_t n = strings.scan(string("a"), overlong, [](ArtNode*) {});
+    CHECK(n == 1);
+}
+
+static void testShortBytes() {
+    // A key that ends at an inner node is not found and not erased
+    Tree<uint64_t> tree;
+    uint8_t key[8];
+    for (uint64_t k = 1; k <= 3; k++) {
+        IntegerKeyLoader<uint64_t>::encode(k, key);
+        CHECK(tree.insert(key, k));
+    }
+    CHECK(tree.lookup(key, 4) == NULL);
+    CHECK(tree.lookupPessimistic(key, 4) == NULL);
+    CHECK(tree.lookupPessimistic(key, 7) == NULL);
+    CHECK(!tree.erase(key, 7));
+    CHECK(tree.stats().leaves == 3);
+}
+
+static void testPrefixKeys() {
+    // A key that is a proper prefix of a present one, or has one as its
+    // prefix, is not inserted and does not change the present value
+    ShortStringTree tree;
+    const uint8_t abc[] = {'a', 'b', 'c'};
+    const uint8_t abcd[] = {'a', 'b', 'c', 'd'};
+    const uint8_t abx[] = {'a', 'b', 'x'};
+    CHECK(tree.insert(abc, 3, 1));
+    CHECK(!tree.insert(abcd, 4, 2));
+    CHECK(!tree.upsert(abcd, 4, 3));
+    CHECK(!tree.upsert(abc, 2, 4));
+    ArtNode* leaf = tree.lookup(abc, 3);
+    CHECK(leaf && ShortStringTree::value(leaf) == 1);
+    CHECK(tree.lookup(abcd, 4) == NULL);
+
+    CHECK(tree.insert(abx, 3, 5));
+    CHECK(!tree.insert(abc, 2, 6));
+    CHECK(!tree.upsert(abc, 1, 7));
+    CHECK(!tree.insert(abcd, 4, 8));
+    CHECK(tree.stats().leaves == 2);
+    leaf = tree.lookup(abc, 3);
+    CHECK(leaf && ShortStringTree::value(leaf) == 1);
+    leaf = tree.lookup(abx, 3);
+    CHECK(leaf && ShortStringTree::value(leaf) == 5);
+}
+
+static void testPrefixKeysOlc() {
+    // The same for the concurrent tree: prefix keys are refused at a leaf,
+    // inside a prefix and at an inner node, the present keys stay
+    OLC::Tree<string, uint64_t, ShortStringKeyLoader, StoredLeaves> tree;
+    OLC::Tree<string, uint64_t, ShortStringKeyLoader,
+              StoredLeaves>::ThreadInfo& info = tree.getThreadInfo();
+    const uint8_t ab[] = {'a', 'b'};
+    const uint8_t abc[] = {'a', 'b', 'c'};
+    const uint8_t abcx[] = {'a', 'b', 'c', 'x'};
+    const uint8_t abcy[] = {'a', 'b', 'c', 'y'};
+    CHECK(tree.insert(ab, 2, 1, info));
+    CHECK(!tree.insert(abc, 3, 2, info));
+    CHECK(!tree.insert(ab, 1, 3, info));
+    uint64_t value = 0;
+    CHECK(tree.lookup(ab, 2, value, info) && value == 1);
+    CHECK(!tree.lookup(abc, 3, value, info));
+    CHECK(tree.erase(ab, 2, info));
+
+    CHECK(tree.insert(abcx, 4, 4, info));
+    CHECK(tree.insert(abcy, 4, 5, info));
+    CHECK(!tree.insert(ab, 2, 6, info));
+    CHECK(!tree.insert(ab, 1, 7, info));
+    CHECK(!tree.insert(abcx, 3, 8, info));
+    CHECK(tree.lookup(abcx, 4, value, info) && value == 4);
+    CHECK(tree.lookup(abcy, 4, value, info) && value == 5);
+    CHECK(!tree.lookup(ab, 2, value, info));
+}
+
+static void testPrefixKeysRowex() {
+    // And for the copy-on-write tree, which has a single writer
+    ROWEX::Tree<string, uint64_t, ShortStringKeyLoader, StoredLeaves> tree;
+    ROWEX::Tree<string, uint64_t, ShortStringKeyLoader,
+                StoredLeaves>::ThreadInfo& info = tree.getThreadInfo();
+    const uint8_t ab[] = {'a', 'b'};
+    const uint8_t abc[] = {'a', 'b', 'c'};
+    const uint8_t abcx[] = {'a', 'b', 'c', 'x'};
+    const uint8_t abcy[] = {'a', 'b', 'c', 'y'};
+    CHECK(tree.insert(ab, 2, 1));
+    CHECK(!tree.insert(abc, 3, 2));
+    CHECK(!tree.insert(ab, 1, 3));
+    uint64_t value = 0;
+    CHECK(tree.lookup(ab, 2, value, info) && value == 1);
+    CHECK(!tree.lookup(abc, 3, value, info));
+    CHECK(tree.erase(ab, 2));
+
+    CHECK(tree.insert(abcx, 4, 4));
+    CHECK(tree.insert(abcy, 4, 5));
+    CHECK(!tree.insert(ab, 2, 6));
+    CHECK(!tree.insert(ab, 1, 7));
+    CHECK(!tree.insert(abcx, 3, 8));
+    CHECK(tree.lookup(abcx, 4, value, info) && value == 4);
+    CHECK(tree.lookup(abcy, 4, value, info) && value == 5);
+    CHECK(!tree.lookup(ab, 2, value, info));
+}
+
+static void testIteratorValue() {
+    // An iterator reports the keys in order with their values
+    typedef Tree<uint64_t, uint64_t, IntegerKeyLoader<uint64_t>, StoredLeaves>
+        StoredTree;
+    StoredTree tree;
+    for (uint64_t k = 10; k > 0; k--) CHECK(tree.insert(k, k * 100));
+    uint64_t expected = 1;
+    for (StoredTree::Iterator it = tree.begin(); it.valid(); ++it, expected++)
+        CHECK(it.value() == expected * 100);
+    CHECK(expected == 11);
+}
+
+static void testPseudoLeafValues() {
+    // A pseudo-leaf value has to load its key; upsert and compareExchange
+    // keep the present value instead of storing one that does not
+    Tree<uint64_t> tree;
+    CHECK(tree.insert(5, 5));
+    CHECK(!tree.upsert(5, 6));
+    ArtNode* leaf = tree.lookup(5);
+    CHECK(leaf && Tree<uint64_t>::value(leaf) == 5);
+    uintptr_t expected = 5;
+    CHECK(!tree.compareExchange(5, expected, 7));
+    CHECK(expected == 5);
+    leaf = tree.lookup(5);
+    CHECK(leaf && Tree<uint64_t>::value(leaf) == 5);
+    CHECK(tree.compareExchange(5, expected, 5));
+}
+
+static void testShrinkPolicy() {
+    // Shrink counts outside their range are clamped into it
+    ShrinkPolicy policy(0, 100, 1000);
+    CHECK(policy.node16 == 2 && policy.node48 == 12 && policy.node256 == 37);
+    policy.node16 = 50;
+    Tree<uint64_t> tree;
+    tree.setShrinkPolicy(policy);
+    CHECK(tree.shrinkPolicy().node16 == 3);
+    for (uint64_t k = 1; k <= 300; k++) CHECK(tree.insert(k, k));
+    for (uint64_t k = 1; k <= 300; k++) CHECK(tree.erase(k));
+    CHECK(tree.empty());
+}
+
+int main() {
+    testOverlongString();
+    testOverlongBytes();
+    testShortBytes();
+    testPrefixKeys();
+    testPrefixKeysOlc();
+    testPrefixKeysRowex();
+    testIteratorValue();
+    testPseudoLeafValues();
+    testShrinkPolicy();
+    if (failures) printf("%u checks failed\n", failures);
+    return failures;
+}
@@ -0,0 +1,423 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>  // std::unique_ptr
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "ART.h"
+#include "ARTOLC.h"
+#include "ARTROWEX.h"
+#include "MappedFile.h"
+#include "ShardedTree.h"
+#include "ThreadPool.h"
+#include "Workload.h"
+
+using namespace std;
+using namespace ART;
+
+// Mixed-workload driver in the manner of YCSB: load part of a key file into
+// a concurrent tree variant, then let 1, 2, 4, ... threads run a mix of
+// operations on keys drawn from the loaded ones and report the aggregate
+// throughput of every thread count. The tree is rebuilt for every run, so
+// each thread count starts from the same state.
+
+// Percentages of the operations, they add up to 100
+struct Mix {
+    unsigned read, insert, update, erase, scan;
+
+    Mix(unsigned read = 100, unsigned insert = 0, unsigned update = 0,
+        unsigned erase = 0, unsigned scan = 0)
+        : read(read), insert(insert), update(update), erase(erase),
+          scan(scan) {}
+
+    bool parse(const string& spec) {
+        // A YCSB core workload letter, or read,insert,update,delete,scan
+        if (spec == "a") {
+            *this = Mix(50, 0, 50);
+        } else if (spec == "b") {
+            *this = Mix(95, 0, 5);
+        } else if (spec == "c") {
+            *this = Mix(100);
+        } else if (spec == "d") {
+            *this = Mix(95, 5);
+        } else if (spec == "e") {
+            *this = Mix(0, 5, 0, 0, 95);
+        } else if (sscanf(spec.c_str(), "%u,%u,%u,%u,%u", &read, &insert,
+                          &update, &erase, &scan) != 5) {
+            return false;
+        }
+        return read + insert + update + erase + scan == 100;
+    }
+};
+
+enum Op { OpRead, OpInsert, OpUpdate, OpErase, OpScan };
+
+// Every variant offers load, a per-thread session and the operations on
+// integer keys whose value is the key itself; writes return whether they
+// changed the tree
+
+// Optimistic lock coupling: all threads read and write
+struct OlcVariant {
+    typedef OLC::Tree<uint64_t> Tree;
+    typedef Tree::ThreadInfo Session;
+    static const bool scans = false;
+
+    static const char* name() { return "olc"; }
+
+    void load(const vector<uint64_t>& keys, ThreadPool& pool) {
+        // A new tree holding keys, inserted on the pool
+        tree.reset(new Tree());
+        size_t blockSize = (keys.size() + pool.size() - 1) / pool.size();
+        pool.run(pool.size(), [&](size_t b, unsigned) {
+            Session& s = tree->getThreadInfo();
+            for (size_t i = b * blockSize;
+                 i < min(keys.size(), (b + 1) * blockSize); i++)
+                tree->insert(keys[i], keys[i], s);
+        });
+    }
+
+    Session& session() { return tree->getThreadInfo(); }
+
+    bool read(Session& s, uint64_t key) {
+        uint64_t value;
+        return tree->lookup(key, value, s);
+    }
+
+    bool insert(Session& s, uint64_t key) { return tree->insert(key, key, s); }
+
+    bool update(Session& s, uint64_t key) {
+        // There is no in-place update; readers in between miss the key
+        return tree->erase(key, s) && tree->insert(key, key, s);
+    }
+
+    bool erase(Session& s, uint64_t key) { return tree->erase(key, s); }
+
+    size_t scan(Session&, uint64_t, unsigned) { return 0; }
+
+    unique_ptr<Tree> tree;
+};
+
+// Single writer, lock-free readers: writes are serialized by one mutex
+struct RowexVariant {
+    typedef ROWEX::Tree<uint64_t> Tree;
+    typedef Tree::ThreadInfo Session;
+    static const bool scans = false;
+
+    static const char* name() { return "rowex"; }
+
+    void load(const vector<uint64_t>& keys, ThreadPool&) {
+        tree.reset(new Tree());
+        for (uint64_t key : keys) tree->insert(key, key);
+    }
+
+    Session& session() { return tree->getThreadInfo(); }
+
+    bool read(Session& s, uint64_t key) {
+        uint64_t value;
+        return tree->lookup(key, value, s);
+    }
+
+    bool insert(Session&, uint64_t key) {
+        lock_guard<mutex> guard(writer);
+        return tree->insert(key, key);
+    }
+
+    bool update(Session&, uint64_t key) {
+        lock_guard<mutex> guard(writer);
+        return tree->erase(key) && tree->insert(key, key);
+    }
+
+    bool erase(Session&, uint64_t key) {
+        lock_guard<mutex> guard(writer);
+        return tree->erase(key);
+    }
+
+    size_t scan(Session&, uint64_t, unsigned) { return 0; }
+
+    unique_ptr<Tree> tree;
+    mutex writer;
+};
+
+// Sharded single-threaded trees behind a reader-writer lock per shard.
+// Scans stay within the shard of their first key.
+struct ShardedVariant {
+    typedef ShardedTree<uint64_t> Tree;
+    struct Session {};
+    static const bool scans = true;
+
+    ShardedVariant() : locks(1u << Tree::maxShardBits) {}
+
+    static const char* name() { return "sharded"; }
+
+    void load(const vector<uint64_t>& keys, ThreadPool& pool) {
+        tree.reset(new Tree());
+        tree->insertBatch(keys.data(), keys.data(), keys.size(), pool);
+    }
+
+    Session session() { return Session(); }
+
+    bool read(Session&, uint64_t key) {
+        uint8_t k[8];
+        IntegerKeyLoader<uint64_t>::encode(key, k);
+        shared_lock<shared_mutex> guard(locks[tree->shardOf(k)]);
+        return tree->lookup(k, 8) != NULL;
+    }
+
+    bool insert(Session&, uint64_t key) {
+        uint8_t k[8];
+        IntegerKeyLoader<uint64_t>::encode(key, k);
+        lock_guard<shared_mutex> guard(locks[tree->shardOf(k)]);
+        return tree->insert(k, 8, key);
+    }
+
+    bool update(Session&, uint64_t key) {
+        uint8_t k[8];
+        IntegerKeyLoader<uint64_t>::encode(key, k);
+        lock_guard<shared_mutex> guard(locks[tree->shardOf(k)]);
+        return !tree->upsert(k, 8, key);
+    }
+
+    bool erase(Session&, uint64_t key) {
+        uint8_t k[8];
+        IntegerKeyLoader<uint64_t>::encode(key, k);
+        lock_guard<shared_mutex> guard(locks[tree->shardOf(k)]);
+        return tree->erase(k, 8);
+    }
+
+    size_t scan(Session&, uint64_t key, unsigned length) {
+        // Up to length keys from key on, in its shard
+        static const uint8_t last[8] = {0xff, 0xff, 0xff, 0xff,
+                                        0xff, 0xff, 0xff, 0xff};
+        uint8_t k[8];
+        IntegerKeyLoader<uint64_t>::encode(key, k);
+        unsigned s = tree->shardOf(k);
+        shared_lock<shared_mutex> guard(locks[s]);
+        return tree->shard(s).scan(
+            k, 8, last, 8, [](ArtNode*) {}, length);
+    }
+
+    unique_ptr<Tree> tree;
+    vector<shared_mutex> locks;
+};
+
+// Settings of every run, from the command line
+struct Options {
+    size_t opsPerThread;  // -o
+    unsigned maxThreads;  // -t
+    Mix mix;              // -m
+    bool zipfian;         // -d uniform|zipfian
+    double theta;         // -z
+    unsigned scanLength;  // -s
+    bool pin;             // -P turns pinning off
+
+    Options()
+        : opsPerThread(1000000), maxThreads(thread::hardware_concurrency()),
+          zipfian(false), theta(0.99), scanLength(100), pin(true) {}
+};
+
+static void pinThread(unsigned cpu) {
+    // Keep the calling thread on one core, thread i of a run on core i
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % thread::hardware_concurrency(), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+template <typename Variant>
+double runMix(Variant& tree, const vector<uint64_t>& loaded,
+              const vector<uint64_t>& fresh, unsigned threads,
+              ThreadPool& pool, const Options& o) {
+    // Let threads run opsPerThread operations each against a tree holding
+    // loaded, return the seconds until the last one is done. Inserts take
+    // keys of fresh in turn and become reads once fresh is used up.
+    ZipfianGenerator zipf(o.zipfian ? loaded.size() : 1, o.theta);
+    atomic<size_t> nextFresh(0);
+    atomic<size_t> found(0);  // keeps the results alive
+    auto start = chrono::steady_clock::now();
+    pool.run(threads, [&](size_t t, unsigned) {
+        if (o.pin) pinThread(t);
+        auto&& session = tree.session();
+        ZipfianGenerator ranks = zipf;
+        mt19937_64 rng(t + 1);
+        size_t hits = 0;
+        for (size_t i = 0; i < o.opsPerThread; i++) {
+            uint64_t key = loaded[o.zipfian ? ranks.next(rng)
+                                            : rng() % loaded.size()];
+            unsigned pick = rng() % 100;
+            Op op = pick < o.mix.read ? OpRead
+                    : (pick -= o.mix.read) < o.mix.insert ? OpInsert
+                    : (pick -= o.mix.insert) < o.mix.update ? OpUpdate
+                    : (pick -= o.mix.update) < o.mix.erase ? OpErase
+                                                           : OpScan;
+            if (op == OpInsert) {
+                size_t f = nextFresh.fetch_add(1, memory_order_relaxed);
+                if (f < fresh.size())
+                    key = fresh[f];
+                else
+                    op = OpRead;
+            }
+            switch (op) {
+                case OpRead:
+                    hits += tree.read(session, key);
+                    break;
+                case OpInsert:
+                    hits += tree.insert(session, key);
+                    break;
+                case OpUpdate:
+                    hits += tree.update(session, key);
+                    break;
+                case OpErase:
+                    hits += tree.erase(session, key);
+                    break;
+                case OpScan:
+                    hits += tree.scan(session, key, o.scanLength);
+                    break;
+            }
+        }
+        found += hits;
+    });
+    auto stop = chrono::steady_clock::now();
+    return chrono::duration<double>(stop - start).count();
+}
+
+template <typename Variant>
+void runScaling(const vector<uint64_t>& loaded, const vector<uint64_t>& fresh,
+                const Options& o) {
+    // One run per thread count 1, 2, 4, ... up to maxThreads
+    if (o.mix.scan && !Variant::scans) {
+        printf("%-8s skipped, no scans\n", Variant::name());
+        return;
+    }
+    Variant tree;
+    ThreadPool pool(o.maxThreads);
+    double single = 0;
+    for (unsigned threads = 1; threads <= o.maxThreads;
+         threads = threads == o.maxThreads ? threads + 1
+                                           : min(threads * 2, o.maxThreads)) {
+        tree.load(loaded, pool);
+        double secs = runMix(tree, loaded, fresh, threads, pool, o);
+        double mops = threads * o.opsPerThread / secs / 1e6;
+        if (threads == 1) single = mops;
+        printf("%-8s %8u %12zu %10.3f %10.2f %10.2f %8.2f\n", Variant::name(),
+               threads, threads * o.opsPerThread, secs, mops, mops / threads,
+               mops / single);
+    }
+}
+
+int main(int argc, char** argv) {
+    Options o;
+    size_t N = 0;                          // -N, keys loaded
+    string variant = "all";               // -T olc|rowex|sharded|all
+    KeyFileFormat format = KeyFileDetect;  // -F sosd|raw
+    string input_file;                     // -f, required
+    // Parse arguments; make sure to increment i by 2 if you consume an argument
+    for (int i = 1; i < argc;) {
+        if (string(argv[i]) == "-P") {
+            o.pin = false;
+            i++;
+        } else if (i + 1 == argc) {
+            input_file.clear();  // an option without its value
+            break;
+        } else if (string(argv[i]) == "-f") {
+            input_file = argv[i + 1];
+            i += 2;
+        } else if (string(argv[i]) == "-F") {
+            format = string(argv[i + 1]) == "sosd" ? KeyFileSOSD : KeyFileRaw;
+            i += 2;
+        } else if (string(argv[i]) == "-N") {
+            N = atoll(argv[i + 1]);
+            i += 2;
+        } else if (string(argv[i]) == "-o") {
+            o.opsPerThread = atoll(argv[i + 1]);
+            i += 2;
+        } else if (string(argv[i]) == "-t") {
+            o.maxThreads = atoi(argv[i + 1]);
+            i += 2;
+        } else if (string(argv[i]) == "-m") {
+            if (!o.mix.parse(argv[i + 1])) {
+                cerr << "bad mix " << argv[i + 1] << endl;
+                return 1;
+            }
+            i += 2;
+        } else if (string(argv[i]) == "-d") {
+            o.zipfian = string(argv[i + 1]) == "zipfian";
+            i += 2;
+        } else if (string(argv[i]) == "-z") {
+            o.theta = atof(argv[i + 1]);
+            i += 2;
+        } else if (string(argv[i]) == "-s") {
+            o.scanLength = atoi(argv[i + 1]);
+            i += 2;
+        } else if (string(argv[i]) == "-T") {
+            variant = argv[i + 1];
+            i += 2;
+        } else {
+            i++;
+        }
+    }
+    if (input_file.empty()) {
+        cerr << "usage: " << argv[0]
+             << " -f keys [-F sosd|raw] [-N loaded] [-o ops/thread]"
+             << " [-t threads] [-m a|b|c|d|e|read,insert,update,delete,scan]"
+             << " [-d uniform|zipfian] [-z theta] [-s scan length]"
+             << " [-T olc|rowex|sharded|all] [-P]" << endl;
+        return 1;
+    }
+    if (o.maxThreads == 0) o.maxThreads = 1;
+
+    KeyFile<uint64_t> file;
+    if (!file.open(input_file.c_str(), format)) {
+        cerr << "cannot read keys from " << input_file << endl;
+        return 1;
+    }
+    // Distinct keys that fit pseudo-leaves (63 bits) in random order; the
+    // first N are loaded, the others are inserted by the runs
+    vector<uint64_t> keys;
+    keys.reserve(file.size());
+    for (size_t i = 0; i < file.size(); i++)
+        if (file[i] >> 63 == 0) keys.push_back(file[i]);
+    size_t dropped = file.size() - keys.size();
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    mt19937_64 rng(42);
+    shuffle(keys.begin(), keys.end(), rng);
+    if (N == 0 || N > keys.size()) N = keys.size() / 2;
+    if (N == 0) {
+        cerr << "no keys in " << input_file << endl;
+        return 1;
+    }
+    vector<uint64_t> loaded(keys.begin(), keys.begin() + N);
+    vector<uint64_t> fresh(keys.begin() + N, keys.end());
+
+    printf("# loaded: %zu, fresh: %zu, dropped 64-bit: %zu\n", loaded.size(),
+           fresh.size(), dropped);
+    printf("# mix read/insert/update/delete/scan: %u/%u/%u/%u/%u, %s",
+           o.mix.read, o.mix.insert, o.mix.update, o.mix.erase, o.mix.scan,
+           o.zipfian ? "zipfian" : "uniform");
+    if (o.zipfian) printf(" %.2f", o.theta);
+    printf(", pinned: %s\n", o.pin ? "yes" : "no");
+    printf("%-8s %8s %12s %10s %10s %10s %8s\n", "variant", "threads", "ops",
+           "seconds", "Mops/s", "per-thread", "speedup");
+    if (variant == "olc" || variant == "all")
+        runScaling<OlcVariant>(loaded, fresh, o);
+    if (variant == "rowex" || variant == "all")
+        runScaling<RowexVariant>(loaded, fresh, o);
+    if (variant == "sharded" || variant == "all")
+        runScaling<ShardedVariant>(loaded, fresh, o);
+    return 0;
+}